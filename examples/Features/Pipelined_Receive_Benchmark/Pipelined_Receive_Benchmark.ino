@@ -0,0 +1,160 @@
+/**
+ * NuSock Pipelined Receive Benchmark
+ *
+ * This sketch measures the cost of parsing many small frames that arrive
+ * in a single TCP segment (1000 x 8-byte frames), without any network.
+ *
+ * The same segment is parsed by:
+ * 1. The NuSock frame parser on the receive buffer (Generic mode path): the
+ *    bytes are appended with appendRx() as far as the buffer takes them and
+ *    parsed with process(), consumed frames only move the read cursor.
+ * 2. The NuSock frame parser in place (LwIP path, feed() on an empty receive
+ *    buffer): the frames are parsed straight from the segment, without a copy.
+ * 3. A reference loop that moves the remaining bytes to the front of the
+ *    receive buffer after every frame (the previous receive path).
+ *
+ * The segment (8000 bytes) is allocated on the heap, use a board with enough
+ * RAM (ESP32, ESP8266, RP2040, SAMD51, STM32 etc).
+ */
+
+#include <Arduino.h>
+
+#include <NuSock.h>
+
+#define FRAME_COUNT 1000 // Frames per segment
+#define FRAME_SIZE 8     // 2 bytes header + 6 bytes payload
+#define ROUNDS 20        // Segments parsed per measurement
+
+NuSockClient ws; // Owner of the test NuClient only, never connected
+
+uint8_t *segment = nullptr;
+size_t segmentLen = 0;
+size_t received = 0;
+
+bool onFrame(void *ctx, NuClient *c, NuFrameEvent event, uint8_t *payload, size_t len)
+{
+    received++;
+    return true;
+}
+
+void buildSegment()
+{
+    segmentLen = FRAME_COUNT * FRAME_SIZE;
+    segment = (uint8_t *)malloc(segmentLen);
+    if (!segment)
+        return;
+
+    // Unmasked binary frames (server to client)
+    for (size_t i = 0; i < FRAME_COUNT; i++)
+    {
+        uint8_t *f = segment + i * FRAME_SIZE;
+        f[0] = 0x82;
+        f[1] = FRAME_SIZE - 2;
+        for (size_t j = 2; j < FRAME_SIZE; j++)
+            f[j] = (uint8_t)(i + j);
+    }
+}
+
+unsigned long runReadCursor(NuClient *c)
+{
+    unsigned long start = micros();
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        size_t pos = 0;
+        while (pos < segmentLen)
+        {
+            size_t n = c->appendRx(segment + pos, segmentLen - pos);
+            if (n == 0)
+                break;
+            pos += n;
+            NuFrameParser::process(c, false, onFrame, nullptr);
+        }
+    }
+    return (micros() - start) / ROUNDS;
+}
+
+unsigned long runInPlace(NuClient *c)
+{
+    unsigned long start = micros();
+    for (int r = 0; r < ROUNDS; r++)
+        NuFrameParser::feed(c, segment, segmentLen, false, onFrame, nullptr);
+    return (micros() - start) / ROUNDS;
+}
+
+unsigned long runMemmove(uint8_t *buf)
+{
+    unsigned long start = micros();
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        size_t rxLen = 0, pos = 0;
+        while (pos < segmentLen)
+        {
+            size_t n = segmentLen - pos;
+            if (n > MAX_WS_BUFFER - rxLen)
+                n = MAX_WS_BUFFER - rxLen;
+            memcpy(buf + rxLen, segment + pos, n);
+            rxLen += n;
+            pos += n;
+
+            while (rxLen >= 2)
+            {
+                size_t total = 2 + (buf[1] & 0x7F);
+                if (rxLen < total)
+                    break;
+                received++;
+                memmove(buf, buf + total, rxLen - total);
+                rxLen -= total;
+            }
+        }
+    }
+    return (micros() - start) / ROUNDS;
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial)
+        ;
+
+    delay(3000);
+
+    Serial.println();
+    NuSock::printLog("INFO", "NuSock Pipelined Receive Benchmark v%s\n", NUSOCK_VERSION_STR);
+
+    buildSegment();
+    uint8_t *buf = (uint8_t *)malloc(MAX_WS_BUFFER);
+    NuClient *c = new NuClient(&ws, nullptr);
+    if (!segment || !buf || !c->rxBuffer)
+    {
+        NuSock::printLog("INFO", "Not enough memory\n");
+        return;
+    }
+    c->state = NuClient::STATE_CONNECTED;
+
+    received = 0;
+    unsigned long tParser = runReadCursor(c);
+    size_t nParser = received / ROUNDS;
+
+    received = 0;
+    unsigned long tInPlace = runInPlace(c);
+    size_t nInPlace = received / ROUNDS;
+
+    received = 0;
+    unsigned long tMemmove = runMemmove(buf);
+    size_t nMemmove = received / ROUNDS;
+
+    NuSock::printLog("INFO", "%d x %d-byte frames per segment\n", FRAME_COUNT, FRAME_SIZE);
+    NuSock::printLog("INFO", "Read cursor : %lu us/segment (%d frames)\n", tParser, (int)nParser);
+    NuSock::printLog("INFO", "In place    : %lu us/segment (%d frames)\n", tInPlace, (int)nInPlace);
+    NuSock::printLog("INFO", "Memmove     : %lu us/segment (%d frames)\n", tMemmove, (int)nMemmove);
+    if (tParser > 0)
+        NuSock::printLog("INFO", "Speedup     : %lu.%02lux (read cursor vs memmove)\n", tMemmove / tParser, (tMemmove * 100 / tParser) % 100);
+
+    delete c;
+    free(buf);
+    free(segment);
+}
+
+void loop()
+{
+}
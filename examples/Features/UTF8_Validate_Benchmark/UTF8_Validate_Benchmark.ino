@@ -0,0 +1,95 @@
+/**
+ * NuSock UTF-8 Validation Benchmark
+ *
+ * This sketch measures the cost of validating text payloads as UTF-8,
+ * without any network.
+ *
+ * Three 4 KB payloads are validated:
+ * 1. ASCII (JSON telemetry).
+ * 2. Mixed (mostly ASCII with Latin-1 accents, symbols and emoji).
+ * 3. CJK (almost all 3-byte sequences).
+ *
+ * Each payload is validated by:
+ * 1. NuUTF8::validate (16 bytes per step lookup algorithm on host builds with
+ *    SSSE3/NEON, 4 bytes per step ASCII skipping on MCUs).
+ * 2. NuUTF8::validateDFA (byte at a time state machine, the reference).
+ */
+
+#include <Arduino.h>
+
+#include <NuSock.h>
+
+#define PAYLOAD_SIZE 4096 // Bytes per payload
+#define ROUNDS 50         // Validations per measurement
+
+uint8_t *payload = nullptr;
+size_t payloadLen = 0;
+
+// Repeats the pattern into the payload, without cutting a character at the end.
+void fill(const char *pattern)
+{
+    size_t n = strlen(pattern);
+    payloadLen = 0;
+    while (payloadLen + n <= PAYLOAD_SIZE)
+    {
+        memcpy(payload + payloadLen, pattern, n);
+        payloadLen += n;
+    }
+}
+
+unsigned long run(bool dfa, bool &valid)
+{
+    unsigned long start = micros();
+    for (int r = 0; r < ROUNDS; r++)
+    {
+        uint32_t state = NuUTF8::UTF8_ACCEPT;
+        valid = dfa ? NuUTF8::validateDFA(state, payload, payloadLen)
+                    : NuUTF8::validate(state, payload, payloadLen);
+        valid = valid && NuUTF8::isComplete(state);
+    }
+    return (micros() - start) / ROUNDS;
+}
+
+void measure(const char *name, const char *pattern)
+{
+    fill(pattern);
+
+    bool validFast = false, validDFA = false;
+    unsigned long tFast = run(false, validFast);
+    unsigned long tDFA = run(true, validDFA);
+
+    NuSock::printLog("INFO", "%s (%d bytes, %s)\n", name, (int)payloadLen, validFast == validDFA ? "match" : "MISMATCH");
+    NuSock::printLog("INFO", "  validate    : %lu us\n", tFast);
+    NuSock::printLog("INFO", "  validateDFA : %lu us\n", tDFA);
+    if (tFast > 0)
+        NuSock::printLog("INFO", "  Speedup     : %lu.%02lux\n", tDFA / tFast, (tDFA * 100 / tFast) % 100);
+}
+
+void setup()
+{
+    Serial.begin(115200);
+    while (!Serial)
+        ;
+
+    delay(3000);
+
+    Serial.println();
+    NuSock::printLog("INFO", "NuSock UTF-8 Validation Benchmark v%s\n", NUSOCK_VERSION_STR);
+
+    payload = (uint8_t *)malloc(PAYLOAD_SIZE);
+    if (!payload)
+    {
+        NuSock::printLog("INFO", "Not enough memory\n");
+        return;
+    }
+
+    measure("ASCII", "{\"id\":42,\"temp\":23.5,\"hum\":61,\"status\":\"ok\",\"tags\":[\"a\",\"b\"]}\n");
+    measure("Mixed", "{\"city\":\"Z\xC3\xBCrich\",\"note\":\"caf\xC3\xA9 \xE2\x82\xAC" "5\",\"mood\":\"\xF0\x9F\x98\x80\"}\n");
+    measure("CJK", "\xE4\xBD\xA0\xE5\xA5\xBD\xE4\xB8\x96\xE7\x95\x8C\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E\xED\x95\x9C\xEA\xB5\xAD\xEC\x96\xB4");
+
+    free(payload);
+}
+
+void loop()
+{
+}
@@ -10,6 +10,7 @@
 #include "NuSockConfig.h"
 #include "NuSockUtils.h"
 #include "NuSockTypes.h"
+#include "NuSockFrame.h"
 #include "vector/dynamic/DynamicVector.h"
 
 typedef void (*NuClientEventCallback)(NuClient *client, NuClientEvent event, const uint8_t *payload, size_t len);
@@ -73,11 +74,48 @@ private:
     char _path[128];
 
     NuClientEventCallback _onEvent = nullptr;
+    size_t _fragmentSize = 0;
+    NuBufferConfig _bufferConfig;
+    uint32_t _postFailures = 0;
+
+#ifdef NUSOCK_DISPATCH
+    NuEventQueue _events; // Dispatch mode: events waiting for loop()
+#endif
+
+#ifdef NUSOCK_NETWORK_TASK
+    TaskHandle_t volatile _task = nullptr; // Runs the I/O loop (startNetworkTask())
+    volatile bool _taskRunning = false;
+
+    static void networkTask(void *arg)
+    {
+        NuSockClient *self = (NuSockClient *)arg;
+        while (self->_taskRunning)
+        {
+            self->myLock.lock();
+            if (self->_internalClient)
+                self->generic_process();
+            self->myLock.unlock();
+            vTaskDelay(1);
+        }
+        self->_task = nullptr;
+        vTaskDelete(nullptr);
+    }
+#endif
 
 #ifdef NUSOCK_USE_LWIP
     struct tcp_pcb *client_pcb = nullptr;
     NuClient *_internalClient = nullptr;
     ip_addr_t server_ip;
+    NuCallbackMsg _resumeMsg; // Resumes the paused receiver on the network thread
+
+    static void static_resume(void *arg)
+    {
+        NuSockClient *self = (NuSockClient *)arg;
+        self->myLock.lock();
+        if (self->_internalClient && self->client_pcb && (self->_internalClient->rxHeld || self->_internalClient->rxPaused))
+            self->lwip_resume();
+        self->myLock.unlock();
+    }
 
     static void static_on_error(void *arg, err_t err)
     {
@@ -87,7 +125,11 @@ private:
         NuSock::printLog("DBG ", "Error Callback. Code: %d\n", (int)err);
 #endif
 
-        if (self && self->_internalClient)
+        if (!self)
+            return;
+        // stop() deletes the connection on the application task
+        self->myLock.lock();
+        if (self->_internalClient)
         {
             self->_internalClient->state = NuClient::STATE_HANDSHAKE;
             if (self->_onEvent)
@@ -97,21 +139,44 @@ private:
 #if defined(NUSOCK_DEBUG)
                 NuSock::printLog("DBG ", "Error: LwIP Error Code %d\n", (int)err);
 #endif
-                self->_onEvent(self->_internalClient, CLIENT_EVENT_ERROR, (const uint8_t *)errBuf, strlen(errBuf));
-                self->_onEvent(self->_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
+                self->emit(self->_internalClient, CLIENT_EVENT_ERROR, (const uint8_t *)errBuf, strlen(errBuf));
+                self->emit(self->_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
             }
             // PCB is freed by LwIP internally on error
             self->client_pcb = nullptr;
         }
+        self->myLock.unlock();
     }
 
     static err_t static_on_poll(void *arg, struct tcp_pcb *pcb)
     {
+        NuSockClient *self = (NuSockClient *)arg;
+        if (!self)
+            return ERR_OK;
+        // stop() deletes the connection on the application task
+        self->myLock.lock();
+        // Retry the received data the parser could not take
+        if (self->_internalClient && (self->_internalClient->rxHeld || self->_internalClient->rxPaused))
+            self->lwip_resume();
+        // Retry a flush that could not be posted
+        if (self->_internalClient && !self->_internalClient->flushMsg.queued() && self->_internalClient->txPending())
+            static_flush_client(self->_internalClient);
+        self->notifyWritable();
+        self->myLock.unlock();
         return ERR_OK;
     }
 
     static err_t static_on_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
     {
+        // Continue with the data that did not fit into the send buffer
+        NuSockClient *self = (NuSockClient *)arg;
+        if (!self)
+            return ERR_OK;
+        self->myLock.lock();
+        if (self->_internalClient && self->_internalClient->txPending())
+            static_flush_client(self->_internalClient);
+        self->notifyWritable();
+        self->myLock.unlock();
         return ERR_OK;
     }
 
@@ -160,40 +225,135 @@ private:
                 pbuf_free(p);
             return ERR_OK;
         }
+        // stop() deletes the connection on the application task
+        self->myLock.lock();
+        err_t ret = self->lwip_recv(pcb, p);
+        self->myLock.unlock();
+        return ret;
+    }
 
+    err_t lwip_recv(struct tcp_pcb *pcb, struct pbuf *p)
+    {
         if (!p)
         {
 #if defined(NUSOCK_DEBUG)
             NuSock::printLog("DBG ", "Remote closed connection (FIN).\n");
 #endif
 
-            if (self->client_pcb)
+            if (client_pcb)
             {
-                tcp_arg(self->client_pcb, nullptr);
-                tcp_close(self->client_pcb);
-                self->client_pcb = nullptr;
+                tcp_arg(client_pcb, nullptr);
+                tcp_close(client_pcb);
+                client_pcb = nullptr;
             }
-            if (self->_onEvent)
-                self->_onEvent(self->_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
+            emit(_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
             return ERR_OK;
         }
 
-        tcp_recved(pcb, p->tot_len);
+        NuClient *c = _internalClient;
+        if (!c)
+        {
+            pbuf_free(p);
+            return ERR_OK;
+        }
+        // Data is still held: refuse, lwIP keeps the pbuf and delivers it again later
+        if (c->rxHeld)
+            return ERR_MEM;
+        size_t used;
+        if (!lwip_receive(p, 0, used))
+        {
+            pbuf_free(p);
+            return ERR_OK; // Stopped
+        }
+        if (used == 0)
+            return ERR_MEM; // Nothing taken, refused as above
+        // Only the consumed bytes reopen the server's window
+        tcp_recved(pcb, used);
+        if (used < p->tot_len)
+        {
+            c->rxHeld = p;
+            c->rxHeldOffset = used;
+        }
+        else
+            pbuf_free(p);
+        return ERR_OK;
+    }
 
-        struct pbuf *ptr = p;
-        while (ptr)
+    // Continue a paused receiver once the dispatch queue has room, then parse the
+    // held data again (poll callback, resume message)
+    void lwip_resume()
+    {
+        NuClient *c = _internalClient;
+        if (c->rxPaused)
+        {
+            if (_events.full())
+                return;
+            c->rxPaused = false;
+            if (!NuFrameParser::process(c, false, frameHandler, this))
+                return;
+        }
+        if (!c->rxHeld)
+            return;
+        struct pbuf *p = c->rxHeld;
+        size_t offset = c->rxHeldOffset;
+        c->rxHeld = nullptr;
+        size_t used;
+        if (!lwip_receive(p, offset, used))
+        {
+            pbuf_free(p);
+            return;
+        }
+        if (used > 0)
+            tcp_recved(client_pcb, used);
+        if (offset + used < p->tot_len)
         {
-            if (self->_internalClient->rxLen + ptr->len <= MAX_WS_BUFFER)
+            c->rxHeld = p;
+            c->rxHeldOffset = offset + used;
+        }
+        else
+            pbuf_free(p);
+    }
+
+    // Parse a received pbuf chain from offset, used is set to the bytes consumed.
+    // Stops early when the receive buffer is full. Returns false if the client was stopped.
+    bool lwip_receive(struct pbuf *p, size_t offset, size_t &used)
+    {
+        used = 0;
+        for (struct pbuf *ptr = p; ptr; ptr = ptr->next)
+        {
+            if (offset >= ptr->len)
+            {
+                offset -= ptr->len;
+                continue;
+            }
+            // Parse each pbuf in place, the chain is freed once the callbacks have returned
+            uint8_t *data = (uint8_t *)ptr->payload + offset;
+            size_t len = ptr->len - offset;
+            offset = 0;
+            while (len > 0)
             {
-                memcpy(self->_internalClient->rxBuffer + self->_internalClient->rxLen, ptr->payload, ptr->len);
-                self->_internalClient->rxLen += ptr->len;
+                NuClient *c = _internalClient;
+                if (!c || !client_pcb)
+                    return false;
+                size_t n = 0;
+                if (c->state == NuClient::STATE_HANDSHAKE)
+                {
+                    // Keep one byte free for the terminator of the response
+                    size_t room = c->reserveRx(len);
+                    n = c->appendRx(data, room > len ? len : (room > 0 ? room - 1 : 0));
+                    if (!lwip_handshake())
+                        return false;
+                }
+                else if (!NuFrameParser::feed(c, data, len, false, frameHandler, this, &n))
+                    return false;
+                used += n;
+                if (n == 0)
+                    return true; // Buffer full
+                data += n;
+                len -= n;
             }
-            ptr = ptr->next;
         }
-        pbuf_free(p);
-
-        self->lwip_process();
-        return ERR_OK;
+        return true;
     }
 
     static void static_flush_client(void *arg)
@@ -203,28 +363,54 @@ private:
             return;
 
 #ifdef NUSOCK_USE_LWIP
-        if (c->pcb && c->txLen > 0)
+        if (!c->pcb)
+            return;
+        const uint8_t *data;
+        size_t pending;
+        // The application appends to the queues from its own task meanwhile
+        c->txLock.lock();
+        while ((data = c->txPeek(pending)) != nullptr)
         {
-            tcp_write(c->pcb, c->txBuffer, c->txLen, TCP_WRITE_FLAG_COPY);
-            tcp_output(c->pcb);
-            c->clearTx();
+            size_t send_len = tcp_sndbuf(c->pcb);
+            if (send_len > pending)
+                send_len = pending;
+            if (send_len == 0 || tcp_write(c->pcb, data, send_len, TCP_WRITE_FLAG_COPY) != ERR_OK)
+                break;
+            c->txConsume(send_len);
         }
+        c->txLock.unlock();
+        tcp_output(c->pcb);
 #endif
     }
 
+    // Post a flush unless one is queued, a burst of sends costs one callback and one tcp_output().
+    // A failed post is retried from static_on_poll.
+    void post_flush(NuClient *c)
+    {
+        if (!c->flushMsg.post())
+            _postFailures++;
+    }
+
     // Internal Connect Logic running on LwIP Thread
     static void static_internal_connect(void *arg)
     {
         NuSockClient *self = (NuSockClient *)arg;
         if (!self)
             return;
+        // The application task may stop or send meanwhile
+        self->myLock.lock();
+        self->lwip_connect();
+        self->myLock.unlock();
+    }
 
+    void lwip_connect()
+    {
         // Double check inside the thread
-        if (self->client_pcb)
+        if (client_pcb)
             return;
 
-        self->client_pcb = tcp_new();
-        if (!self->client_pcb)
+        client_pcb = tcp_new();
+        if (!client_pcb)
         {
 #if defined(NUSOCK_DEBUG)
             NuSock::printLog("DBG ", "tcp_new failed!\n");
@@ -232,18 +418,20 @@ private:
             return;
         }
 
-        if (self->_internalClient)
-            delete self->_internalClient;
-        self->_internalClient = new NuClient((NuSockServer *)nullptr, self->client_pcb);
-        self->_internalClient->state = NuClient::STATE_HANDSHAKE;
+        if (_internalClient)
+            deleteClient(_internalClient);
+        _internalClient = new NuClient((NuSockServer *)nullptr, client_pcb, _bufferConfig);
+        _internalClient->state = NuClient::STATE_HANDSHAKE;
+        _internalClient->flushMsg.init(static_flush_client, _internalClient); // On failure, flushes run from static_on_poll
+        _resumeMsg.init(static_resume, this); // On failure, the receiver resumes from static_on_poll
 
-        tcp_arg(self->client_pcb, self);
-        tcp_err(self->client_pcb, static_on_error);
-        tcp_recv(self->client_pcb, static_on_recv);
-        tcp_sent(self->client_pcb, static_on_sent);
-        tcp_poll(self->client_pcb, static_on_poll, 4);
+        tcp_arg(client_pcb, this);
+        tcp_err(client_pcb, static_on_error);
+        tcp_recv(client_pcb, static_on_recv);
+        tcp_sent(client_pcb, static_on_sent);
+        tcp_poll(client_pcb, static_on_poll, 4);
 
-        err_t err = tcp_connect(self->client_pcb, &self->server_ip, self->_port, static_on_connected);
+        err_t err = tcp_connect(client_pcb, &server_ip, _port, static_on_connected);
 
         if (err != ERR_OK)
         {
@@ -251,276 +439,279 @@ private:
             NuSock::printLog("DBG ", "Connect Call Failed: %d\n", (int)err);
 #endif
             // If connect fails immediately, we must close
-            tcp_arg(self->client_pcb, nullptr);
-            tcp_close(self->client_pcb);
-            self->client_pcb = nullptr;
+            tcp_arg(client_pcb, nullptr);
+            tcp_close(client_pcb);
+            client_pcb = nullptr;
         }
     }
 
-    void lwip_process()
+    // Check the upgrade response once it is complete. Returns false if the client was stopped.
+    bool lwip_handshake()
     {
-        if (!client_pcb || !_internalClient)
-            return;
+        NuClient *c = _internalClient;
+        if (!client_pcb || !c)
+            return false;
 
-        if (_internalClient->state == NuClient::STATE_HANDSHAKE)
+        if (c->rxLen > 0)
         {
-            if (_internalClient->rxLen > 0)
+            c->rxBuffer[c->rxLen] = 0; // rxLen < rxCap during the handshake
+            char *resp = (char *)c->rxBuffer;
+            char *respEnd = strstr(resp, "\r\n\r\n");
+            if (respEnd && strstr(resp, "101 Switching Protocols"))
             {
-                if (_internalClient->rxLen < MAX_WS_BUFFER)
-                    _internalClient->rxBuffer[_internalClient->rxLen] = 0;
-                else
-                    _internalClient->rxBuffer[MAX_WS_BUFFER - 1] = 0;
-
-                if (strstr((char *)_internalClient->rxBuffer, "101 Switching Protocols"))
-                {
-                    _internalClient->state = NuClient::STATE_CONNECTED;
-                    _internalClient->rxLen = 0;
-                    if (_onEvent)
-                        _onEvent(_internalClient, CLIENT_EVENT_CONNECTED, nullptr, 0);
-                }
-                else if (_internalClient->rxLen > 1024)
-                {
-                    stop();
-                }
+                c->state = NuClient::STATE_CONNECTED;
+                // Frames sent right behind the response stay in the buffer
+                c->consumeRx(respEnd + 4 - resp);
+                c->resizeRx(c->bufferConfig.frameBufferSize);
+                emit(c, CLIENT_EVENT_CONNECTED, nullptr, 0);
+                if (_internalClient != c)
+                    return false;
+                return NuFrameParser::process(c, false, frameHandler, this);
             }
-        }
-        else
-        {
-            // Process Loop
-            while (_internalClient->rxLen > 0)
+            else if (c->rxLen + 1 >= c->rxCap)
             {
-                if (_internalClient->rxLen < 2)
-                    return;
-
-                uint8_t *frameStart = _internalClient->rxBuffer;
-                uint8_t opcode = frameStart[0] & 0x0F;
-                bool isFin = (frameStart[0] & 0x80);
-                uint8_t lenByte = frameStart[1] & 0x7F;
-                bool isMasked = (frameStart[1] & 0x80);
-
-                // Strict checks
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                // RSV Check
-                if ((frameStart[0] & 0x70) != 0)
-                {
-                    stop();
-                    return;
-                }
-                // Strict Masking (Client MUST receive UNMASKED frames from Server)
-                if (isMasked)
-                {
-                    stop();
-                    return;
-                }
+                stop();
+                return false;
+            }
+        }
+        return true;
+    }
+#else
+    void *_genericClientRef = nullptr;
+    Client *(*_connectFunc)(void *, const char *, uint16_t) = nullptr;
+    NuClient *_internalClient = nullptr;
 #endif
 
-                size_t headerSize = 2;
-                size_t payloadLen = lenByte;
-
-                if (payloadLen == 126)
-                {
-                    if (_internalClient->rxLen < 4)
-                        return;
-                    payloadLen = (frameStart[2] << 8) | frameStart[3];
-                    headerSize += 2;
-                }
-                // (127 support omitted)
+    void generateRandomKey(char *outBuf)
+    {
+        uint8_t randomBytes[16];
+        for (int i = 0; i < 16; i++)
+            randomBytes[i] = random(0, 255);
+        NuBase64::encode(randomBytes, 16, outBuf, 32);
+    }
 
-                if (isMasked)
-                    headerSize += 4; // Should not happen if strict check passed
+    bool buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
+    {
+        uint8_t mask[4];
+        NuFrameBuilder::randomMask(mask);
+        c->txLock.lock();
+        bool queued = NuFrameBuilder::build(c, opcode, isFin, data, len, mask);
+        c->txLock.unlock();
+        return queued;
+    }
 
-                size_t totalFrameSize = headerSize + payloadLen;
-                if (_internalClient->rxLen < totalFrameSize)
-                    return;
+    bool buildMessage(NuClient *c, uint8_t opcode, const uint8_t *data, size_t len)
+    {
+        c->txLock.lock();
+        bool queued = NuFrameBuilder::buildMessage(c, opcode, data, len, _fragmentSize, true);
+        c->txLock.unlock();
+        return queued;
+    }
 
-                // Control frames
-                if (opcode >= 0x8)
-                {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                    if (!isFin || payloadLen > 125)
-                    {
-                        stop();
-                        return;
-                    }
+    // Queue a data message (or fragment) below the high watermark
+    bool sendData(uint8_t opcode, bool fragment, bool fin, const uint8_t *data, size_t len)
+    {
+        myLock.lock();
+        NuClient *c = _internalClient;
+        bool queued = false;
+        if (c)
+        {
+            // txLock: the LwIP thread flushes the same queues (the lock is recursive)
+            c->txLock.lock();
+            size_t encoded = NuFrameBuilder::encodedLength(len, fragment ? 0 : _fragmentSize, true);
+            queued = c->state == NuClient::STATE_CONNECTED && c->txAdmit(encoded);
+            if (queued)
+                queued = fragment ? buildFrame(c, opcode, fin, data, len) : buildMessage(c, opcode, data, len);
+            c->txLock.unlock();
+        }
+#ifdef NUSOCK_USE_LWIP
+        if (queued)
+            post_flush(c);
 #endif
-                    uint8_t *payload = &frameStart[headerSize]; // Server frames are unmasked
+        myLock.unlock();
+        return queued;
+    }
 
-                    // Handle Close
-                    if (opcode == 0x8)
-                    {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
-                        if (payloadLen == 1)
-                        {
-                            stop();
-                            return;
-                        }
-
-                        // We initiated close (Waiting for Echo)
-                        if (_internalClient->state == NuClient::STATE_CLOSING)
-                        {
-                            // Handshake complete
-                            stop();
-                            return;
-                        }
-
-                        // Server initiated close
-                        // Echo Close back
-                        buildFrame(_internalClient, 0x8, true, payload, payloadLen);
-                        tcpip_callback(static_flush_client, _internalClient);
+    // Queue a frame of a NuMessageWriter if its connection is still open
+    static bool writerSink(void *owner, NuClient *c, NuSharedFrame *frame, bool droppable)
+    {
+        NuSockClient *self = (NuSockClient *)owner;
+        self->myLock.lock();
+        bool queued = false;
+        if (self->_internalClient == c)
+        {
+            c->txLock.lock();
+            queued = c->state == NuClient::STATE_CONNECTED && c->queueShared(frame, droppable);
+            c->txLock.unlock();
+        }
+#ifdef NUSOCK_USE_LWIP
+        if (queued)
+            self->post_flush(c);
 #endif
-                        stop();
-                        return;
-                    }
-                    // Handle Ping
-                    else if (opcode == 0x9)
-                    {
-                        buildFrame(_internalClient, 0xA, true, payload, payloadLen); // Send Pong
-                        tcpip_callback(static_flush_client, _internalClient);
-                    }
-
-                    // Strip & Continue
-                    size_t rem = _internalClient->rxLen - totalFrameSize;
-                    if (rem > 0)
-                        memmove(_internalClient->rxBuffer, _internalClient->rxBuffer + totalFrameSize, rem);
-                    _internalClient->rxLen -= totalFrameSize;
-                    continue;
-                }
-
-                // Data frames (Streaming)
-                uint8_t *payload = &frameStart[headerSize];
+        self->myLock.unlock();
+        return queued;
+    }
 
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                // UTF-8 validation
-                bool checkUTF8 = (opcode == 0x1);
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                // Check continuations if original frame was Text
-                if (opcode == 0 && _internalClient->fragmentOpcode == 0x1)
-                    checkUTF8 = true;
+    // Delete a connection, or leave it to dispatch() while queued events refer to it
+    static void deleteClient(NuClient *c)
+    {
+#ifdef NUSOCK_DISPATCH
+        if (c->refs > 0)
+        {
+            c->detached = true;
+#ifdef NUSOCK_USE_LWIP
+            c->flushMsg.release();
+#else
+            c->client = nullptr; // Stopped already, the application may reconnect it
 #endif
-                if (checkUTF8)
-                {
-                    // Validate current fragment
-                    if (!NuUTF8::validate(_internalClient->utf8State, payload, payloadLen))
-                    {
-                        stop(); // RFC 6455 1007
-                        return;
-                    }
-
-                    // If final fragment, ensure state is complete (ACCEPT)
-                    if (isFin)
-                    {
-                        if (!NuUTF8::isComplete(_internalClient->utf8State))
-                        {
-                            stop(); // RFC 6455 1007 (Truncated UTF-8)
-                            return;
-                        }
-                        _internalClient->utf8State = 0; // Reset for next message
-                    }
-                }
+            return;
+        }
 #endif
+        delete c;
+    }
 
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                if (opcode > 0)
-                {
-                    if (_internalClient->fragmentOpcode != 0)
-                    {
-                        stop();
-                        return;
-                    }
-
-                    if (!isFin)
-                    {
-                        _internalClient->fragmentOpcode = opcode;
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_START, payload, payloadLen);
-                    }
-                    else
-                    {
-                        if (opcode == 0x1 && _onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                        else if (opcode == 0x2 && _onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                    }
-                }
-                else if (opcode == 0)
-                {
-                    if (_internalClient->fragmentOpcode == 0)
-                    {
-                        stop();
-                        return;
-                    }
-
-                    if (!isFin)
-                    {
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_CONT, payload, payloadLen);
-                    }
-                    else
-                    {
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_FIN, payload, payloadLen);
-                        _internalClient->fragmentOpcode = 0;
-                    }
-                }
-#else
-                // Legacy
-                if (opcode == 0x1 && _onEvent)
-                    _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                else if (opcode == 0x2 && _onEvent)
-                    _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_BINARY, payload, payloadLen);
+#ifdef NUSOCK_DISPATCH
+    // Run the callbacks of the queued events on the calling task (dispatch mode)
+    void dispatch()
+    {
+        // Events queued meanwhile wait for the next call
+        myLock.lock();
+        size_t n = _events.count;
+        myLock.unlock();
+        while (n-- > 0)
+        {
+            myLock.lock();
+            NuEventQueue::Item *e = _events.pop();
+            myLock.unlock();
+            if (!e)
+                break;
+            if (e->client)
+                e->publish(); // The parser may be ahead, restore the state queued with the event
+            if (_onEvent)
+                _onEvent(e->client, (NuClientEvent)e->event, e->len ? e->data() : nullptr, e->len);
+            myLock.lock();
+            NuClient *c = NuEventQueue::release(e);
+            if (c)
+                delete c;
+            myLock.unlock();
+        }
+        myLock.lock();
+        if (_events.paused && !_events.full())
+        {
+            _events.paused = false;
+#ifdef NUSOCK_USE_LWIP
+            if (!_resumeMsg.post())
+                _postFailures++; // The poll callback resumes the receiver
 #endif
-
-                // Consume
-                size_t rem = _internalClient->rxLen - totalFrameSize;
-                if (rem > 0)
-                    memmove(_internalClient->rxBuffer, _internalClient->rxBuffer + totalFrameSize, rem);
-                _internalClient->rxLen -= totalFrameSize;
-            }
+            // The network task resumes the receiver on its next pass
         }
+        myLock.unlock();
     }
-#else
-    void *_genericClientRef = nullptr;
-    Client *(*_connectFunc)(void *, const char *, uint16_t) = nullptr;
-    NuClient *_internalClient = nullptr;
 #endif
 
-    void generateRandomKey(char *outBuf)
+    // Run the event callback, or queue the event for loop() in dispatch mode
+    void emit(NuClient *c, NuClientEvent event, const uint8_t *payload, size_t len)
     {
-        uint8_t randomBytes[16];
-        for (int i = 0; i < 16; i++)
-            randomBytes[i] = random(0, 255);
-        NuBase64::encode(randomBytes, 16, outBuf, 32);
+#ifdef NUSOCK_DISPATCH
+        if (_events.enabled())
+        {
+            myLock.lock();
+            _events.push(c, event, payload, len);
+            if (c && _events.full() && c->state != NuClient::STATE_HANDSHAKE)
+            {
+                // The parser stops before the next frame, the server's window closes
+                c->rxPaused = true;
+                _events.paused = true;
+            }
+            myLock.unlock();
+            return;
+        }
+#endif
+        if (c)
+            c->publishRx();
+        if (_onEvent)
+            _onEvent(c, event, payload, len);
     }
 
-    void buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
+    // Fire WRITABLE once the blocked queue has drained to the low watermark
+    void notifyWritable()
     {
-        uint8_t mask[4];
-        for (int i = 0; i < 4; i++)
-            mask[i] = random(0, 255);
+        NuClient *c = _internalClient;
+        if (!c)
+            return;
+        c->txLock.lock();
+        bool writable = c->txWritable();
+        c->txLock.unlock();
+        if (writable)
+            emit(c, CLIENT_EVENT_WRITABLE, nullptr, 0);
+    }
 
-        // Apply FIN bit based on argument
-        uint8_t firstByte = opcode & 0x0F;
-        if (isFin)
+    // Write the pending TX data immediately
+    void flushNow(NuClient *c)
+    {
+#ifdef NUSOCK_USE_LWIP
+        static_flush_client(c);
+#else
+        if (c->client && c->client->connected())
         {
-            firstByte |= 0x80;
+            const uint8_t *data;
+            size_t len;
+            c->txLock.lock();
+            while ((data = c->txPeek(len)) != nullptr)
+            {
+                c->client->write(data, len);
+                c->txConsume(len);
+            }
+            c->txLock.unlock();
         }
-        c->appendTx(firstByte);
+#endif
+        notifyWritable();
+    }
 
-        if (len <= 125)
+    static bool frameHandler(void *ctx, NuClient *c, NuFrameEvent event, uint8_t *payload, size_t len)
+    {
+        NuSockClient *self = (NuSockClient *)ctx;
+        switch (event)
         {
-            c->appendTx((uint8_t)len | 0x80);
-        }
-        else
+        case FRAME_EVENT_PING:
+            // Send Pong
+            self->buildFrame(c, 0xA, true, payload, len);
+#ifdef NUSOCK_USE_LWIP
+            self->flushNow(c);
+#endif
+            return true;
+
+        case FRAME_EVENT_PONG:
+            return true;
+
+        case FRAME_EVENT_CLOSE:
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
+            // Server initiated close: Echo Close back.
+            // If we initiated the close, this frame completes the handshake.
+            if (c->state != NuClient::STATE_CLOSING)
+            {
+                self->buildFrame(c, 0x8, true, payload, len);
+                self->flushNow(c);
+            }
+#endif
+            self->stop();
+            return false;
+
+        case FRAME_EVENT_ERROR:
         {
-            c->appendTx(126 | 0x80);
-            c->appendTx(len >> 8);
-            c->appendTx(len & 0xFF);
+            // Tell the server why the connection is dropped (status in rxFrame.closeCode, e.g. 1009)
+            uint8_t closeFrame[125];
+            self->buildFrame(c, 0x8, true, closeFrame, NuFrameBuilder::closePayload(closeFrame, c->rxFrame.closeCode, payload, len));
+            self->flushNow(c);
+            self->emit(c, CLIENT_EVENT_ERROR, payload, len);
+            self->stop();
+            return false;
         }
 
-        for (int i = 0; i < 4; i++)
-            c->appendTx(mask[i]);
-        for (size_t j = 0; j < len; j++)
-            c->appendTx(data[j] ^ mask[j % 4]);
+        default:
+            self->emit(c, NuFrameParser::clientEvent(event), payload, len);
+            return true;
+        }
     }
 
 #ifndef NUSOCK_USE_LWIP
@@ -575,8 +766,7 @@ private:
             if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
             {
                 // Connection lost unexpectedly
-                if (_onEvent)
-                    _onEvent(_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
+                emit(_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
                 stop(); // Cleanup
             }
             return;
@@ -611,7 +801,7 @@ private:
 #endif
                         char errBuf[128];
                         snprintf(errBuf, sizeof(errBuf), "Bad Status: %.110s", lineBuf);
-                        _onEvent(_internalClient, CLIENT_EVENT_ERROR, (const uint8_t *)errBuf, strlen(errBuf));
+                        emit(_internalClient, CLIENT_EVENT_ERROR, (const uint8_t *)errBuf, strlen(errBuf));
                     }
                     stop();
                     return;
@@ -636,220 +826,55 @@ private:
 
                 if (isUpgrade && isWebsocket)
                 {
-                    if (_onEvent)
-                        _onEvent(_internalClient, CLIENT_EVENT_HANDSHAKE, nullptr, 0);
+                    emit(_internalClient, CLIENT_EVENT_HANDSHAKE, nullptr, 0);
                     _internalClient->state = NuClient::STATE_CONNECTED;
-                    if (_onEvent)
-                        _onEvent(_internalClient, CLIENT_EVENT_CONNECTED, nullptr, 0);
+                    _internalClient->resizeRx(_internalClient->bufferConfig.frameBufferSize);
+                    emit(_internalClient, CLIENT_EVENT_CONNECTED, nullptr, 0);
                 }
                 else
                 {
 #if defined(NUSOCK_DEBUG)
                     NuSock::printLog("DBG ", "Error: Missing Headers\n");
 #endif
-                    if (_onEvent)
-                        _onEvent(_internalClient, CLIENT_EVENT_ERROR, (const uint8_t *)"Missing Headers", 15);
+                    emit(_internalClient, CLIENT_EVENT_ERROR, (const uint8_t *)"Missing Headers", 15);
                     stop();
                 }
             }
         }
         else
         {
-            // Read Data
-            while (_internalClient->client->available())
-            {
-                int byte = _internalClient->client->read();
-                if (byte == -1)
-                    break;
-                if (_internalClient->rxLen < MAX_WS_BUFFER)
-                    _internalClient->rxBuffer[_internalClient->rxLen++] = (uint8_t)byte;
-            }
-
-            // Process Loop
-            while (_internalClient->rxLen > 0)
+#ifdef NUSOCK_DISPATCH
+            if (_internalClient->rxPaused)
             {
-                if (_internalClient->rxLen < 2)
-                    return;
-
-                uint8_t *frameStart = _internalClient->rxBuffer;
-                uint8_t opcode = frameStart[0] & 0x0F;
-                bool isFin = (frameStart[0] & 0x80);
-                uint8_t lenByte = frameStart[1] & 0x7F;
-                bool isMasked = (frameStart[1] & 0x80);
-
-                // Strict checks
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                if ((frameStart[0] & 0x70) != 0)
+                // Resume once loop() has made room in the dispatch queue
+                if (_events.full())
                 {
-                    stop();
-                    return;
-                }
-                if (isMasked)
-                {
-                    stop();
+                    flushNow(_internalClient);
                     return;
                 }
+                _internalClient->rxPaused = false;
+            }
 #endif
-                size_t headerSize = 2;
-                size_t payloadLen = lenByte;
-                if (payloadLen == 126)
-                {
-                    if (_internalClient->rxLen < 4)
-                        return;
-                    payloadLen = (frameStart[2] << 8) | frameStart[3];
-                    headerSize += 2;
-                }
-
-                if (isMasked)
-                    headerSize += 4;
-                size_t totalFrameSize = headerSize + payloadLen;
-                if (_internalClient->rxLen < totalFrameSize)
+            // Parse what a paused receiver left in the buffer, then read as much
+            // as the receive buffer can hold and parse it
+            if (_internalClient->rxAvailable() > 0 && !NuFrameParser::process(_internalClient, false, frameHandler, this))
+                return;
+            int pending;
+            while ((pending = _internalClient->client->available()) > 0)
+            {
+                size_t room = _internalClient->reserveRx(pending);
+                if (room == 0)
+                    break;
+                int n = _internalClient->client->read(_internalClient->rxBuffer + _internalClient->rxLen, room);
+                if (n <= 0)
+                    break;
+                _internalClient->rxLen += n;
+                if (!NuFrameParser::process(_internalClient, false, frameHandler, this))
                     return;
-
-                // Control frames
-                if (opcode >= 0x8)
-                {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                    if (!isFin || payloadLen > 125)
-                    {
-                        stop();
-                        return;
-                    }
-#endif
-                    uint8_t *payload = &frameStart[headerSize];
-
-                    if (opcode == 0x8)
-                    {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
-                        if (payloadLen == 1)
-                        {
-                            stop();
-                            return;
-                        }
-
-                        // We initiated close
-                        if (_internalClient->state == NuClient::STATE_CLOSING)
-                        {
-                            stop();
-                            return;
-                        }
-
-                        // Server initiated close
-                        buildFrame(_internalClient, 0x8, true, payload, payloadLen);
-                        if (_internalClient->txLen > 0)
-                        {
-                            _internalClient->client->write(_internalClient->txBuffer, _internalClient->txLen);
-                            _internalClient->clearTx();
-                        }
-#endif
-                        stop();
-                        return;
-                    }
-                    else if (opcode == 0x9)
-                    {
-                        buildFrame(_internalClient, 0xA, true, payload, payloadLen);
-                    }
-
-                    size_t rem = _internalClient->rxLen - totalFrameSize;
-                    if (rem > 0)
-                        memmove(_internalClient->rxBuffer, _internalClient->rxBuffer + totalFrameSize, rem);
-                    _internalClient->rxLen -= totalFrameSize;
-                    continue;
-                }
-
-                // Data frames
-                uint8_t *payload = &frameStart[headerSize];
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                // UTF-8 Validation
-                bool checkUTF8 = (opcode == 0x1);
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                if (opcode == 0 && _internalClient->fragmentOpcode == 0x1)
-                    checkUTF8 = true;
-#endif
-                if (checkUTF8)
-                {
-                    if (!NuUTF8::validate(_internalClient->utf8State, payload, payloadLen))
-                    {
-                        stop(); // 1007
-                        return;
-                    }
-
-                    if (isFin)
-                    {
-                        if (!NuUTF8::isComplete(_internalClient->utf8State))
-                        {
-                            stop(); // 1007 (Truncated)
-                            return;
-                        }
-                        _internalClient->utf8State = 0;
-                    }
-                }
-#endif
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                if (opcode > 0)
-                {
-                    if (_internalClient->fragmentOpcode != 0)
-                    {
-                        stop();
-                        return;
-                    }
-
-                    if (!isFin)
-                    {
-                        _internalClient->fragmentOpcode = opcode;
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_START, payload, payloadLen);
-                    }
-                    else
-                    {
-                        if (opcode == 0x1 && _onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                        else if (opcode == 0x2 && _onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                    }
-                }
-                else if (opcode == 0)
-                {
-                    if (_internalClient->fragmentOpcode == 0)
-                    {
-                        stop();
-                        return;
-                    }
-
-                    if (!isFin)
-                    {
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_CONT, payload, payloadLen);
-                    }
-                    else
-                    {
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_FIN, payload, payloadLen);
-                        _internalClient->fragmentOpcode = 0;
-                    }
-                }
-#else
-                if (opcode == 0x1 && _onEvent)
-                    _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                else if (opcode == 0x2 && _onEvent)
-                    _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_BINARY, payload, payloadLen);
-#endif
-
-                // Consume
-                size_t rem = _internalClient->rxLen - totalFrameSize;
-                if (rem > 0)
-                    memmove(_internalClient->rxBuffer, _internalClient->rxBuffer + totalFrameSize, rem);
-                _internalClient->rxLen -= totalFrameSize;
             }
         }
 
-        if (_internalClient->txLen > 0 && _internalClient->client && _internalClient->client->connected())
-        {
-            _internalClient->client->write(_internalClient->txBuffer, _internalClient->txLen);
-            _internalClient->clearTx();
-        }
+        flushNow(_internalClient);
     }
 #endif
 
@@ -874,6 +899,7 @@ public:
      */
     ~NuSockClient()
     {
+        stopNetworkTask();
         stop();
     }
 
@@ -951,7 +977,11 @@ public:
 
         // Dispatch to LwIP Thread to prevent ESP32 Panic
         // tcp_new() and tcp_connect() must run in the TCPIP task.
-        tcpip_callback(static_internal_connect, this);
+        if (tcpip_callback(static_internal_connect, this) != ERR_OK)
+        {
+            _postFailures++;
+            return false;
+        }
 
         return true;
     }
@@ -1001,6 +1031,8 @@ public:
         if (!_connectFunc || !_genericClientRef)
             return false;
 
+        // The network task does not serve the connection while it is replaced
+        myLock.lock();
         Client *c = _connectFunc(_genericClientRef, _host, _port);
 
         if (c && c->connected())
@@ -1008,7 +1040,7 @@ public:
             if (_internalClient)
                 stop(); // Cleanup previous if any
 
-            _internalClient = new NuClient((NuSockServer *)nullptr, c, false /* false for pointer to external client */);
+            _internalClient = new NuClient((NuSockServer *)nullptr, c, false /* false for pointer to external client */, _bufferConfig);
             strncpy(_internalClient->id, "SERVER", sizeof(_internalClient->id));
             _internalClient->state = NuClient::STATE_HANDSHAKE;
 
@@ -1031,8 +1063,10 @@ public:
             c->print("User-Agent: NuSock\r\n");
             c->print("\r\n");
 
+            myLock.unlock();
             return true;
         }
+        myLock.unlock();
         return false;
     }
 #endif
@@ -1057,11 +1091,12 @@ public:
      */
     void stop()
     {
+        myLock.lock();
         if (_internalClient)
         {
-            if (_onEvent && _internalClient->state == NuClient::STATE_CONNECTED)
+            if (_internalClient->state == NuClient::STATE_CONNECTED)
             {
-                _onEvent(_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
+                emit(_internalClient, CLIENT_EVENT_DISCONNECTED, nullptr, 0);
             }
 
 #ifndef NUSOCK_USE_LWIP
@@ -1078,10 +1113,10 @@ public:
             }
 #endif
 
-            if (_internalClient)
-                delete _internalClient;
+            deleteClient(_internalClient);
             _internalClient = nullptr;
         }
+        myLock.unlock();
     }
 
     /**
@@ -1098,7 +1133,18 @@ public:
      */
     void loop()
     {
-#ifndef NUSOCK_USE_LWIP
+#if defined(NUSOCK_NETWORK_TASK)
+        if (!_task)
+        {
+            myLock.lock();
+            if (_internalClient)
+                generic_process();
+            myLock.unlock();
+        }
+        dispatch();
+#elif defined(NUSOCK_USE_LWIP)
+        dispatch();
+#else
         if (_internalClient)
         {
             generic_process();
@@ -1113,34 +1159,193 @@ public:
     void onEvent(NuClientEventCallback cb) { _onEvent = cb; }
 
     /**
-     * @brief Send a text message to the server.
-     * @param msg Null-terminated string to send.
+     * @brief Enable automatic fragmentation of large messages.
+     * Messages sent with send() that are larger than the fragment size are split into
+     * a first frame and continuation frames, so large payloads can be sent without
+     * sendFragmentStart/Cont/Fin.
+     * @param fragmentSize Maximum payload per frame, 0 to disable (default).
+     * NUSOCK_FRAGMENT_SIZE sizes the frames to the transport (TCP MSS on LwIP).
+     */
+    void setFragmentSize(size_t fragmentSize) { _fragmentSize = fragmentSize; }
+
+    /**
+     * @brief Set the buffer sizes and the message size limit of this client.
+     * Applies to connections opened afterwards.
+     * @param config Handshake and frame receive buffer sizes, maximum message size
+     * (0 = no limit) and initial transmit buffer capacity. frameBufferSize is
+     * raised to NUSOCK_MIN_FRAME_BUFFER (139 bytes) if smaller.
      */
-    void send(const char *msg)
+    void setBufferConfig(const NuBufferConfig &config)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            buildFrame(_internalClient, 0x1, true, (const uint8_t *)msg, strlen(msg));
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, _internalClient);
+        _bufferConfig = config;
+        if (_bufferConfig.frameBufferSize < NUSOCK_MIN_FRAME_BUFFER)
+            _bufferConfig.frameBufferSize = NUSOCK_MIN_FRAME_BUFFER;
+    }
+
+    /**
+     * @brief Get the buffer configuration of this client.
+     */
+    const NuBufferConfig &getBufferConfig() const { return _bufferConfig; }
+
+    /**
+     * @brief Get the number of flush/connect requests that could not be posted to the
+     * network thread (LwIP mode, always 0 otherwise). A failed flush is retried from
+     * the poll callback, a failed connect makes connect() return false.
+     */
+    uint32_t getPostFailures() const { return _postFailures; }
+
+    /**
+     * @brief Run the event callbacks from loop() instead of the network thread (LwIP mode).
+     * The lwIP thread then only parses the received data and queues the events with a
+     * copy of their payload, loop() runs the callbacks on the application task, so a
+     * slow callback does not stall the TCP/IP stack. Once the queued payloads reach
+     * maxBytes, receiving is paused and the server is slowed down by the TCP window
+     * until loop() has caught up. Each event is queued with its NuClient::rxStream
+     * and fragmentOpcode, they are restored when it is dispatched.
+     * In Generic mode the callbacks run from loop() anyway, the queue is used by the
+     * network task (see startNetworkTask()).
+     * @param maxBytes Payload bytes queued before receiving is paused, 0 to disable (default).
+     */
+    void setDispatchQueue(size_t maxBytes)
+    {
+#ifdef NUSOCK_DISPATCH
+        myLock.lock();
+        _events.limit = maxBytes;
+        myLock.unlock();
+#else
+        (void)maxBytes;
+#endif
+    }
+
+    /**
+     * @brief Run the I/O loop of the connection in its own FreeRTOS task (ESP32).
+     * The task reads, parses and writes; the events are queued with the dispatch queue
+     * (NUSOCK_DISPATCH_QUEUE_SIZE bytes unless setDispatchQueue() was called) and loop()
+     * only runs their callbacks, each with the NuClient::rxStream and fragmentOpcode it
+     * was queued with, while the task parses ahead. Messages sent from the application
+     * are queued and written by the task. connect() still runs on the calling task.
+     * In LwIP mode the TCP/IP thread is already the network task (its core is set by
+     * CONFIG_LWIP_TCPIP_TASK_AFFINITY), only the dispatch queue is enabled.
+     * @param core Core the task is pinned to, tskNO_AFFINITY (or a core the chip does
+     * not have) to let the scheduler choose.
+     * @param priority FreeRTOS priority of the task.
+     * @param stackSize Stack size of the task in bytes.
+     * @return true if the task is running, false if it could not be created or the
+     * platform has no network task.
+     */
+    bool startNetworkTask(int core = NUSOCK_TASK_CORE, uint8_t priority = NUSOCK_TASK_PRIORITY, uint32_t stackSize = NUSOCK_TASK_STACK_SIZE)
+    {
+#ifdef NUSOCK_DISPATCH
+        myLock.lock();
+        if (!_events.enabled())
+            _events.limit = NUSOCK_DISPATCH_QUEUE_SIZE;
+        myLock.unlock();
 #endif
+#if defined(NUSOCK_NETWORK_TASK)
+        if (_task)
+            return true;
+        if (core < 0 || core >= portNUM_PROCESSORS)
+            core = tskNO_AFFINITY;
+        _taskRunning = true;
+        TaskHandle_t task = nullptr;
+        if (xTaskCreatePinnedToCore(networkTask, "NuSockClient", stackSize, this, priority, &task, core) != pdPASS)
+        {
+            _taskRunning = false;
+            return false;
         }
+        _task = task;
+        return true;
+#elif defined(NUSOCK_USE_LWIP)
+        (void)core;
+        (void)priority;
+        (void)stackSize;
+        return true;
+#else
+        (void)core;
+        (void)priority;
+        (void)stackSize;
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Stop the network task and wait until it has finished its pass.
+     * loop() serves the connection again afterwards. Called by the destructor.
+     */
+    void stopNetworkTask()
+    {
+#ifdef NUSOCK_NETWORK_TASK
+        if (!_task || xTaskGetCurrentTaskHandle() == _task)
+            return;
+        _taskRunning = false;
+        while (_task)
+            vTaskDelay(1);
+#endif
+    }
+
+    /**
+     * @brief Send a text message to the server.
+     * @param msg Null-terminated string to send.
+     * @return true if the message was queued.
+     * @return false if not connected, above the high watermark (CLIENT_EVENT_WRITABLE
+     * follows once the queue drains) or memory is low.
+     */
+    bool send(const char *msg)
+    {
+        return sendData(0x1, false, true, (const uint8_t *)msg, strlen(msg));
     }
 
     /**
      * @brief Send a binary message to the server.
      * @param data Pointer to the data buffer.
      * @param len Length of the data to send.
+     * @return true if the message was queued (see send(const char *)).
      */
-    void send(const uint8_t *data, size_t len)
+    bool send(const uint8_t *data, size_t len)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
+        return sendData(0x2, false, true, data, len);
+    }
+
+    /**
+     * @brief Start a message that is written with print() or printf().
+     * The output is encoded and masked in place into the frame (see NuMessageWriter)
+     * and sent as continuation frames when it exceeds the fragment size
+     * (setFragmentSize(), NUSOCK_FRAGMENT_SIZE if not set). The message is sent by end().
+     * @param isBinary true for a Binary message, false for Text.
+     * @return NuMessageWriter The writer, false if not connected or above the high watermark.
+     */
+    NuMessageWriter message(bool isBinary = false)
+    {
+        myLock.lock();
+        NuClient *c = _internalClient;
+        bool ready = false;
+        if (c)
         {
-            buildFrame(_internalClient, 0x2, true, data, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, _internalClient);
-#endif
+            c->txLock.lock();
+            ready = c->state == NuClient::STATE_CONNECTED && c->txAdmit(0);
+            c->txLock.unlock();
         }
+        size_t blockSize = ready ? c->txQueue.blockSize : 0;
+        myLock.unlock();
+        if (!ready)
+            return NuMessageWriter();
+        return NuMessageWriter(this, c, writerSink, isBinary ? 0x2 : 0x1, _fragmentSize ? _fragmentSize : NUSOCK_FRAGMENT_SIZE, blockSize, true);
+    }
+
+    /**
+     * @brief Send a formatted text message to the server.
+     * The text is formatted directly into the frame, without a separate buffer.
+     * @param format printf() format string.
+     * @return true if the message was queued (see send(const char *)).
+     */
+    bool sendf(const char *format, ...)
+    {
+        NuMessageWriter writer = message();
+        va_list args;
+        va_start(args, format);
+        writer.vprintf(format, args);
+        va_end(args);
+        return writer.end();
     }
 
     /**
@@ -1148,51 +1353,36 @@ public:
      * @param payload The first chunk of data.
      * @param len Length of the data chunk.
      * @param isBinary If true, starts a Binary message (Opcode 0x2). If false, starts Text (Opcode 0x1).
+     * @return true if the fragment was queued (a rejected fragment can be sent again later).
      */
-    void sendFragmentStart(const uint8_t *payload, size_t len, bool isBinary)
+    bool sendFragmentStart(const uint8_t *payload, size_t len, bool isBinary)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = false, Opcode = 0x1 (Text) or 0x2 (Binary)
-            buildFrame(_internalClient, isBinary ? 0x2 : 0x1, false, payload, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, _internalClient);
-#endif
-        }
+        // FIN = false, Opcode = 0x1 (Text) or 0x2 (Binary)
+        return sendData(isBinary ? 0x2 : 0x1, true, false, payload, len);
     }
 
     /**
      * @brief Send a middle fragment (FIN=0, Opcode=0x0).
      * @param payload The data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentCont(const uint8_t *payload, size_t len)
+    bool sendFragmentCont(const uint8_t *payload, size_t len)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = false, Opcode = 0x0 (Continuation)
-            buildFrame(_internalClient, 0x0, false, payload, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, _internalClient);
-#endif
-        }
+        // FIN = false, Opcode = 0x0 (Continuation)
+        return sendData(0x0, true, false, payload, len);
     }
 
     /**
      * @brief Finish a fragmented message (FIN=1, Opcode=0x0).
      * @param payload The last data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentFin(const uint8_t *payload, size_t len)
+    bool sendFragmentFin(const uint8_t *payload, size_t len)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = true, Opcode = 0x0 (Continuation)
-            buildFrame(_internalClient, 0x0, true, payload, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, _internalClient);
-#endif
-        }
+        // FIN = true, Opcode = 0x0 (Continuation)
+        return sendData(0x0, true, true, payload, len);
     }
 
     /**
@@ -1201,13 +1391,15 @@ public:
      */
     void sendPing(const char *msg = "")
     {
+        myLock.lock();
         if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
         {
             buildFrame(_internalClient, 0x9, true, (const uint8_t *)msg, strlen(msg));
 #ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, _internalClient);
+            post_flush(_internalClient);
 #endif
         }
+        myLock.unlock();
     }
 
     /**
@@ -1217,6 +1409,7 @@ public:
      */
     void close(uint16_t code = 1000, const char *reason = "")
     {
+        myLock.lock();
         if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
         {
             uint8_t payload[128];
@@ -1235,12 +1428,13 @@ public:
             buildFrame(_internalClient, 0x8, true, payload, 2 + reasonLen);
 
 #ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, _internalClient);
+            post_flush(_internalClient);
 #endif
 
             // Update state
             _internalClient->state = NuClient::STATE_CLOSING;
         }
+        myLock.unlock();
     }
 };
 
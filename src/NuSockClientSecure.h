@@ -12,6 +12,7 @@
 #include "NuSockConfig.h"
 #include "NuSockUtils.h"
 #include "NuSockTypes.h"
+#include "NuSockFrame.h"
 #include <esp_tls.h>
 #include <esp_crt_bundle.h> // Required for default public server trust
 #include <fcntl.h>
@@ -36,6 +37,8 @@ private:
     const char *_ca_cert = nullptr;
 
     NuClientSecureEventCallback _onEvent = nullptr;
+    size_t _fragmentSize = 0;
+    NuBufferConfig _bufferConfig;
 
     // Internal State
     esp_tls_t *_tls = nullptr;
@@ -51,256 +54,130 @@ private:
     }
 
     // Helper: Build and append a WebSocket frame to the TX buffer
-    void buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
+    bool buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
     {
         uint8_t mask[4];
-        for (int i = 0; i < 4; i++)
-            mask[i] = random(0, 255);
+        NuFrameBuilder::randomMask(mask);
+        return NuFrameBuilder::build(c, opcode, isFin, data, len, mask);
+    }
 
-        // Apply FIN bit based on argument
-        uint8_t firstByte = opcode & 0x0F;
-        if (isFin)
-        {
-            firstByte |= 0x80;
-        }
-        c->appendTx(firstByte);
+    bool buildMessage(NuClient *c, uint8_t opcode, const uint8_t *data, size_t len)
+    {
+        return NuFrameBuilder::buildMessage(c, opcode, data, len, _fragmentSize, true);
+    }
 
-        if (len <= 125)
-        {
-            c->appendTx((uint8_t)len | 0x80); // Mask bit set
-        }
-        else
-        {
-            c->appendTx(126 | 0x80); // Mask bit set
-            c->appendTx(len >> 8);
-            c->appendTx(len & 0xFF);
-        }
-        for (int i = 0; i < 4; i++)
-            c->appendTx(mask[i]);
-        for (size_t j = 0; j < len; j++)
-            c->appendTx(data[j] ^ mask[j % 4]);
+    // Queue a data message (or fragment) below the high watermark, written by loop()
+    bool sendData(uint8_t opcode, bool fragment, bool fin, const uint8_t *data, size_t len)
+    {
+        NuClient *c = _internalClient;
+        size_t encoded = NuFrameBuilder::encodedLength(len, fragment ? 0 : _fragmentSize, true);
+        if (!c || c->state != NuClient::STATE_CONNECTED || !c->txAdmit(encoded))
+            return false;
+        return fragment ? buildFrame(c, opcode, fin, data, len) : buildMessage(c, opcode, data, len);
+    }
+
+    // Queue a frame of a NuMessageWriter if its connection is still open
+    static bool writerSink(void *owner, NuClient *c, NuSharedFrame *frame, bool droppable)
+    {
+        NuSockClientSecure *self = (NuSockClientSecure *)owner;
+        bool queued = self->_internalClient == c && c->state == NuClient::STATE_CONNECTED && c->queueShared(frame, droppable);
+        return queued;
     }
 
-    void process_rx_buffer()
+    // Fire WRITABLE once the blocked queue has drained to the low watermark
+    void notifyWritable()
+    {
+        if (_internalClient && _internalClient->txWritable() && _onEvent)
+            _onEvent(_internalClient, CLIENT_EVENT_WRITABLE, nullptr, 0);
+    }
+
+    void process_handshake()
     {
         if (!_internalClient)
             return;
 
-        if (_internalClient->state == NuClient::STATE_HANDSHAKE)
+        if (_internalClient->rxLen > 0)
         {
-            if (_internalClient->rxLen > 0)
+            if (_internalClient->rxLen < _internalClient->rxCap)
+                _internalClient->rxBuffer[_internalClient->rxLen] = 0;
+            else
+                _internalClient->rxBuffer[_internalClient->rxCap - 1] = 0;
+
+            if (strstr((char *)_internalClient->rxBuffer, "101 Switching Protocols"))
             {
-                if (_internalClient->rxLen < MAX_WS_BUFFER)
-                    _internalClient->rxBuffer[_internalClient->rxLen] = 0;
-                else
-                    _internalClient->rxBuffer[MAX_WS_BUFFER - 1] = 0;
-
-                if (strstr((char *)_internalClient->rxBuffer, "101 Switching Protocols"))
-                {
-                    _internalClient->state = NuClient::STATE_CONNECTED;
-                    _internalClient->rxLen = 0;
-                    if (_onEvent)
-                        _onEvent(_internalClient, CLIENT_EVENT_CONNECTED, nullptr, 0);
-                }
-                else if (_internalClient->rxLen > 1024)
-                {
-                    stop();
-                }
+                _internalClient->state = NuClient::STATE_CONNECTED;
+                _internalClient->rxLen = 0;
+                _internalClient->resizeRx(_internalClient->bufferConfig.frameBufferSize);
+                if (_onEvent)
+                    _onEvent(_internalClient, CLIENT_EVENT_CONNECTED, nullptr, 0);
+            }
+            else if (_internalClient->rxLen >= _internalClient->rxCap)
+            {
+                stop();
             }
         }
-        else
+    }
+
+    // Write the pending TX data immediately
+    void flushNow(NuClient *c)
+    {
+        const uint8_t *data;
+        size_t len;
+        while ((data = c->txPeek(len)) != nullptr)
         {
-            // Standard WS Frame Parsing
-            while (_internalClient->rxLen >= 2)
-            {
-                uint8_t opcode = _internalClient->rxBuffer[0] & 0x0F;
-                bool isFin = (_internalClient->rxBuffer[0] & 0x80);
-                uint8_t lenByte = _internalClient->rxBuffer[1] & 0x7F;
-                bool isMasked = (_internalClient->rxBuffer[1] & 0x80);
-
-                // Strict checks
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                // RSV check
-                if ((_internalClient->rxBuffer[0] & 0x70) != 0)
-                {
-                    stop();
-                    return;
-                }
-                // Strict Masking (Client MUST receive UNMASKED)
-                if (isMasked)
-                {
-                    stop();
-                    return;
-                }
-#endif
+            int sent = esp_tls_conn_write(_tls, data, len);
+            if (sent <= 0)
+                break;
+            c->txConsume(sent);
+        }
+        notifyWritable();
+    }
 
-                size_t headerSize = 2;
-                size_t payloadLen = lenByte;
-
-                if (payloadLen == 126)
-                {
-                    if (_internalClient->rxLen < 4)
-                        return;
-                    payloadLen = (_internalClient->rxBuffer[2] << 8) | _internalClient->rxBuffer[3];
-                    headerSize += 2;
-                }
-
-                if (isMasked)
-                    headerSize += 4;
-
-                size_t totalFrameSize = headerSize + payloadLen;
-                if (_internalClient->rxLen < totalFrameSize)
-                    return;
-
-                // Control frames
-                if (opcode >= 0x8)
-                {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                    if (!isFin || payloadLen > 125)
-                    {
-                        stop();
-                        return;
-                    }
-#endif
-                    uint8_t *payload = &_internalClient->rxBuffer[headerSize]; // Unmasked from Server
+    static bool frameHandler(void *ctx, NuClient *c, NuFrameEvent event, uint8_t *payload, size_t len)
+    {
+        NuSockClientSecure *self = (NuSockClientSecure *)ctx;
+        c->publishRx();
+        switch (event)
+        {
+        case FRAME_EVENT_PING:
+            self->buildFrame(c, 0xA, true, payload, len);
+            return true;
 
-                    if (opcode == 0x8)
-                    {
+        case FRAME_EVENT_PONG:
+            return true;
+
+        case FRAME_EVENT_CLOSE:
 #if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
-                        if (payloadLen == 1)
-                        {
-                            stop();
-                            return;
-                        }
-
-                        // We initiated close
-                        if (_internalClient->state == NuClient::STATE_CLOSING)
-                        {
-                            stop();
-                            return;
-                        }
-
-                        // Server initiated close
-                        // Echo
-                        buildFrame(_internalClient, 0x8, true, payload, payloadLen);
-                        if (_internalClient->txLen > 0)
-                        {
-                            esp_tls_conn_write(_tls, _internalClient->txBuffer, _internalClient->txLen);
-                            _internalClient->clearTx();
-                        }
-#endif
-                        stop();
-                        return;
-                    }
-                    else if (opcode == 0x9)
-                    {
-                        buildFrame(_internalClient, 0xA, true, payload, payloadLen);
-                    }
-
-                    size_t rem = _internalClient->rxLen - totalFrameSize;
-                    if (rem > 0)
-                        memmove(_internalClient->rxBuffer, _internalClient->rxBuffer + totalFrameSize, rem);
-                    _internalClient->rxLen -= totalFrameSize;
-                    continue;
-                }
-
-                // Data frames
-                uint8_t *payload = &_internalClient->rxBuffer[headerSize];
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                // UTF-8 validation
-                bool checkUTF8 = (opcode == 0x1);
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                if (opcode == 0 && _internalClient->fragmentOpcode == 0x1)
-                    checkUTF8 = true;
+            // Server initiated close: Echo.
+            // If we initiated the close, this frame completes the handshake.
+            if (c->state != NuClient::STATE_CLOSING)
+            {
+                self->buildFrame(c, 0x8, true, payload, len);
+                self->flushNow(c);
+            }
 #endif
+            self->stop();
+            return false;
 
-                if (checkUTF8)
-                {
-                    if (!NuUTF8::validate(_internalClient->utf8State, payload, payloadLen))
-                    {
-#if defined(NUSOCK_DEBUG)
-                        NuSock::printLog("DBG ", "Error: Invalid UTF-8 sequence\n");
-#endif
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_ERROR, (uint8_t *)"Invalid UTF-8 sequence", 22);
-                        stop(); // Close Code 1007
-                        return;
-                    }
-
-                    if (isFin)
-                    {
-                        if (!NuUTF8::isComplete(_internalClient->utf8State))
-                        {
+        case FRAME_EVENT_ERROR:
+        {
 #if defined(NUSOCK_DEBUG)
-                            NuSock::printLog("DBG ", "Error: Incomplete UTF-8 at FIN\n");
-#endif
-                            if (_onEvent)
-                                _onEvent(_internalClient, CLIENT_EVENT_ERROR, (uint8_t *)"Incomplete UTF-8 at FIN", 23);
-                            stop(); // Close Code 1007
-                            return;
-                        }
-                        _internalClient->utf8State = 0; // Reset for next message
-                    }
-                }
-#endif
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                if (opcode > 0)
-                {
-                    if (_internalClient->fragmentOpcode != 0)
-                    {
-                        stop();
-                        return;
-                    }
-
-                    if (!isFin)
-                    {
-                        _internalClient->fragmentOpcode = opcode;
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_START, payload, payloadLen);
-                    }
-                    else
-                    {
-                        if (opcode == 0x1 && _onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                        else if (opcode == 0x2 && _onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                    }
-                }
-                else if (opcode == 0)
-                {
-                    if (_internalClient->fragmentOpcode == 0)
-                    {
-                        stop();
-                        return;
-                    }
-
-                    if (!isFin)
-                    {
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_CONT, payload, payloadLen);
-                    }
-                    else
-                    {
-                        if (_onEvent)
-                            _onEvent(_internalClient, CLIENT_EVENT_FRAGMENT_FIN, payload, payloadLen);
-                        _internalClient->fragmentOpcode = 0;
-                    }
-                }
-#else
-                if (opcode == 0x1 && _onEvent)
-                    _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                else if (opcode == 0x2 && _onEvent)
-                    _onEvent(_internalClient, CLIENT_EVENT_MESSAGE_BINARY, payload, payloadLen);
+            NuSock::printLog("DBG ", "Error: %.*s\n", (int)len, (const char *)payload);
 #endif
+            // Tell the server why the connection is dropped (status in rxFrame.closeCode, e.g. 1009)
+            uint8_t closeFrame[125];
+            self->buildFrame(c, 0x8, true, closeFrame, NuFrameBuilder::closePayload(closeFrame, c->rxFrame.closeCode, payload, len));
+            self->flushNow(c);
+            if (self->_onEvent)
+                self->_onEvent(c, CLIENT_EVENT_ERROR, payload, len);
+            self->stop();
+            return false;
+        }
 
-                // Consume
-                size_t rem = _internalClient->rxLen - totalFrameSize;
-                if (rem > 0)
-                    memmove(_internalClient->rxBuffer, _internalClient->rxBuffer + totalFrameSize, rem);
-                _internalClient->rxLen -= totalFrameSize;
-            }
+        default:
+            if (self->_onEvent)
+                self->_onEvent(c, NuFrameParser::clientEvent(event), payload, len);
+            return true;
         }
     }
 
@@ -350,6 +227,35 @@ public:
      */
     void onEvent(NuClientSecureEventCallback cb) { _onEvent = cb; }
 
+    /**
+     * @brief Enable automatic fragmentation of large messages.
+     * Messages sent with send() that are larger than the fragment size are split into
+     * a first frame and continuation frames, so large payloads can be sent without
+     * sendFragmentStart/Cont/Fin.
+     * @param fragmentSize Maximum payload per frame, 0 to disable (default).
+     * NUSOCK_FRAGMENT_SIZE sizes the frames to the transport (TCP MSS on LwIP).
+     */
+    void setFragmentSize(size_t fragmentSize) { _fragmentSize = fragmentSize; }
+
+    /**
+     * @brief Set the buffer sizes and the message size limit of this client.
+     * Applies to connections opened afterwards.
+     * @param config Handshake and frame receive buffer sizes, maximum message size
+     * (0 = no limit) and initial transmit buffer capacity. frameBufferSize is
+     * raised to NUSOCK_MIN_FRAME_BUFFER (139 bytes) if smaller.
+     */
+    void setBufferConfig(const NuBufferConfig &config)
+    {
+        _bufferConfig = config;
+        if (_bufferConfig.frameBufferSize < NUSOCK_MIN_FRAME_BUFFER)
+            _bufferConfig.frameBufferSize = NUSOCK_MIN_FRAME_BUFFER;
+    }
+
+    /**
+     * @brief Get the buffer configuration of this client.
+     */
+    const NuBufferConfig &getBufferConfig() const { return _bufferConfig; }
+
     /**
      * @brief Establish the Secure WebSocket connection (WSS).
      * Initiates the SSL handshake using esp_tls and performs the WebSocket Upgrade.
@@ -415,9 +321,9 @@ public:
 
 // WSS doesn't use LwIP PCB directly in this class, so we pass nullptr
 #ifdef NUSOCK_USE_LWIP
-        _internalClient = new NuClient((NuSockServer *)nullptr, (struct tcp_pcb *)nullptr);
+        _internalClient = new NuClient((NuSockServer *)nullptr, (struct tcp_pcb *)nullptr, _bufferConfig);
 #else
-        _internalClient = new NuClient((NuSockServer *)nullptr, (Client *)nullptr, false);
+        _internalClient = new NuClient((NuSockServer *)nullptr, (Client *)nullptr, false, _bufferConfig);
 #endif
         _internalClient->state = NuClient::STATE_HANDSHAKE;
 
@@ -487,16 +393,17 @@ public:
         if (ret > 0)
         {
             // Data received
-            if (_internalClient->rxLen + ret <= MAX_WS_BUFFER)
+            if (_internalClient->state == NuClient::STATE_HANDSHAKE)
             {
-                memcpy(_internalClient->rxBuffer + _internalClient->rxLen, buf, ret);
-                _internalClient->rxLen += ret;
-                process_rx_buffer();
-
-                // Safety: If processing caused a disconnect/stop, return immediately
-                if (!_internalClient)
-                    return;
+                _internalClient->appendRx((const uint8_t *)buf, ret);
+                process_handshake();
             }
+            else
+                NuFrameParser::feed(_internalClient, (uint8_t *)buf, ret, false, frameHandler, this);
+
+            // Safety: If processing caused a disconnect/stop, return immediately
+            if (!_internalClient)
+                return;
         }
         else if (ret == 0)
         {
@@ -509,46 +416,81 @@ public:
             return;
         }
 
-        if (_internalClient && _internalClient->txLen > 0)
+        const uint8_t *data;
+        size_t pending;
+        while (_internalClient && (data = _internalClient->txPeek(pending)) != nullptr)
         {
-            int sent = esp_tls_conn_write(_tls, _internalClient->txBuffer, _internalClient->txLen);
+            int sent = esp_tls_conn_write(_tls, data, pending);
             if (sent > 0)
             {
-                _internalClient->clearTx(); // Assuming full write for simplicity
+                _internalClient->txConsume(sent);
+                continue;
             }
-            else if (sent != ESP_TLS_ERR_SSL_WANT_READ && sent != ESP_TLS_ERR_SSL_WANT_WRITE)
+            if (sent != ESP_TLS_ERR_SSL_WANT_READ && sent != ESP_TLS_ERR_SSL_WANT_WRITE)
             {
 #if defined(NUSOCK_DEBUG)
                 NuSock::printLog("DBG ", "Write Error\n");
 #endif
                 // Optional: stop() on write error
             }
+            break;
         }
+        notifyWritable();
     }
 
     /**
      * @brief Send a text message to the server.
      * @param msg Null-terminated string to send.
+     * @return true if the message was queued.
+     * @return false if not connected, above the high watermark (CLIENT_EVENT_WRITABLE
+     * follows once the queue drains) or memory is low.
      */
-    void send(const char *msg)
+    bool send(const char *msg)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            buildFrame(_internalClient, 0x1, true, (const uint8_t *)msg, strlen(msg));
-        }
+        return sendData(0x1, false, true, (const uint8_t *)msg, strlen(msg));
     }
 
     /**
      * @brief Send a binary message to the server.
      * @param data Pointer to the data buffer.
      * @param len Length of the data to send.
+     * @return true if the message was queued (see send(const char *)).
      */
-    void send(const uint8_t *data, size_t len)
+    bool send(const uint8_t *data, size_t len)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            buildFrame(_internalClient, 0x2, true, data, len);
-        }
+        return sendData(0x2, false, true, data, len);
+    }
+
+    /**
+     * @brief Start a message that is written with print() or printf().
+     * The output is encoded and masked in place into the frame (see NuMessageWriter)
+     * and sent as continuation frames when it exceeds the fragment size
+     * (setFragmentSize(), NUSOCK_FRAGMENT_SIZE if not set). The message is sent by end().
+     * @param isBinary true for a Binary message, false for Text.
+     * @return NuMessageWriter The writer, false if not connected or above the high watermark.
+     */
+    NuMessageWriter message(bool isBinary = false)
+    {
+        NuClient *c = _internalClient;
+        if (!c || c->state != NuClient::STATE_CONNECTED || !c->txAdmit(0))
+            return NuMessageWriter();
+        return NuMessageWriter(this, c, writerSink, isBinary ? 0x2 : 0x1, _fragmentSize ? _fragmentSize : NUSOCK_FRAGMENT_SIZE, c->txQueue.blockSize, true);
+    }
+
+    /**
+     * @brief Send a formatted text message to the server.
+     * The text is formatted directly into the frame, without a separate buffer.
+     * @param format printf() format string.
+     * @return true if the message was queued (see send(const char *)).
+     */
+    bool sendf(const char *format, ...)
+    {
+        NuMessageWriter writer = message();
+        va_list args;
+        va_start(args, format);
+        writer.vprintf(format, args);
+        va_end(args);
+        return writer.end();
     }
     /**
      * @brief Start a fragmented message(FIN = 0).
@@ -556,42 +498,36 @@ public:
      * @param len Length of the data chunk.
      * @param isBinary If true,
      * starts a Binary message(Opcode 0x2).If false, starts Text(Opcode 0x1).
+     * @return true if the fragment was queued (a rejected fragment can be sent again later).
      */
-    void sendFragmentStart(const uint8_t *payload, size_t len, bool isBinary)
+    bool sendFragmentStart(const uint8_t *payload, size_t len, bool isBinary)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = false, Opcode = 0x1 (Text) or 0x2 (Binary)
-            buildFrame(_internalClient, isBinary ? 0x2 : 0x1, false, payload, len);
-        }
+        // FIN = false, Opcode = 0x1 (Text) or 0x2 (Binary)
+        return sendData(isBinary ? 0x2 : 0x1, true, false, payload, len);
     }
 
     /**
      * @brief Send a middle fragment (FIN=0, Opcode=0x0).
      * @param payload The data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentCont(const uint8_t *payload, size_t len)
+    bool sendFragmentCont(const uint8_t *payload, size_t len)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = false, Opcode = 0x0 (Continuation)
-            buildFrame(_internalClient, 0x0, false, payload, len);
-        }
+        // FIN = false, Opcode = 0x0 (Continuation)
+        return sendData(0x0, true, false, payload, len);
     }
 
     /**
      * @brief Finish a fragmented message (FIN=1, Opcode=0x0).
      * @param payload The last data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentFin(const uint8_t *payload, size_t len)
+    bool sendFragmentFin(const uint8_t *payload, size_t len)
     {
-        if (_internalClient && _internalClient->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = true, Opcode = 0x0 (Continuation)
-            buildFrame(_internalClient, 0x0, true, payload, len);
-        }
+        // FIN = true, Opcode = 0x0 (Continuation)
+        return sendData(0x0, true, true, payload, len);
     }
 
     /**
@@ -628,11 +564,7 @@ public:
             buildFrame(_internalClient, 0x8, true, payload, 2 + reasonLen);
 
             // Flush immediate for close
-            if (_internalClient->txLen > 0)
-            {
-                esp_tls_conn_write(_tls, _internalClient->txBuffer, _internalClient->txLen);
-                _internalClient->clearTx();
-            }
+            flushNow(_internalClient);
 
             _internalClient->state = NuClient::STATE_CLOSING;
         }
@@ -25,7 +25,8 @@ extern "C"
 
 #include <schedule.h>
 
-// ESP8266 Polyfill: LwIP runs in NO_SYS mode.
+// ESP8266 Polyfill: LwIP runs in NO_SYS mode. Used by NuSockClient::connect(),
+// the recurring posts use NuCallbackMsg.
 static inline err_t tcpip_callback(void (*f)(void *), void *ctx)
 {
     if (schedule_function([f, ctx]()
@@ -45,6 +46,260 @@ static inline err_t tcpip_callback(void (*f)(void *), void *ctx)
 #include "mbedtls/sha1.h"
 #include "mbedtls/base64.h"
 #endif
+
+// Size of the ring that holds posted callback messages on ESP8266
+#ifndef NUSOCK_CALLBACK_RING_SIZE
+#define NUSOCK_CALLBACK_RING_SIZE 32
+#endif
+
+/**
+ * @brief Preallocated callback message for the network thread.
+ * Allocated once and posted without allocation: tcpip_callbackmsg_trycallback()
+ * on ESP32, a fixed ring drained from the scheduler on ESP8266. A message is
+ * queued at most once, posting it again while queued is a no-op.
+ * post(), queued() and release() may be called from any task. If the owner is
+ * released while the message is queued, the message is cancelled and freed when
+ * it is dequeued. If the callback is running on another task, release() waits
+ * until it has returned, so the owner can be deleted right after release().
+ */
+class NuCallbackMsg
+{
+public:
+    uint32_t failures = 0; // Posts that could not be queued
+
+    NuCallbackMsg() {}
+    NuCallbackMsg(const NuCallbackMsg &) = delete;
+    NuCallbackMsg &operator=(const NuCallbackMsg &) = delete;
+    ~NuCallbackMsg() { release(); }
+
+    /**
+     * @brief Allocate the message.
+     * @return false if out of memory.
+     */
+    bool init(void (*fn)(void *), void *ctx)
+    {
+        release();
+        Slot *s = (Slot *)malloc(sizeof(Slot));
+        if (!s)
+            return false;
+        s->fn = fn;
+        s->ctx = ctx;
+        s->queued = false;
+        s->cancelled = false;
+        s->running = false;
+        s->waiting = false;
+        s->runner = nullptr;
+#if defined(ESP8266)
+        if (!ring().started)
+            ring().started = schedule_recurrent_function_us([]()
+                                                            { drain(); return true; }, 0);
+#else
+        s->msg = tcpip_callbackmsg_new(run, s);
+        if (!s->msg)
+        {
+            free(s);
+            return false;
+        }
+#endif
+        enter();
+        _slot = s;
+        leave();
+        return true;
+    }
+
+    /**
+     * @brief Queue the callback unless it is already queued.
+     * @return false if it could not be queued (counted in failures).
+     */
+    bool post()
+    {
+        enter();
+        Slot *s = _slot;
+        bool queue = s && !s->queued;
+        if (queue)
+            s->queued = true; // The slot is not freed while queued
+        leave();
+        if (!s)
+        {
+            failures++;
+            return false;
+        }
+        if (!queue)
+            return true;
+#if defined(ESP8266)
+        Ring &r = ring();
+        bool ok = r.started && r.count < NUSOCK_CALLBACK_RING_SIZE;
+        if (ok)
+        {
+            r.items[(r.head + r.count) % NUSOCK_CALLBACK_RING_SIZE] = s;
+            r.count++;
+        }
+#else
+        bool ok = tcpip_callbackmsg_trycallback(s->msg) == ERR_OK;
+#endif
+        if (!ok)
+        {
+            enter();
+            s->queued = false;
+            bool dead = orphaned(s); // Released meanwhile
+            leave();
+            if (dead)
+                destroy(s);
+            failures++;
+        }
+        return ok;
+    }
+
+    /**
+     * @brief Check if the message is waiting to run.
+     */
+    bool queued() const
+    {
+        enter();
+        bool q = _slot && _slot->queued;
+        leave();
+        return q;
+    }
+
+    void release()
+    {
+        enter();
+        Slot *s = _slot;
+        _slot = nullptr;
+        bool dead = false, wait = false;
+        if (s)
+        {
+            s->cancelled = true;
+            // Released from another task while the callback runs: wait for it.
+            // From the callback itself, run() frees the slot when it returns.
+            wait = s->waiting = s->running && s->runner != self();
+            dead = orphaned(s);
+        }
+        leave();
+        if (dead)
+            destroy(s);
+        if (!wait)
+            return; // Freed, or freed by run()
+#if !defined(ESP8266)
+        for (;;)
+        {
+            enter();
+            bool running = s->running;
+            if (!running)
+            {
+                s->waiting = false;
+                dead = orphaned(s);
+            }
+            leave();
+            if (!running)
+                break;
+            vTaskDelay(1);
+        }
+        if (dead)
+            destroy(s);
+#endif
+    }
+
+private:
+    // The flags are changed under a critical section, the slot is freed by whoever
+    // finds it cancelled and no longer queued, running or waited for (orphaned()).
+    struct Slot
+    {
+        void (*fn)(void *);
+        void *ctx;
+        bool queued;
+        bool cancelled;
+        bool running;
+        bool waiting; // release() waits for the running callback
+        void *runner; // Task running the callback
+#if !defined(ESP8266)
+        struct tcpip_callback_msg *msg;
+#endif
+    };
+    Slot *_slot = nullptr;
+
+    static bool orphaned(const Slot *s) { return s->cancelled && !s->queued && !s->running && !s->waiting; }
+
+#if defined(ESP8266)
+    // Single-threaded: the scheduler, the lwIP callbacks and loop() do not preempt each other
+    static void enter() {}
+    static void leave() {}
+    static void *self() { return nullptr; }
+#else
+    static portMUX_TYPE &mux()
+    {
+        static portMUX_TYPE m = portMUX_INITIALIZER_UNLOCKED;
+        return m;
+    }
+    static void enter() { portENTER_CRITICAL(&mux()); }
+    static void leave() { portEXIT_CRITICAL(&mux()); }
+    static void *self() { return (void *)xTaskGetCurrentTaskHandle(); }
+#endif
+
+    static void run(void *arg)
+    {
+        Slot *s = (Slot *)arg;
+        enter();
+        s->queued = false;
+        bool cancelled = s->cancelled;
+        if (!cancelled)
+        {
+            s->running = true;
+            s->runner = self();
+        }
+        leave();
+        if (cancelled)
+        {
+            destroy(s); // Not waited for, nothing else refers to it
+            return;
+        }
+        s->fn(s->ctx); // May release the owner
+        enter();
+        s->running = false;
+        bool dead = orphaned(s);
+        leave();
+        if (dead)
+            destroy(s);
+    }
+
+    static void destroy(Slot *s)
+    {
+#if !defined(ESP8266)
+        tcpip_callbackmsg_delete(s->msg);
+#endif
+        free(s);
+    }
+
+#if defined(ESP8266)
+    struct Ring
+    {
+        Slot *items[NUSOCK_CALLBACK_RING_SIZE];
+        size_t head;
+        size_t count;
+        bool started;
+    };
+
+    static Ring &ring()
+    {
+        static Ring r = {};
+        return r;
+    }
+
+    // Runs the messages queued so far (messages posted meanwhile wait for the next pass)
+    static void drain()
+    {
+        Ring &r = ring();
+        for (size_t n = r.count; n > 0 && r.count > 0; n--)
+        {
+            Slot *s = r.items[r.head];
+            r.head = (r.head + 1) % NUSOCK_CALLBACK_RING_SIZE;
+            r.count--;
+            run(s);
+        }
+    }
+#endif
+};
+
 #else
 // Generic (SAMD, STM32, RP2040, etc)
 #include <Client.h>
@@ -57,6 +312,90 @@ static inline err_t tcpip_callback(void (*f)(void *), void *ctx)
 
 #endif
 
+// Default receive buffer size per client (see NuBufferConfig for per-instance settings)
+#ifndef MAX_WS_BUFFER
 #define MAX_WS_BUFFER 1024
+#endif
+
+// Smallest frame receive buffer: a maximal frame header (2 + 8 length + 4 mask)
+// plus the largest control frame payload (125), so control frames always fit
+#define NUSOCK_MIN_FRAME_BUFFER (2 + 8 + 4 + 125)
+
+// Size of the blocks that hold the outgoing frames of a client (see NuBufferConfig)
+#ifndef NUSOCK_TX_BLOCK_SIZE
+#define NUSOCK_TX_BLOCK_SIZE 512
+#endif
+
+// Size of the blocks that hold the outgoing control frames (Ping, Pong, Close) of a client
+#ifndef NUSOCK_TX_CONTROL_BLOCK_SIZE
+#define NUSOCK_TX_CONTROL_BLOCK_SIZE 128
+#endif
+
+// Flash (PROGMEM) is not readable through a RAM pointer on AVR and ESP8266: queued
+// flash payloads (NuPreparedMessage) are copied in chunks of this size when sent.
+#if defined(__AVR__) || defined(ESP8266)
+#define NUSOCK_PROGMEM_COPY
+#endif
+
+#ifndef NUSOCK_PROGMEM_CHUNK_SIZE
+#define NUSOCK_PROGMEM_CHUNK_SIZE 64
+#endif
+
+// Number of drained transmit blocks each client keeps for reuse
+#ifndef NUSOCK_TX_POOL_BLOCKS
+#define NUSOCK_TX_POOL_BLOCKS 2
+#endif
+
+// Define NUSOCK_LWIP_ZERO_COPY to pass the queued frames to tcp_write() without copying
+// them into lwIP. The frames are then kept until the peer has acknowledged them.
+#if defined(NUSOCK_LWIP_ZERO_COPY) && !defined(NUSOCK_USE_LWIP)
+#undef NUSOCK_LWIP_ZERO_COPY
+#endif
+
+// Number of lwIP poll intervals (about one second each) a closed connection waits
+// for its zero-copy frames to be acknowledged before it is aborted.
+#ifndef NUSOCK_LWIP_LINGER_POLLS
+#define NUSOCK_LWIP_LINGER_POLLS 10
+#endif
+
+// Payload size of the frames produced by automatic fragmentation when
+// setFragmentSize(NUSOCK_FRAGMENT_SIZE) is used (one frame per TCP segment on LwIP).
+#ifndef NUSOCK_FRAGMENT_SIZE
+#if defined(NUSOCK_USE_LWIP) && defined(TCP_MSS)
+#define NUSOCK_FRAGMENT_SIZE (TCP_MSS - 8)
+#else
+#define NUSOCK_FRAGMENT_SIZE MAX_WS_BUFFER
+#endif
+#endif
+
+// Generic mode on ESP32 can run the I/O loop in its own FreeRTOS task (startNetworkTask()).
+// In LwIP mode the TCP/IP thread is already the network task.
+#if defined(ESP32) && !defined(NUSOCK_USE_LWIP) && !defined(NUSOCK_NO_NETWORK_TASK)
+#define NUSOCK_NETWORK_TASK
+#endif
+
+// The events are queued for loop() by the network thread or task (see NuEventQueue)
+#if defined(NUSOCK_USE_LWIP) || defined(NUSOCK_NETWORK_TASK)
+#define NUSOCK_DISPATCH
+#endif
+
+// Default stack size (bytes), priority and core of the network task
+#ifndef NUSOCK_TASK_STACK_SIZE
+#define NUSOCK_TASK_STACK_SIZE 4096
+#endif
+
+#ifndef NUSOCK_TASK_PRIORITY
+#define NUSOCK_TASK_PRIORITY 3
+#endif
+
+#ifndef NUSOCK_TASK_CORE
+#define NUSOCK_TASK_CORE 0
+#endif
+
+// Payload bytes the network task queues for loop() before receiving is paused,
+// used by startNetworkTask() when setDispatchQueue() was not called
+#ifndef NUSOCK_DISPATCH_QUEUE_SIZE
+#define NUSOCK_DISPATCH_QUEUE_SIZE 8192
+#endif
 
 #endif
\ No newline at end of file
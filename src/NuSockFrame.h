@@ -0,0 +1,1074 @@
+/**
+ * SPDX-FileCopyrightText: 2025 Suwatchai K. <suwatchai@outlook.com>
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef NUSOCK_FRAME_H
+#define NUSOCK_FRAME_H
+
+#include "NuSockConfig.h"
+#include "NuSockUtils.h"
+#include "NuSockTypes.h"
+#include <stdarg.h>
+
+/**
+ * @brief Events produced by the frame parser.
+ * Each server/client maps these onto its own event type and transport actions.
+ */
+enum NuFrameEvent
+{
+    FRAME_EVENT_TEXT,           // Complete text message
+    FRAME_EVENT_BINARY,         // Complete binary message
+    FRAME_EVENT_FRAGMENT_START, // First frame of a fragmented message
+    FRAME_EVENT_FRAGMENT_CONT,  // Middle frame of a fragmented message
+    FRAME_EVENT_FRAGMENT_FIN,   // Last frame of a fragmented message
+    FRAME_EVENT_PING,           // Ping received (payload must be echoed in a Pong)
+    FRAME_EVENT_PONG,           // Pong received
+    FRAME_EVENT_CLOSE,          // Close frame received (payload is the status code and reason)
+    FRAME_EVENT_ERROR,          // Protocol error (payload is the reason, status in rxFrame.closeCode)
+    FRAME_EVENT_STREAM_CHUNK    // Payload chunk of a frame larger than the receive buffer (see NuClient::rxStream)
+};
+
+/**
+ * @brief Frame event handler.
+ * @return true to continue parsing, false if the connection is being dropped
+ * (the NuClient may already be deleted and must not be accessed).
+ */
+typedef bool (*NuFrameHandler)(void *ctx, NuClient *c, NuFrameEvent event, uint8_t *payload, size_t len);
+
+/**
+ * @brief Incremental WebSocket frame parser shared by all servers and clients.
+ * Decodes frames from the client's receive buffer, resuming from the state kept in
+ * NuClient::rxFrame, and reports them to the owner through a NuFrameHandler.
+ */
+class NuFrameParser
+{
+public:
+    /**
+     * @brief Parse all complete frames currently held in the receive buffer.
+     * @param c The client whose rxBuffer is parsed.
+     * @param isServer true if the parser runs on the server side (incoming frames are masked).
+     * @param handler Callback receiving the frame events.
+     * @param ctx User context passed to the handler.
+     * @return true if the connection is still alive.
+     * @return false if the connection was dropped by the handler.
+     */
+    static bool process(NuClient *c, bool isServer, NuFrameHandler handler, void *ctx)
+    {
+        while (c->rxBuffer)
+        {
+            size_t used = 0;
+            if (!parse(c, c->rxData(), c->rxAvailable(), used, isServer, handler, ctx))
+                return false;
+            if (used == 0)
+            {
+                // A frame that is not streamed (control frame) must fit into the buffer
+                if (!c->rxPaused && c->rxAvailable() == c->rxCap)
+                    return fail(c, handler, ctx, "Buffer Full", 1009);
+                return true; // Wait for more data
+            }
+
+            // Consume frame (moves the read cursor, no copy)
+            c->consumeRx(used);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Parse received bytes, in place where possible.
+     * While the receive buffer is empty, the frames (and stream chunks) contained
+     * in data are unmasked and reported straight from it, without copying. Only the
+     * bytes of a frame that continues in the next chunk (e.g. a frame straddling
+     * two pbufs) are copied to the receive buffer and parsed from there.
+     * The caller keeps data valid until feed() returns (LwIP: the pbuf is freed afterwards).
+     * Bytes the receive buffer cannot take are left unconsumed, the caller keeps them
+     * and feeds them again later (LwIP: they are not acknowledged to the peer).
+     * @param data Received bytes, modified in place (unmasking).
+     * @param consumed Set to the number of bytes consumed (optional).
+     * @return true if the connection is still alive.
+     * @return false if the connection was dropped by the handler.
+     */
+    static bool feed(NuClient *c, uint8_t *data, size_t len, bool isServer, NuFrameHandler handler, void *ctx, size_t *consumed = nullptr)
+    {
+        size_t total = len;
+        while (len > 0 && c->rxBuffer && c->rxAvailable() == 0)
+        {
+            size_t used = 0;
+            if (!parse(c, data, len, used, isServer, handler, ctx))
+                return false;
+            if (used == 0)
+                break; // Incomplete frame, buffered below
+            data += used;
+            len -= used;
+        }
+
+        while (len > 0)
+        {
+            size_t n = c->appendRx(data, len);
+            if (n == 0)
+                break; // Buffer full, the rest is fed again later
+            data += n;
+            len -= n;
+            if (!process(c, isServer, handler, ctx))
+                return false;
+        }
+        if (consumed)
+            *consumed = total - len;
+        return true;
+    }
+
+    /**
+     * @brief Map a data frame event to the server event type.
+     */
+    static NuServerEvent serverEvent(NuFrameEvent event)
+    {
+        switch (event)
+        {
+        case FRAME_EVENT_TEXT:
+            return SERVER_EVENT_MESSAGE_TEXT;
+        case FRAME_EVENT_BINARY:
+            return SERVER_EVENT_MESSAGE_BINARY;
+        case FRAME_EVENT_FRAGMENT_START:
+            return SERVER_EVENT_FRAGMENT_START;
+        case FRAME_EVENT_FRAGMENT_CONT:
+            return SERVER_EVENT_FRAGMENT_CONT;
+        case FRAME_EVENT_FRAGMENT_FIN:
+            return SERVER_EVENT_FRAGMENT_FIN;
+        case FRAME_EVENT_STREAM_CHUNK:
+            return SERVER_EVENT_STREAM_CHUNK;
+        default:
+            return SERVER_EVENT_ERROR;
+        }
+    }
+
+    /**
+     * @brief Map a data frame event to the client event type.
+     */
+    static NuClientEvent clientEvent(NuFrameEvent event)
+    {
+        switch (event)
+        {
+        case FRAME_EVENT_TEXT:
+            return CLIENT_EVENT_MESSAGE_TEXT;
+        case FRAME_EVENT_BINARY:
+            return CLIENT_EVENT_MESSAGE_BINARY;
+        case FRAME_EVENT_FRAGMENT_START:
+            return CLIENT_EVENT_FRAGMENT_START;
+        case FRAME_EVENT_FRAGMENT_CONT:
+            return CLIENT_EVENT_FRAGMENT_CONT;
+        case FRAME_EVENT_FRAGMENT_FIN:
+            return CLIENT_EVENT_FRAGMENT_FIN;
+        case FRAME_EVENT_STREAM_CHUNK:
+            return CLIENT_EVENT_STREAM_CHUNK;
+        default:
+            return CLIENT_EVENT_ERROR;
+        }
+    }
+
+private:
+    // Parse the next frame (or stream chunk) at buf, resuming from the state kept in
+    // c->rxFrame. Sets used to the bytes to consume, 0 if more data is needed (the
+    // header bytes of an incomplete frame stay at buf). Returns false if the
+    // connection was dropped.
+    static bool parse(NuClient *c, uint8_t *buf, size_t avail, size_t &used, bool isServer, NuFrameHandler handler, void *ctx)
+    {
+        NuFrameState &f = c->rxFrame;
+        used = 0;
+
+        if (c->rxPaused)
+            return true; // Resumed later, the data stays unconsumed
+
+        if (f.stage == NuFrameState::STAGE_HEADER)
+        {
+            if (avail < 2)
+                return true; // Wait for header
+
+            f.fin = (buf[0] & 0x80);
+            f.opcode = buf[0] & 0x0F;
+            f.masked = (buf[1] & 0x80);
+            uint8_t lenByte = buf[1] & 0x7F;
+            f.headerSize = 2;
+
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
+            // RSV bits must be 0 (no extensions negotiated)
+            if ((buf[0] & 0x70) != 0)
+                return fail(c, handler, ctx, "RSV Error", 1002);
+
+            // Client to server frames must be masked, server to client frames must not
+            if (f.masked != isServer)
+                return fail(c, handler, ctx, "Mask Error", 1002);
+#else
+            (void)isServer;
+#endif
+
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
+            // Control frames cannot be fragmented or > 125 bytes
+            if (f.opcode >= 0x8 && (!f.fin || lenByte > 125))
+                return fail(c, handler, ctx, "Control Err", 1002);
+
+            // Reserved opcodes
+            if ((f.opcode > 0x2 && f.opcode < 0x8) || f.opcode > 0xA)
+                return fail(c, handler, ctx, "Opcode Error", 1002);
+#endif
+
+            f.payloadLen = lenByte;
+            f.lenBytes = (lenByte == 126) ? 2 : (lenByte == 127 ? 8 : 0);
+            if (!f.lenBytes && !checkSize(c, handler, ctx))
+                return false;
+            f.stage = f.lenBytes ? NuFrameState::STAGE_LENGTH : (f.masked ? NuFrameState::STAGE_MASK : NuFrameState::STAGE_PAYLOAD);
+        }
+
+        if (f.stage == NuFrameState::STAGE_LENGTH)
+        {
+            if (avail < (size_t)f.headerSize + f.lenBytes)
+                return true;
+
+            // Extended length, 16 or 64 bit in network byte order
+            uint64_t len64 = 0;
+            for (uint8_t i = 0; i < f.lenBytes; i++)
+                len64 = (len64 << 8) | buf[f.headerSize + i];
+
+            // The most significant bit must be 0, and the length must be addressable
+            if ((len64 >> 63) || len64 > (uint64_t)SIZE_MAX)
+                return fail(c, handler, ctx, "Frame Too Large", 1009);
+
+            f.payloadLen = (size_t)len64;
+            f.headerSize += f.lenBytes;
+            if (!checkSize(c, handler, ctx))
+                return false;
+            f.stage = f.masked ? NuFrameState::STAGE_MASK : NuFrameState::STAGE_PAYLOAD;
+        }
+
+        if (f.stage == NuFrameState::STAGE_MASK)
+        {
+            if (avail < (size_t)f.headerSize + 4)
+                return true;
+
+            memcpy(f.mask, buf + f.headerSize, 4);
+            f.headerSize += 4;
+            f.stage = NuFrameState::STAGE_PAYLOAD;
+        }
+
+        // Data frames that can never fit in the receive buffer are streamed:
+        // the header is dropped and the payload is delivered as it arrives.
+        if (f.streaming || (f.opcode < 0x8 && (size_t)f.headerSize + f.payloadLen > c->rxCap))
+        {
+            size_t skip = 0;
+            if (!f.streaming)
+            {
+                skip = f.headerSize;
+                f.streaming = true;
+            }
+
+            size_t n = f.payloadLen - f.offset;
+            if (n > avail - skip)
+                n = avail - skip;
+            if (n > 0 && !dispatchChunk(c, buf + skip, n, handler, ctx))
+                return false;
+
+            used = skip + n; // Header only if no payload has arrived yet
+            f.offset += n;
+            if (f.offset == f.payloadLen)
+                f.reset();
+            return true;
+        }
+
+        size_t totalFrameSize = f.headerSize + f.payloadLen;
+        if (avail < totalFrameSize)
+            return true; // Wait for full payload
+
+        if (!dispatch(c, buf + f.headerSize, f.payloadLen, handler, ctx))
+            return false;
+
+        used = totalFrameSize;
+        f.reset();
+        return true;
+    }
+
+    static bool fail(NuClient *c, NuFrameHandler handler, void *ctx, const char *reason, uint16_t code)
+    {
+        c->rxFrame.closeCode = code;
+        handler(ctx, c, FRAME_EVENT_ERROR, (uint8_t *)reason, strlen(reason));
+        return false;
+    }
+
+    // Message size limit (NuBufferConfig::maxMessageSize), per frame and across the
+    // fragments of a message. Checked as soon as the length is decoded, before any
+    // payload is buffered.
+    static bool checkSize(NuClient *c, NuFrameHandler handler, void *ctx)
+    {
+        const NuFrameState &f = c->rxFrame;
+        size_t limit = c->bufferConfig.maxMessageSize;
+        if (limit == 0 || f.opcode > 0x2)
+            return true; // No limit, control or ignored frame
+
+        size_t prior = (f.opcode == 0 && c->rxFrame.fragmentOpcode) ? c->rxMessageLen : 0;
+        if (f.payloadLen > limit || prior > limit - f.payloadLen)
+            return fail(c, handler, ctx, "Message Too Big", 1009);
+
+        c->rxMessageLen = prior + f.payloadLen;
+        return true;
+    }
+
+    // Fragmentation state validation of a data frame.
+    // Returns 1 if the frame is accepted, 0 if it is ignored, -1 on protocol error (connection dropped).
+    static int acceptData(NuClient *c, NuFrameHandler handler, void *ctx)
+    {
+        const NuFrameState &f = c->rxFrame;
+
+        if (f.opcode > 0x2)
+            return 0; // Unknown data frame, ignored
+
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
+        // Nested message or orphan continuation
+        if ((f.opcode > 0) == (c->rxFrame.fragmentOpcode != 0))
+        {
+            fail(c, handler, ctx, "Frag Error", 1002);
+            return -1;
+        }
+#else
+        (void)handler;
+        (void)ctx;
+        if (f.opcode == 0)
+            return 0; // Legacy: continuation frames are ignored
+#endif
+        return 1;
+    }
+
+    // Unmask a payload (or a chunk of it starting at phase). Text payloads are
+    // validated as UTF-8 in the same pass. Returns false on invalid UTF-8.
+    static bool unmask(NuClient *c, uint8_t *payload, size_t len, size_t phase, bool text)
+    {
+        const NuFrameState &f = c->rxFrame;
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
+        if (text)
+            return NuUTF8::unmaskValidate(c->utf8State, payload, len, f.masked ? f.mask : nullptr, phase);
+#else
+        (void)text;
+#endif
+        if (f.masked)
+            NuMask::apply(payload, len, f.mask, phase);
+        return true;
+    }
+
+    // Validates a chunk of a streamed (masked) data frame and reports it to the handler.
+    static bool dispatchChunk(NuClient *c, uint8_t *chunk, size_t len, NuFrameHandler handler, void *ctx)
+    {
+        const NuFrameState &f = c->rxFrame;
+        bool first = (f.offset == 0);
+        bool last = (f.offset + len == f.payloadLen);
+
+        // Frame level checks are done once, on the first chunk
+        if (first)
+        {
+            int accepted = acceptData(c, handler, ctx);
+            if (accepted < 0)
+                return false;
+            if (accepted == 0)
+            {
+                c->rxFrame.stream.opcode = 0; // Ignore the whole frame
+                return true;
+            }
+            c->rxFrame.stream.opcode = f.opcode ? f.opcode : c->rxFrame.fragmentOpcode;
+        }
+        else if (c->rxFrame.stream.opcode == 0)
+            return true;
+
+        bool text = (c->rxFrame.stream.opcode == 0x1);
+        if (first && text && f.opcode != 0)
+            c->utf8State = NuUTF8::UTF8_ACCEPT; // New message
+
+        // Mask phase continues from the previous chunk
+        if (!unmask(c, chunk, len, f.offset, text))
+            return fail(c, handler, ctx, "Invalid UTF-8", 1007);
+
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
+        if (text && last && f.fin && !NuUTF8::isComplete(c->utf8State))
+            return fail(c, handler, ctx, "Truncated UTF-8", 1007);
+#endif
+
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
+        if (first && f.opcode > 0 && !f.fin)
+            c->rxFrame.fragmentOpcode = f.opcode; // Mark start
+#endif
+
+        c->rxFrame.stream.fin = f.fin;
+        c->rxFrame.stream.offset = f.offset;
+        c->rxFrame.stream.total = f.payloadLen;
+        c->rxFrame.stream.final = last;
+
+        if (!handler(ctx, c, FRAME_EVENT_STREAM_CHUNK, chunk, len))
+            return false;
+
+        if (last && f.fin)
+            c->rxFrame.fragmentOpcode = 0; // Mark end
+        return true;
+    }
+
+    // Validates a complete (masked) frame and reports it to the handler.
+    static bool dispatch(NuClient *c, uint8_t *payload, size_t len, NuFrameHandler handler, void *ctx)
+    {
+        const NuFrameState &f = c->rxFrame;
+
+        // Control frames (OpCode >= 0x8)
+        if (f.opcode >= 0x8)
+        {
+            unmask(c, payload, len, 0, false);
+
+            if (f.opcode == 0x8)
+            {
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
+                // Protocol Error: Payload length 1 is illegal (must be 0 or >= 2)
+                if (len == 1)
+                    return fail(c, handler, ctx, "Close Error", 1002);
+#endif
+                handler(ctx, c, FRAME_EVENT_CLOSE, payload, len);
+                return false;
+            }
+            if (f.opcode == 0x9)
+                return handler(ctx, c, FRAME_EVENT_PING, payload, len);
+            if (f.opcode == 0xA)
+                return handler(ctx, c, FRAME_EVENT_PONG, payload, len);
+            return true; // Unknown control frame, ignored
+        }
+
+        int accepted = acceptData(c, handler, ctx);
+        if (accepted <= 0)
+            return accepted == 0;
+
+        uint8_t messageOpcode = f.opcode ? f.opcode : c->rxFrame.fragmentOpcode;
+
+        // Strict UTF-8 validation (incremental across fragments) is fused with unmasking
+        bool text = (messageOpcode == 0x1);
+        if (text && f.opcode != 0)
+            c->utf8State = NuUTF8::UTF8_ACCEPT; // New message
+
+        if (!unmask(c, payload, len, 0, text))
+            return fail(c, handler, ctx, "Invalid UTF-8", 1007);
+
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
+        // If final fragment, ensure state is complete (ACCEPT)
+        if (text && f.fin && !NuUTF8::isComplete(c->utf8State))
+            return fail(c, handler, ctx, "Truncated UTF-8", 1007);
+#endif
+
+        NuFrameEvent event;
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
+        if (f.opcode > 0)
+        {
+            if (!f.fin)
+            {
+                c->rxFrame.fragmentOpcode = f.opcode; // Mark start
+                event = FRAME_EVENT_FRAGMENT_START;
+            }
+            else
+                event = (f.opcode == 0x1) ? FRAME_EVENT_TEXT : FRAME_EVENT_BINARY;
+        }
+        else
+            event = f.fin ? FRAME_EVENT_FRAGMENT_FIN : FRAME_EVENT_FRAGMENT_CONT;
+#else
+        event = (messageOpcode == 0x1) ? FRAME_EVENT_TEXT : FRAME_EVENT_BINARY;
+#endif
+
+        if (!handler(ctx, c, event, payload, len))
+            return false;
+
+        if (event == FRAME_EVENT_FRAGMENT_FIN)
+            c->rxFrame.fragmentOpcode = 0; // Mark end
+
+        return true;
+    }
+};
+
+/**
+ * @brief Frame builder shared by all servers and clients.
+ * Appends a complete frame to the client's transmit queue with a single
+ * reservation: the header and the payload are copied (or mask-copied) in bulk
+ * into the queue blocks.
+ */
+class NuFrameBuilder
+{
+public:
+    /**
+     * @brief Append a frame to the transmit queue.
+     * @param c The client whose txQueue (ctrlQueue for control frames) receives the frame.
+     * @param opcode Frame opcode.
+     * @param fin FIN bit.
+     * @param data Payload.
+     * @param len Payload length.
+     * @param mask 4-byte masking key (client to server frames), nullptr for unmasked frames.
+     * @return true if the frame was queued.
+     * @return false if out of memory (nothing is queued).
+     */
+    static bool build(NuClient *c, uint8_t opcode, bool fin, const uint8_t *data, size_t len, const uint8_t *mask = nullptr)
+    {
+        uint8_t header[14];
+        size_t headerSize = writeHeader(header, opcode, fin, len, mask);
+
+        // Control frames have their own queue, sent ahead of the data at a frame boundary
+        NuTxQueue &q = (opcode & 0x08) ? c->ctrlQueue : c->txQueue;
+        if (!q.reserve(headerSize + len))
+            return false;
+
+        append(q, header, headerSize, nullptr);
+        append(q, data, len, mask);
+        if (opcode == 0x8)
+            c->txCloseQueued = true;
+        return true;
+    }
+
+    /**
+     * @brief Append a message, split into fragments when it is larger than fragmentSize.
+     * The first frame carries the opcode, the following ones are continuation
+     * frames and the last one has the FIN bit set.
+     * @param fragmentSize Maximum payload per frame, 0 to always send a single frame.
+     * @param masked true to mask each frame with a new random key (client to server).
+     * @return true if all frames were queued.
+     */
+    static bool buildMessage(NuClient *c, uint8_t opcode, const uint8_t *data, size_t len, size_t fragmentSize, bool masked)
+    {
+        uint8_t mask[4];
+        size_t offset = 0;
+        do
+        {
+            size_t n = fragment(len, offset, fragmentSize);
+
+            if (masked)
+                randomMask(mask);
+            if (!build(c, offset == 0 ? opcode : 0x0, offset + n == len, data + offset, n, masked ? mask : nullptr))
+                return false;
+            offset += n;
+        } while (offset < len);
+        return true;
+    }
+
+    /**
+     * @brief Get the encoded size of a message, the frame headers (and masking keys)
+     * of all its fragments included, as queued by buildMessage().
+     * @param fragmentSize Maximum payload per frame, 0 for a single frame.
+     * @param masked Client frames carry a 4-byte masking key.
+     */
+    static size_t encodedLength(size_t len, size_t fragmentSize, bool masked)
+    {
+        if (fragmentSize == 0 || len <= fragmentSize)
+            return headerLength(len, masked) + len;
+        size_t rest = len % fragmentSize;
+        size_t total = (len / fragmentSize) * (headerLength(fragmentSize, masked) + fragmentSize);
+        if (rest > 0)
+            total += headerLength(rest, masked) + rest;
+        return total;
+    }
+
+    /**
+     * @brief Encode an unmasked message once into a shared frame (server broadcast).
+     * The message is split into fragments like buildMessage(), the encoded frames
+     * are stored back to back and queued on each client with NuClient::queueShared().
+     * @param fragmentSize Maximum payload per frame, 0 to always encode a single frame.
+     * @return NuSharedFrame* The encoded message holding one reference (release it
+     * after queuing), or nullptr if out of memory.
+     */
+    static NuSharedFrame *buildShared(uint8_t opcode, const uint8_t *data, size_t len, size_t fragmentSize)
+    {
+        NuSharedFrame *frame = NuSharedFrame::create(encodedLength(len, fragmentSize, false));
+        if (!frame)
+            return nullptr;
+
+        uint8_t *p = frame->data;
+        size_t offset = 0;
+        do
+        {
+            size_t n = fragment(len, offset, fragmentSize);
+            p += writeHeader(p, offset == 0 ? opcode : 0x0, offset + n == len, n, nullptr);
+            if (n > 0)
+                memcpy(p, data + offset, n);
+            p += n;
+            offset += n;
+        } while (offset < len);
+        return frame;
+    }
+
+    /**
+     * @brief Encode only the header of an unmasked frame into a shared frame, for a
+     * payload queued after it without copying (flash data, see NuPreparedMessage).
+     * @return NuSharedFrame* The header holding one reference, or nullptr if out of memory.
+     */
+    static NuSharedFrame *buildSharedHeader(uint8_t opcode, size_t len)
+    {
+        uint8_t header[14];
+        size_t headerSize = writeHeader(header, opcode, true, len, nullptr);
+        NuSharedFrame *frame = NuSharedFrame::create(headerSize);
+        if (frame)
+            memcpy(frame->data, header, headerSize);
+        return frame;
+    }
+
+    /**
+     * @brief Write a Close frame payload (status code and reason).
+     * @param out Output buffer, at least 125 bytes.
+     * @param code Close status code (e.g. 1009).
+     * @param reason Reason text (truncated to 123 bytes), may be nullptr.
+     * @param len Length of the reason.
+     * @return size_t Payload length.
+     */
+    static size_t closePayload(uint8_t *out, uint16_t code, const uint8_t *reason, size_t len)
+    {
+        out[0] = (uint8_t)((code >> 8) & 0xFF);
+        out[1] = (uint8_t)(code & 0xFF);
+        if (len > 123)
+            len = 123; // Control frame payload is limited to 125 bytes
+        if (reason && len > 0)
+            memcpy(out + 2, reason, len);
+        return 2 + len;
+    }
+
+    /**
+     * @brief Generate a new masking key.
+     */
+    static void randomMask(uint8_t mask[4])
+    {
+        for (int i = 0; i < 4; i++)
+            mask[i] = random(0, 255);
+    }
+
+private:
+    friend class NuMessageWriter;
+
+    // Copies (or mask-copies) into the queue blocks, the space has been reserved.
+    static void append(NuTxQueue &q, const uint8_t *data, size_t len, const uint8_t *mask)
+    {
+        size_t done = 0;
+        while (done < len)
+        {
+            size_t room;
+            uint8_t *p = q.writePtr(room);
+            size_t n = (len - done < room) ? len - done : room;
+            if (mask)
+                NuMask::copy(p, data + done, n, mask, done);
+            else
+                memcpy(p, data + done, n);
+            q.commit(n);
+            done += n;
+        }
+    }
+
+    // Writes the frame header (up to 14 bytes), returns its size.
+    static size_t writeHeader(uint8_t *out, uint8_t opcode, bool fin, size_t len, const uint8_t *mask)
+    {
+        size_t headerSize = 0;
+        uint8_t maskBit = mask ? 0x80 : 0;
+
+        out[headerSize++] = (fin ? 0x80 : 0) | (opcode & 0x0F);
+        if (len <= 125)
+            out[headerSize++] = maskBit | (uint8_t)len;
+        else if (len <= 0xFFFF)
+        {
+            out[headerSize++] = maskBit | 126;
+            out[headerSize++] = len >> 8;
+            out[headerSize++] = len & 0xFF;
+        }
+        else
+        {
+            out[headerSize++] = maskBit | 127;
+            for (int i = 7; i >= 0; i--)
+                out[headerSize++] = (uint8_t)((uint64_t)len >> (8 * i));
+        }
+        if (mask)
+        {
+            memcpy(out + headerSize, mask, 4);
+            headerSize += 4;
+        }
+        return headerSize;
+    }
+
+    // Size of the header writeHeader() writes for a payload of len bytes.
+    static size_t headerLength(size_t len, bool masked)
+    {
+        return 2 + (len <= 125 ? 0 : (len <= 0xFFFF ? 2 : 8)) + (masked ? 4 : 0);
+    }
+
+    // Payload length of the fragment starting at offset.
+    static size_t fragment(size_t len, size_t offset, size_t fragmentSize)
+    {
+        size_t n = len - offset;
+        if (fragmentSize > 0 && n > fragmentSize)
+            n = fragmentSize;
+        return n;
+    }
+};
+
+/**
+ * @brief A server message encoded once and sent to any number of clients.
+ * Sending it queues a reference to the encoded frames, the header is not encoded
+ * and the payload is not copied again. A flash (PROGMEM) payload is not copied
+ * to RAM at all: only the frame header is allocated and the payload is read from
+ * flash while it is sent, so it must stay valid while the message is queued.
+ * Changing or destroying the message does not affect the copies already queued.
+ */
+class NuPreparedMessage
+{
+public:
+    NuPreparedMessage() {}
+    NuPreparedMessage(const NuPreparedMessage &) = delete;
+    NuPreparedMessage &operator=(const NuPreparedMessage &) = delete;
+    ~NuPreparedMessage() { clear(); }
+
+    /**
+     * @brief Encode a text message.
+     * @param msg Null-terminated string (copied).
+     * @param fragmentSize Maximum payload per frame, 0 to encode a single frame.
+     * @return false if out of memory (the message is empty).
+     */
+    bool setText(const char *msg, size_t fragmentSize = 0)
+    {
+        return set(0x1, (const uint8_t *)msg, strlen(msg), fragmentSize);
+    }
+
+    /**
+     * @brief Encode a binary message.
+     * @param data Payload (copied).
+     * @param len Length of the payload.
+     * @param fragmentSize Maximum payload per frame, 0 to encode a single frame.
+     * @return false if out of memory (the message is empty).
+     */
+    bool setBinary(const uint8_t *data, size_t len, size_t fragmentSize = 0)
+    {
+        return set(0x2, data, len, fragmentSize);
+    }
+
+    /**
+     * @brief Use a flash string as a text message, e.g. setText(F("status: idle")).
+     * @return false if out of memory (the message is empty).
+     */
+    bool setText(const __FlashStringHelper *msg)
+    {
+        PGM_P p = (PGM_P)msg;
+        return setProgmem(0x1, (const uint8_t *)p, strlen_P(p));
+    }
+
+    /**
+     * @brief Use a null-terminated string stored in PROGMEM as a text message.
+     * @return false if out of memory (the message is empty).
+     */
+    bool setText_P(PGM_P msg)
+    {
+        return setProgmem(0x1, (const uint8_t *)msg, strlen_P(msg));
+    }
+
+    /**
+     * @brief Use data stored in PROGMEM as a binary message.
+     * @param data Payload in flash, it must stay valid while the message is queued.
+     * @param len Length of the payload.
+     * @return false if out of memory (the message is empty).
+     */
+    bool setBinary_P(const uint8_t *data, size_t len)
+    {
+        return setProgmem(0x2, data, len);
+    }
+
+    /**
+     * @brief Release the encoded message (queued copies are kept until sent).
+     */
+    void clear()
+    {
+        NuSharedFrame::release(_frame);
+        NuSharedFrame::release(_payload);
+        _frame = nullptr;
+        _payload = nullptr;
+    }
+
+    /**
+     * @brief Check if a message has been set.
+     */
+    bool ready() const { return _frame != nullptr; }
+
+    /**
+     * @brief Get the encoded size (frame headers included).
+     */
+    size_t length() const
+    {
+        return (_frame ? _frame->len : 0) + (_payload ? _payload->len : 0);
+    }
+
+    /**
+     * @brief Queue the message on a client's transmit queue (used by the servers).
+     * @param key Latest-wins key, 0 for none.
+     * @return false if the message is empty or out of memory.
+     */
+    bool queue(NuClient *c, uint32_t key = 0) const
+    {
+        return _frame && c->queueShared(_frame, true, key, _payload);
+    }
+
+private:
+    NuSharedFrame *_frame = nullptr;   // Encoded frames, or the header of a flash payload
+    NuSharedFrame *_payload = nullptr; // Flash payload
+
+    bool set(uint8_t opcode, const uint8_t *data, size_t len, size_t fragmentSize)
+    {
+        clear();
+        _frame = NuFrameBuilder::buildShared(opcode, data, len, fragmentSize);
+        return _frame != nullptr;
+    }
+
+    bool setProgmem(uint8_t opcode, const uint8_t *data, size_t len)
+    {
+        clear();
+        _frame = NuFrameBuilder::buildSharedHeader(opcode, len);
+        _payload = len > 0 ? NuSharedFrame::wrapProgmem(data, len) : nullptr;
+        if (_frame && (_payload || len == 0))
+            return true;
+        clear();
+        return false;
+    }
+};
+
+/**
+ * @brief Queues a frame encoded by NuMessageWriter on a client (takes a reference).
+ * @param owner The server or client that created the writer.
+ * @param droppable The frame holds a whole message.
+ * @return false if the client is gone or out of memory.
+ */
+typedef bool (*NuMessageSink)(void *owner, NuClient *c, NuSharedFrame *frame, bool droppable);
+
+/**
+ * @brief Print-compatible writer that encodes a message in place.
+ * print() and printf() output is written straight into a frame allocated with
+ * room for the largest header in front, the header is filled in when the frame
+ * is queued, so no intermediate buffer is needed. Output larger than the fragment
+ * size is queued as continuation frames while it is written.
+ * Obtained from message() of a server or client. The message is finished by end(),
+ * or when the writer is destroyed. Other messages to the same connection must not
+ * be sent before that.
+ */
+class NuMessageWriter : public Print
+{
+public:
+    NuMessageWriter() {}
+
+    /**
+     * @brief Start a message (used by the servers and clients).
+     * @param fragmentSize Maximum payload per frame.
+     * @param initialSize Payload capacity of the first allocation, grown up to fragmentSize.
+     * @param masked true to mask the frames (client to server).
+     */
+    NuMessageWriter(void *owner, NuClient *c, NuMessageSink sink, uint8_t opcode, size_t fragmentSize, size_t initialSize, bool masked)
+        : _owner(owner), _client(c), _sink(sink), _opcode(opcode), _masked(masked)
+    {
+        _fragmentSize = fragmentSize > 0 ? fragmentSize : 1;
+        _initialSize = (initialSize > 0 && initialSize < _fragmentSize) ? initialSize : _fragmentSize;
+    }
+
+    NuMessageWriter(const NuMessageWriter &) = delete;
+    NuMessageWriter &operator=(const NuMessageWriter &) = delete;
+
+    NuMessageWriter(NuMessageWriter &&other)
+        : _owner(other._owner), _client(other._client), _sink(other._sink), _frame(other._frame),
+          _len(other._len), _cap(other._cap), _fragmentSize(other._fragmentSize), _initialSize(other._initialSize),
+          _frames(other._frames), _opcode(other._opcode), _masked(other._masked), _failed(other._failed)
+    {
+        other._sink = nullptr;
+        other._frame = nullptr;
+    }
+
+    ~NuMessageWriter() { end(); }
+
+    using Print::write;
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+
+    size_t write(const uint8_t *data, size_t len) override
+    {
+        size_t done = 0;
+        while (done < len && room(1))
+        {
+            size_t n = _cap - _len;
+            if (n > len - done)
+                n = len - done;
+            memcpy(payload() + _len, data + done, n);
+            _len += n;
+            done += n;
+        }
+        return done;
+    }
+
+    /**
+     * @brief Format text into the message.
+     * @return size_t Number of bytes written.
+     */
+    size_t printf(const char *format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        size_t n = vprintf(format, args);
+        va_end(args);
+        return n;
+    }
+
+    /**
+     * @brief Format text into the message (va_list version).
+     * The text is formatted in place when it fits into the current frame, which is
+     * grown up to the fragment size if needed. Longer text is formatted into a
+     * temporary buffer and written as fragments.
+     * @return size_t Number of bytes written.
+     */
+    size_t vprintf(const char *format, va_list args)
+    {
+        va_list copy;
+        va_copy(copy, args);
+        int len = room(1) ? vsnprintf((char *)payload() + _len, _cap - _len + 1, format, copy) : -1;
+        va_end(copy);
+        if (len < 0)
+            return 0;
+        if ((size_t)len > _cap - _len && _len + len <= _fragmentSize && grow(_len + len))
+        {
+            va_copy(copy, args);
+            vsnprintf((char *)payload() + _len, _cap - _len + 1, format, copy);
+            va_end(copy);
+        }
+        if ((size_t)len <= _cap - _len)
+        {
+            _len += len;
+            return len;
+        }
+        char *text = (char *)malloc(len + 1);
+        if (!text)
+        {
+            _failed = true;
+            return 0;
+        }
+        vsnprintf(text, len + 1, format, args);
+        size_t n = write((const uint8_t *)text, len);
+        free(text);
+        return n;
+    }
+
+    /**
+     * @brief Queue the last frame of the message.
+     * If a write failed after fragments were queued, the message is finished with
+     * an empty frame so the connection stays usable (the message is truncated).
+     * @return true if the whole message was queued.
+     */
+    bool end()
+    {
+        if (!_sink)
+            return false;
+        bool ok = !_failed;
+        if (!ok)
+        {
+            NuSharedFrame::release(_frame);
+            _frame = nullptr;
+            _len = 0;
+        }
+        if ((ok || _frames > 0) && (_frame || alloc(0)))
+            ok = emit(true) && ok;
+        else
+            ok = false;
+        _sink = nullptr;
+        return ok;
+    }
+
+    /**
+     * @brief Check if the message can be written (connected and not failed).
+     */
+    explicit operator bool() const { return _sink && !_failed; }
+
+private:
+    static const size_t headerRoom = 14;
+
+    void *_owner = nullptr;
+    NuClient *_client = nullptr;
+    NuMessageSink _sink = nullptr;
+    NuSharedFrame *_frame = nullptr; // Frame being written, payload after headerRoom bytes
+    size_t _len = 0;                 // Payload bytes written
+    size_t _cap = 0;                 // Payload capacity (one more byte for the formatter's terminator)
+    size_t _fragmentSize = 0;
+    size_t _initialSize = 0;
+    size_t _frames = 0; // Frames queued
+    uint8_t _opcode = 0;
+    bool _masked = false;
+    bool _failed = false;
+
+    uint8_t *payload() { return (uint8_t *)(_frame + 1) + headerRoom; }
+
+    // Make room for n more bytes (up to the fragment size): the frame is allocated
+    // or grown, a full frame is queued as a fragment and the next one started
+    bool room(size_t n)
+    {
+        if (!_sink || _failed)
+            return false;
+        if (_frame && _len + n <= _cap)
+            return true;
+        if (_frame && _cap < _fragmentSize)
+            return grow(_len + n);
+        if (_frame && !emit(false))
+            return false;
+        return alloc(_initialSize);
+    }
+
+    bool alloc(size_t cap)
+    {
+        NuSharedFrame *f = (NuSharedFrame *)malloc(sizeof(NuSharedFrame) + headerRoom + cap + 1);
+        if (!f)
+        {
+            _failed = true;
+            return false;
+        }
+        f->cap = 0;
+        f->refs = 1;
+        f->progmem = false;
+        _frame = f;
+        _len = 0;
+        _cap = cap;
+        return true;
+    }
+
+    bool grow(size_t need)
+    {
+        size_t cap = _cap * 2 > need ? _cap * 2 : need;
+        if (cap > _fragmentSize)
+            cap = _fragmentSize;
+        NuSharedFrame *f = (NuSharedFrame *)realloc(_frame, sizeof(NuSharedFrame) + headerRoom + cap + 1);
+        if (!f)
+        {
+            _failed = true;
+            return false;
+        }
+        _frame = f;
+        _cap = cap;
+        return true;
+    }
+
+    // Fill in the header in front of the payload and queue the frame
+    bool emit(bool fin)
+    {
+        uint8_t header[14], mask[4];
+        if (_masked)
+        {
+            NuFrameBuilder::randomMask(mask);
+            NuMask::apply(payload(), _len, mask);
+        }
+        size_t headerSize = NuFrameBuilder::writeHeader(header, _frames == 0 ? _opcode : 0x0, fin, _len, _masked ? mask : nullptr);
+
+        NuSharedFrame *f = _frame;
+        if (_len < _cap)
+        {
+            NuSharedFrame *shrunk = (NuSharedFrame *)realloc(f, sizeof(NuSharedFrame) + headerRoom + _len);
+            if (shrunk)
+                f = shrunk;
+        }
+        f->data = (uint8_t *)(f + 1) + headerRoom - headerSize;
+        memcpy(f->data, header, headerSize);
+        f->len = headerSize + _len;
+        _frame = nullptr;
+
+        bool queued = _sink(_owner, _client, f, fin && _frames == 0);
+        NuSharedFrame::release(f);
+        _frames++;
+        if (!queued)
+            _failed = true;
+        return queued;
+    }
+};
+
+#endif
@@ -10,478 +10,815 @@
 #include "NuSockConfig.h"
 #include "NuSockUtils.h"
 #include "NuSockTypes.h"
-#include "vector/dynamic/DynamicVector.h"
+#include "NuSockFrame.h"
 
 typedef void (*NuServerEventCallback)(NuClient *client, NuServerEvent event, const uint8_t *payload, size_t len);
 
 class NuSockServer
 {
 private:
-    NuLock myLock;
-    ReadyUtils::DynamicVector<NuClient *> clients;
+    NuLock myLock;                   // Guards the client registry and the event queue
+    NuClientTable clients{myLock};   // Traversed through views without the lock
     uint16_t _port;
     NuServerEventCallback _onEvent = nullptr;
+    size_t _fragmentSize = 0;
+    NuBufferConfig _bufferConfig;
     bool _running = false;
+    uint32_t _postFailures = 0;
+    NuSlowConsumerPolicy _slowPolicy = SLOW_CONSUMER_BLOCK;
+    NuSlowConsumerStats _slowStats;
+
+#ifdef NUSOCK_DISPATCH
+    NuEventQueue _events; // Dispatch mode: events waiting for loop()
+#endif
 
 #ifdef NUSOCK_USE_LWIP
     struct tcp_pcb *server_pcb = nullptr;
+    NuCallbackMsg _resumeMsg; // Resumes the paused receivers on the network thread
 #else
     void *_genericServerRef = nullptr;
     NuClient *(*_acceptFunc)(void *, NuSockServer *) = nullptr;
 #endif
 
+#ifdef NUSOCK_NETWORK_TASK
+    TaskHandle_t volatile _task = nullptr; // Runs the I/O loop (startNetworkTask())
+    volatile bool _taskRunning = false;
+
+    static void networkTask(void *arg)
+    {
+        NuSockServer *s = (NuSockServer *)arg;
+        while (s->_taskRunning)
+        {
+            s->generic_loop();
+            vTaskDelay(1);
+        }
+        s->_task = nullptr;
+        vTaskDelete(nullptr);
+    }
+#endif
+
+    // Remove a client from the registry. It is deleted, with its buffers and callback
+    // messages, once no view or queued event refers to it.
     void removeClient(NuClient *c)
     {
-        for (size_t i = clients.size() - 1; i >= 0; i--)
+        clients.remove(c);
+    }
+
+    bool buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
+    {
+        c->txLock.lock();
+        bool queued = NuFrameBuilder::build(c, opcode, isFin, data, len);
+        c->txLock.unlock();
+        return queued;
+    }
+
+    // Queue or write the pending TX data of a client (generic mode: loop() or the network task only)
+    void flushClient(NuClient *c)
+    {
+#ifdef NUSOCK_USE_LWIP
+        post_flush(c);
+#else
+        if (c->client && c->client->connected())
         {
-            if (clients[i] == c)
+            const uint8_t *data;
+            size_t len;
+            c->txLock.lock();
+            while ((data = c->txPeek(len)) != nullptr)
             {
-                clients.erase(i);
-                for (size_t j = i; j < clients.size(); j++)
-                {
-                    clients[j]->index = j;
-                }
-                break;
+                c->client->write(data, len);
+                c->txConsume(len);
             }
+            c->txLock.unlock();
+            notifyWritable(c);
         }
-        if (c->rxBuffer)
-        {
-            free(c->rxBuffer);
-            c->rxBuffer = nullptr;
-        }
-        if (c)
-        {
-#if defined(__GNUC__)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdelete-non-virtual-dtor"
-#endif
-            delete c;
-#if defined(__GNUC__)
-#pragma GCC diagnostic pop
 #endif
-        }
     }
 
-    void buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
+    // Apply the high watermark and the slow-consumer policy to a message for a client (under
+    // its txLock). Sets close if the policy closes the client, the caller then calls
+    // closeSlowConsumer() after releasing the lock.
+    bool admit(NuClient *c, size_t len, uint32_t key, bool &close)
     {
-        uint8_t firstByte = opcode & 0x0F;
-        if (isFin)
-        {
-            firstByte |= 0x80;
-        }
-        c->appendTx(firstByte);
+        if (c->txAdmit(len, _slowPolicy, key, &_slowStats))
+            return true;
+        close = _slowPolicy == SLOW_CONSUMER_CLOSE;
+        return false;
+    }
 
-        if (len <= 125)
+    // Messages are queued as separate frames the drop policies can remove
+    bool droppable() const
+    {
+        return _slowPolicy == SLOW_CONSUMER_DROP_OLDEST || _slowPolicy == SLOW_CONSUMER_LATEST_WINS;
+    }
+
+    // Close a client that cannot keep up, status 1008 (Policy Violation). Called without locks.
+    void closeSlowConsumer(NuClient *c)
+    {
+        uint8_t closeFrame[125];
+        c->txLock.lock();
+        bool open = c->state == NuClient::STATE_CONNECTED; // Another sender may have closed it
+        if (open)
         {
-            c->appendTx((uint8_t)len);
+            NuFrameBuilder::build(c, 0x8, true, closeFrame, NuFrameBuilder::closePayload(closeFrame, 1008, (const uint8_t *)"Slow Consumer", 13));
+            c->state = NuClient::STATE_CLOSING;
         }
-        else
+        c->txLock.unlock();
+        if (!open)
+            return;
+        emit(c, SERVER_EVENT_ERROR, (const uint8_t *)"Slow Consumer", 13);
+        c->last_event = SERVER_EVENT_ERROR;
+#ifdef NUSOCK_USE_LWIP
+        flushClient(c);
+        dropClient(c);
+#else
+        c->txOverflow = true; // The I/O loop writes the Close frame and drops it
+#endif
+    }
+
+    // Encode the message once and queue it on every connected client below the high watermark
+    bool broadcast(uint8_t opcode, const uint8_t *data, size_t len, uint32_t key = 0)
+    {
+        NuClientTable::View v(clients);
+        NuSharedFrame *frame = nullptr;
+        bool all = true;
+        for (size_t i = 0; i < v.size(); i++)
         {
-            c->appendTx(126);
-            c->appendTx(len >> 8);
-            c->appendTx(len & 0xFF);
+            NuClient *c = v[i];
+            if (c->detached || c->state != NuClient::STATE_CONNECTED)
+                continue;
+            if (!frame)
+            {
+                // Encoded outside the client locks, once the first receiver is found
+                frame = NuFrameBuilder::buildShared(opcode, data, len, _fragmentSize);
+                if (!frame)
+                    return false;
+            }
+            bool close = false;
+            c->txLock.lock();
+            bool queued = c->state == NuClient::STATE_CONNECTED && admit(c, frame->len, key, close) && c->queueShared(frame, true, key);
+            c->txLock.unlock();
+            if (close)
+                closeSlowConsumer(c);
+            if (!queued)
+            {
+                all = false;
+                continue;
+            }
+#ifdef NUSOCK_USE_LWIP
+            post_flush(c);
+#endif
         }
-        for (size_t j = 0; j < len; j++)
-            c->appendTx(data[j]);
+        NuSharedFrame::release(frame);
+        return all;
     }
 
+    // Queue a frame of a NuMessageWriter if its client is still connected
+    static bool writerSink(void *owner, NuClient *c, NuSharedFrame *frame, bool droppable)
+    {
+        NuSockServer *s = (NuSockServer *)owner;
+        NuClientTable::View v(s->clients);
+        if (!v.contains(c))
+            return false;
+        c->txLock.lock();
+        bool queued = c->state == NuClient::STATE_CONNECTED && c->queueShared(frame, droppable);
+        c->txLock.unlock();
 #ifdef NUSOCK_USE_LWIP
-    static void static_close_client(void *arg)
+        if (queued)
+            post_flush(c);
+#endif
+        return queued;
+    }
+
+    // Queue a prepared message on a connected client below the high watermark
+    bool sendPrepared(NuClient *c, const NuPreparedMessage &msg, uint32_t key = 0)
     {
-        NuClient *c = (NuClient *)arg;
-        if (!c)
-            return;
-        NuSockServer *s = (NuSockServer *)c->server;
-        s->myLock.lock();
-        if (s->_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
-            s->_onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, nullptr, 0);
-        c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
-        if (c->pcb)
+        bool close = false;
+        c->txLock.lock();
+        bool queued = c->state == NuClient::STATE_CONNECTED && admit(c, msg.length(), key, close) && msg.queue(c, key);
+        c->txLock.unlock();
+        if (close)
+            closeSlowConsumer(c);
+#ifdef NUSOCK_USE_LWIP
+        if (queued)
+            post_flush(c);
+#endif
+        return queued;
+    }
+
+    // Queue a prepared message on every connected client below the high watermark
+    bool broadcastPrepared(const NuPreparedMessage &msg, uint32_t key = 0)
+    {
+        NuClientTable::View v(clients);
+        bool all = true;
+        for (size_t i = 0; i < v.size(); i++)
         {
-            tcp_arg(c->pcb, NULL);
-            tcp_close(c->pcb);
-            c->pcb = NULL;
+            NuClient *c = v[i];
+            if (!c->detached && c->state == NuClient::STATE_CONNECTED && !sendPrepared(c, msg, key))
+                all = false;
         }
-        s->removeClient(c);
-        s->myLock.unlock();
+        return all;
     }
-    static void static_flush_client(void *arg)
+
+    // Queue a data message (or fragment) on a connected client below the high watermark
+    bool sendData(NuClient *c, uint8_t opcode, bool fragment, bool fin, const uint8_t *data, size_t len, uint32_t key = 0)
     {
-        NuClient *c = (NuClient *)arg;
-        if (!c || !c->pcb)
-            return;
-        NuSockServer *s = (NuSockServer *)c->server;
-        s->myLock.lock();
-        while (c->txLen > 0)
+        bool close = false;
+        c->txLock.lock();
+        size_t encoded = NuFrameBuilder::encodedLength(len, fragment ? 0 : _fragmentSize, false);
+        bool queued = c->state == NuClient::STATE_CONNECTED && admit(c, encoded, key, close);
+        if (queued)
         {
-            size_t available = tcp_sndbuf(c->pcb);
-            size_t mss = tcp_mss(c->pcb);
-            size_t send_len = c->txLen;
-            if (send_len > available)
-                send_len = available;
-            if (send_len > mss)
-                send_len = mss;
-            if (send_len == 0)
-                break;
-            err_t err = tcp_write(c->pcb, &c->txBuffer[0], send_len, TCP_WRITE_FLAG_COPY);
-            if (err == ERR_OK)
+            if (fragment)
+                queued = NuFrameBuilder::build(c, opcode, fin, data, len);
+            else if (droppable())
             {
-                size_t remaining = c->txLen - send_len;
-                if (remaining == 0)
-                    c->clearTx();
-                else
-                {
-                    memmove(c->txBuffer, c->txBuffer + send_len, remaining);
-                    c->txLen = remaining;
-                }
+                NuSharedFrame *frame = NuFrameBuilder::buildShared(opcode, data, len, _fragmentSize);
+                queued = frame && c->queueShared(frame, true, key);
+                NuSharedFrame::release(frame);
             }
             else
-            {
-                if (s->_onEvent)
-                    s->_onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Write Error", 11);
-                c->last_event = SERVER_EVENT_ERROR;
-                break;
-            }
+                queued = NuFrameBuilder::buildMessage(c, opcode, data, len, _fragmentSize, false);
         }
-        tcp_output(c->pcb);
-        s->myLock.unlock();
+        c->txLock.unlock();
+        if (close)
+            closeSlowConsumer(c);
+#ifdef NUSOCK_USE_LWIP
+        if (queued)
+            post_flush(c);
+#endif
+        return queued;
     }
 
-    void lwip_process(NuClient *c)
+    bool sendIndex(int index, uint8_t opcode, bool fragment, bool fin, const uint8_t *data, size_t len, uint32_t key = 0)
     {
-        if (!c->rxBuffer)
-            return;
+        NuClientTable::View v(clients);
+        NuClient *c = v.at(index);
+        return c && sendData(c, opcode, fragment, fin, data, len, key);
+    }
 
-        // Process Loop: Standard consuming loop (parse -> dispatch -> consume)
-        while (c->rxLen > 0)
+    bool sendId(const char *targetId, uint8_t opcode, const uint8_t *data, size_t len)
+    {
+        NuClientTable::View v(clients);
+        bool found = false, all = true;
+        for (size_t i = 0; i < v.size(); i++)
         {
-            if (c->rxLen < 2)
-                return; // Wait for header
-
-            uint8_t opcode = c->rxBuffer[0] & 0x0F;
-            bool isFin = (c->rxBuffer[0] & 0x80);
-            uint8_t lenByte = c->rxBuffer[1] & 0x7F;
-            bool isMasked = (c->rxBuffer[1] & 0x80);
-
-            // Strict masking & RSV checks
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-            // RSV bit check (must be 0)
-            if ((c->rxBuffer[0] & 0x70) != 0)
+            NuClient *c = v[i];
+            if (!c->detached && c->state == NuClient::STATE_CONNECTED && strcmp(c->id, targetId) == 0)
             {
-                if (_onEvent)
-                    _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"RSV Error", 9);
-                c->last_event = SERVER_EVENT_ERROR;
-                tcpip_callback(static_close_client, c);
-                return;
+                found = true;
+                if (!sendData(c, opcode, false, true, data, len))
+                    all = false;
             }
-            // Strict Masking check (server must receive masked)
-            if (!isMasked)
-            {
-                if (_onEvent)
-                    _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Mask Error", 10);
-                c->last_event = SERVER_EVENT_ERROR;
-                tcpip_callback(static_close_client, c);
-                return;
-            }
-            // Control frame validation (basic)
-            if (opcode >= 0x8)
+        }
+        return found && all;
+    }
+
+    // Fire WRITABLE once a blocked client has drained to the low watermark (called without its txLock)
+    void notifyWritable(NuClient *c)
+    {
+        c->txLock.lock();
+        bool writable = c->txWritable();
+        c->txLock.unlock();
+        if (writable)
+            emit(c, SERVER_EVENT_WRITABLE, nullptr, 0);
+    }
+
+    // Run the event callback, or queue the event for loop() in dispatch mode
+    void emit(NuClient *c, NuServerEvent event, const uint8_t *payload, size_t len)
+    {
+#ifdef NUSOCK_DISPATCH
+        if (_events.enabled())
+        {
+            myLock.lock();
+            _events.push(c, event, payload, len);
+            if (c && _events.full() && c->state != NuClient::STATE_HANDSHAKE)
             {
-                // Control frames cannot be fragmented (FIN must be 1)
-                // Control frames cannot have payload > 125
-                if (!isFin || lenByte > 125)
-                {
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Control Err", 11);
-                    tcpip_callback(static_close_client, c);
-                    return;
-                }
+                // The parser stops before the next frame, the peer's window closes
+                c->rxPaused = true;
+                _events.paused = true;
             }
+            myLock.unlock();
+            return;
+        }
 #endif
+        if (c)
+            c->publishRx();
+        if (_onEvent)
+            _onEvent(c, event, payload, len);
+    }
 
-            size_t headerSize = 2;
-            size_t payloadLen = lenByte;
+#ifdef NUSOCK_DISPATCH
+    // Run the callbacks of the queued events on the calling task (dispatch mode)
+    void dispatch()
+    {
+        // Events queued meanwhile wait for the next call
+        myLock.lock();
+        size_t n = _events.count;
+        myLock.unlock();
+        while (n-- > 0)
+        {
+            myLock.lock();
+            NuEventQueue::Item *e = _events.pop();
+            myLock.unlock();
+            if (!e)
+                break;
+            if (e->client)
+                e->publish(); // The parser may be ahead, restore the state queued with the event
+            if (_onEvent)
+                _onEvent(e->client, (NuServerEvent)e->event, e->len ? e->data() : nullptr, e->len);
+            myLock.lock();
+            NuClient *c = NuEventQueue::release(e);
+            myLock.unlock();
+            if (c)
+                delete c; // Removed meanwhile, this was its last event
+        }
+        myLock.lock();
+        if (_events.paused && !_events.full())
+        {
+            _events.paused = false;
+#ifdef NUSOCK_USE_LWIP
+            if (!_resumeMsg.post())
+                _postFailures++; // The poll callbacks resume the receivers
+#endif
+            // The network task resumes its receivers on its next pass
+        }
+        myLock.unlock();
+    }
+#endif
 
-            if (payloadLen == 126)
-            {
-                if (c->rxLen < 4)
-                    return;
-                payloadLen = (c->rxBuffer[2] << 8) | c->rxBuffer[3];
-                headerSize += 2;
-            }
-            else if (payloadLen == 127)
+    // Close the TCP connection; the client is removed and DISCONNECTED is fired afterwards
+    void dropClient(NuClient *c)
+    {
+#ifdef NUSOCK_USE_LWIP
+        post_close(c);
+#else
+        if (c->client)
+            c->client->stop();
+#endif
+    }
+
+    static bool frameHandler(void *ctx, NuClient *c, NuFrameEvent event, uint8_t *payload, size_t len)
+    {
+        NuSockServer *s = (NuSockServer *)ctx;
+        switch (event)
+        {
+        case FRAME_EVENT_PING:
+            // Ping -> Pong
+            s->buildFrame(c, 0xA, true, payload, len);
+            s->flushClient(c);
+            return true;
+
+        case FRAME_EVENT_PONG:
+            return true;
+
+        case FRAME_EVENT_CLOSE:
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
+            // Client initiated the close (State is CONNECTED).
+            // We must Echo the payload back and then close.
+            // Otherwise this frame is the Client's acknowledgement of our close.
+            if (c->state != NuClient::STATE_CLOSING)
             {
-                // (Optional 64-bit support or Error)
-                if (_onEvent)
-                    _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Frame Too Large", 15);
-                tcpip_callback(static_close_client, c);
-                return;
+                s->buildFrame(c, 0x8, true, payload, len);
+                s->flushClient(c);
+                if (c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
+                    s->emit(c, SERVER_EVENT_CLIENT_DISCONNECTED, payload, len);
+                c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
             }
+#endif
+            s->dropClient(c);
+            return false;
 
-            if (isMasked)
-                headerSize += 4;
+        case FRAME_EVENT_ERROR:
+        {
+            // Tell the client why it is dropped (status in rxFrame.closeCode, e.g. 1009)
+            uint8_t closeFrame[125];
+            s->buildFrame(c, 0x8, true, closeFrame, NuFrameBuilder::closePayload(closeFrame, c->rxFrame.closeCode, payload, len));
+            s->flushClient(c);
+            s->emit(c, SERVER_EVENT_ERROR, payload, len);
+            c->last_event = SERVER_EVENT_ERROR;
+            s->dropClient(c);
+            return false;
+        }
 
-            size_t totalFrameSize = headerSize + payloadLen;
-            if (c->rxLen < totalFrameSize)
-                return; // Wait for full payload
+        default:
+        {
+            NuServerEvent ev = NuFrameParser::serverEvent(event);
+            s->emit(c, ev, payload, len);
+            c->last_event = ev;
+            return true;
+        }
+        }
+    }
 
-            size_t maskOffset = headerSize - 4;
+#ifdef NUSOCK_USE_LWIP
+    static void static_close_client(void *arg)
+    {
+        NuClient *c = (NuClient *)arg;
+        if (!c)
+            return;
+        // A queued flush refers to the client, close after it has run
+        if (c->flushMsg.queued())
+        {
+            c->closeMsg.post();
+            return;
+        }
+        NuSockServer *s = (NuSockServer *)c->server;
+        if (c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
+            s->emit(c, SERVER_EVENT_CLIENT_DISCONNECTED, nullptr, 0);
+        c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
+        close_pcb(c);
+        s->removeClient(c);
+    }
 
-            // Control frame handling (OpCode >= 0x8)
-            if (opcode >= 0x8)
-            {
-                // Unmask control frame in-place
-                if (isMasked)
-                {
-                    uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1],
-                                       c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                    // Use a temp pointer to avoid affecting the buffer logic below
-                    uint8_t *ctrlPayload = &c->rxBuffer[headerSize];
-                    for (size_t i = 0; i < payloadLen; i++)
-                        ctrlPayload[i] ^= mask[i % 4];
-                }
-                uint8_t *ctrlPayload = &c->rxBuffer[headerSize];
+    // Detach the pcb from the client and close it
+    static void close_pcb(NuClient *c)
+    {
+        struct tcp_pcb *pcb = c->pcb;
+        if (!pcb)
+            return;
+        c->pcb = NULL;
+        tcp_arg(pcb, NULL);
+#ifdef NUSOCK_LWIP_ZERO_COPY
+        if (c->txQueue.unacked > 0)
+        {
+            // lwIP still references written frames (and may retransmit them),
+            // keep them with the pcb and close it once they are acknowledged.
+            NuTxLinger *l = new NuTxLinger();
+            c->txLock.lock();
+            l->queue.moveFrom(c->txQueue);
+            c->txLock.unlock();
+            tcp_arg(pcb, l);
+            tcp_recv(pcb, linger_recv);
+            tcp_sent(pcb, linger_sent);
+            tcp_err(pcb, linger_err);
+            tcp_poll(pcb, linger_poll, 2);
+            return;
+        }
+#endif
+        tcp_close(pcb);
+    }
 
-                // Close handshake (Opcode 0x8)
-                if (opcode == 0x8)
-                {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
-                    // Protocol Error: Payload length 1 is illegal (must be 0 or >= 2)
-                    if (payloadLen == 1)
-                    {
-                        tcpip_callback(static_close_client, c);
-                        return;
-                    }
+#ifdef NUSOCK_LWIP_ZERO_COPY
+    // Frames of a closed client that are still in flight
+    struct NuTxLinger
+    {
+        NuTxQueue queue;
+        uint8_t polls = 0;
+    };
 
-                    // We initiated the close (State is CLOSING).
-                    // This frame is the Client's acknowledgement.
-                    if (c->state == NuClient::STATE_CLOSING)
-                    {
-                        // Handshake complete. Close TCP connection.
-                        tcpip_callback(static_close_client, c);
-                        return;
-                    }
+    static err_t linger_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+    {
+        NuTxLinger *l = (NuTxLinger *)arg;
+        l->queue.ack(len);
+        if (l->queue.unacked > 0)
+            return ERR_OK;
+        tcp_arg(pcb, NULL);
+        tcp_recv(pcb, NULL);
+        tcp_sent(pcb, NULL);
+        tcp_err(pcb, NULL);
+        tcp_poll(pcb, NULL, 0);
+        delete l;
+        tcp_close(pcb);
+        return ERR_OK;
+    }
 
-                    // Client initiated the close (State is CONNECTED).
-                    // We must Echo the payload back and then close.
-                    buildFrame(c, 0x8, true, ctrlPayload, payloadLen);
-                    tcpip_callback(static_flush_client, c);
+    static err_t linger_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+    {
+        // The client is gone, discard incoming data
+        if (p)
+        {
+            tcp_recved(pcb, p->tot_len);
+            pbuf_free(p);
+        }
+        return ERR_OK;
+    }
 
-                    // Fire Event
-                    if (_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
-                        _onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, ctrlPayload, payloadLen);
+    static void linger_err(void *arg, err_t err)
+    {
+        // The pcb has been freed by lwIP
+        delete (NuTxLinger *)arg;
+    }
 
-                    c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
-                    tcpip_callback(static_close_client, c);
-                    return;
-#else
-                    // Legacy/Simple behavior
-                    tcpip_callback(static_close_client, c);
-                    return;
+    static err_t linger_poll(void *arg, struct tcp_pcb *pcb)
+    {
+        // Give up after NUSOCK_LWIP_LINGER_POLLS intervals of about one second
+        NuTxLinger *l = (NuTxLinger *)arg;
+        if (++l->polls < NUSOCK_LWIP_LINGER_POLLS)
+            return ERR_OK;
+        tcp_abort(pcb); // linger_err releases the frames
+        return ERR_ABRT;
+    }
 #endif
-                }
-                else if (opcode == 0x9)
-                {
-                    // Ping -> Pong
-                    buildFrame(c, 0xA, true, ctrlPayload, payloadLen);
-                    tcpip_callback(static_flush_client, c);
-                }
 
-                // Strip Control frame from buffer and continue
-                // We use memmove to shift the rest of the buffer over this control frame
-                size_t rem = c->rxLen - totalFrameSize;
-                if (rem > 0)
-                    memmove(c->rxBuffer, c->rxBuffer + totalFrameSize, rem);
-                c->rxLen -= totalFrameSize;
-                continue;
-            }
-
-            // Fragmentation state validation
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-            if (opcode > 0) // New data frame
-            {
-                if (c->fragmentOpcode != 0)
-                {
-                    // Error: nested message
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Frag Error", 10);
-                    tcpip_callback(static_close_client, c);
-                    return;
-                }
-                if (!isFin)
-                    c->fragmentOpcode = opcode; // Mark start
-            }
-            else if (opcode == 0) // Continuation
-            {
-                if (c->fragmentOpcode == 0)
-                {
-                    // Error: Orphan continuation
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Frag Error", 10);
-                    tcpip_callback(static_close_client, c);
-                    return;
-                }
-                if (isFin)
-                    c->fragmentOpcode = 0; // Mark end
-            }
+    static err_t cb_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+    {
+        NuClient *c = (NuClient *)arg;
+        if (!c)
+            return ERR_OK;
+        NuSockServer *s = (NuSockServer *)c->server;
+        c->txLock.lock();
+#ifdef NUSOCK_LWIP_ZERO_COPY
+        c->txQueue.ack(len);
 #endif
-            // Unmask Payload
-            if (isMasked)
-            {
-                uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1],
-                                   c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                uint8_t *payload = &c->rxBuffer[headerSize];
-                for (size_t i = 0; i < payloadLen; i++)
-                    payload[i] ^= mask[i % 4];
-            }
+        bool pending = c->txPending();
+        c->txLock.unlock();
+        // Already on the tcpip thread: continue with the data that did not fit
+        if (pending)
+            static_flush_client(c);
+        else
+            s->notifyWritable(c);
+        return ERR_OK;
+    }
 
-            uint8_t *payload = &c->rxBuffer[headerSize];
+    // Post a flush unless one is queued, a burst of sends costs one callback and one tcp_output().
+    // A failed post is retried from cb_poll.
+    static void post_flush(NuClient *c)
+    {
+        if (!c->flushMsg.post())
+            ((NuSockServer *)c->server)->_postFailures++;
+    }
 
-            // Streaming event dispatch
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-            if (opcode > 0)
-            {
-                if (!isFin)
-                {
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_FRAGMENT_START, payload, payloadLen);
-                }
-                else
-                {
-                    // Normal complete message
-                    if (opcode == 0x1 && _onEvent)
-                        _onEvent(c, SERVER_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                    else if (opcode == 0x2 && _onEvent)
-                        _onEvent(c, SERVER_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                }
-            }
-            else if (opcode == 0)
-            {
-                if (!isFin)
-                {
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_FRAGMENT_CONT, payload, payloadLen);
-                }
-                else
-                {
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_FRAGMENT_FIN, payload, payloadLen);
-                }
-            }
+    // Post the close of a client, retried from cb_poll until it has run
+    static void post_close(NuClient *c)
+    {
+        c->closeRequested = true;
+        if (!c->closeMsg.post())
+            ((NuSockServer *)c->server)->_postFailures++;
+    }
+
+    static err_t cb_poll(void *arg, struct tcp_pcb *pcb)
+    {
+        NuClient *c = (NuClient *)arg;
+        if (!c)
+            return ERR_OK;
+        // Retry the received data the parser could not take
+        if ((c->rxHeld || c->rxPaused) && !c->closeRequested)
+            resume_recv(c);
+        if (c->flushMsg.queued())
+            return ERR_OK;
+        if (c->closeRequested && !c->closeMsg.queued())
+            static_close_client(c);
+        else if (c->txPending())
+            static_flush_client(c);
+        return ERR_OK;
+    }
+
+    static void static_flush_client(void *arg)
+    {
+        NuClient *c = (NuClient *)arg;
+        if (!c || !c->pcb)
+            return;
+        NuSockServer *s = (NuSockServer *)c->server;
+        // Each contiguous run of queued frames is one tcp_write(), lwIP packs them into full segments
+        const uint8_t *data;
+        size_t pending;
+        bool copy;
+        bool failed = false;
+        c->txLock.lock();
+        while ((data = c->txPeek(pending, &copy)) != nullptr)
+        {
+            size_t send_len = tcp_sndbuf(c->pcb);
+            if (send_len > pending)
+                send_len = pending;
+            if (send_len == 0)
+                break;
+#ifdef NUSOCK_LWIP_ZERO_COPY
+            // lwIP references the queued data bytes, control frames and flash data are copied
+            err_t err = tcp_write(c->pcb, data, send_len, copy ? TCP_WRITE_FLAG_COPY : 0);
 #else
-            // Legacy event dispatch (Ignore OpCode 0 logic)
-            if (opcode == 0x1 && _onEvent)
-                _onEvent(c, SERVER_EVENT_MESSAGE_TEXT, payload, payloadLen);
-            else if (opcode == 0x2 && _onEvent)
-                _onEvent(c, SERVER_EVENT_MESSAGE_BINARY, payload, payloadLen);
+            err_t err = tcp_write(c->pcb, data, send_len, TCP_WRITE_FLAG_COPY);
 #endif
-            // Consume frame
-            size_t rem = c->rxLen - totalFrameSize;
-            if (rem > 0)
-                memmove(c->rxBuffer, c->rxBuffer + totalFrameSize, rem);
-            c->rxLen -= totalFrameSize;
+            if (err == ERR_OK)
+                c->txConsume(send_len);
+            else
+            {
+                failed = true;
+                break;
+            }
         }
+        c->txLock.unlock();
+        tcp_output(c->pcb);
+        if (failed)
+        {
+            s->emit(c, SERVER_EVENT_ERROR, (const uint8_t *)"Write Error", 11);
+            c->last_event = SERVER_EVENT_ERROR;
+        }
+        s->notifyWritable(c);
     }
 
     static err_t cb_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
     {
         NuClient *c = (NuClient *)arg;
+        if (!c)
+        {
+            if (p)
+                pbuf_free(p);
+            return ERR_OK;
+        }
         if (!p)
         {
-            tcpip_callback(static_close_client, c);
+            post_close(c);
             return ERR_OK;
         }
-        tcp_recved(pcb, p->tot_len);
         if (!c->rxBuffer)
         {
             pbuf_free(p);
-            tcpip_callback(static_close_client, c);
+            post_close(c);
+            return ERR_OK;
+        }
+        // Data is still held: refuse, lwIP keeps the pbuf and delivers it again later
+        if (c->rxHeld)
             return ERR_MEM;
+        size_t used;
+        if (!receive(c, p, 0, used))
+        {
+            pbuf_free(p);
+            return ERR_OK; // Dropped, the close is posted
+        }
+        if (used == 0)
+            return ERR_MEM; // Nothing taken, refused as above
+        // Only the consumed bytes reopen the peer's window
+        tcp_recved(pcb, used);
+        if (used < p->tot_len)
+        {
+            c->rxHeld = p;
+            c->rxHeldOffset = used;
+        }
+        else
+            pbuf_free(p);
+        return ERR_OK;
+    }
+
+    // Continue a paused receiver once the dispatch queue has room, then parse the
+    // held data again (poll callback, resume message)
+    static void resume_recv(NuClient *c)
+    {
+        NuSockServer *s = (NuSockServer *)c->server;
+        if (c->rxPaused)
+        {
+            if (s->_events.full())
+                return;
+            c->rxPaused = false;
+            if (!NuFrameParser::process(c, true, frameHandler, s))
+                return;
+        }
+        if (!c->rxHeld)
+            return;
+        struct pbuf *p = c->rxHeld;
+        size_t offset = c->rxHeldOffset;
+        c->rxHeld = nullptr;
+        size_t used;
+        if (!receive(c, p, offset, used))
+        {
+            pbuf_free(p);
+            return;
         }
-        struct pbuf *ptr = p;
-        while (ptr)
+        if (used > 0)
+            tcp_recved(c->pcb, used);
+        if (offset + used < p->tot_len)
         {
-            if (c->rxLen + ptr->len <= MAX_WS_BUFFER)
+            c->rxHeld = p;
+            c->rxHeldOffset = offset + used;
+        }
+        else
+            pbuf_free(p);
+    }
+
+    // Parse a received pbuf chain from offset, used is set to the bytes consumed.
+    // Stops early when the receive buffer is full. Returns false if the client was dropped.
+    static bool receive(NuClient *c, struct pbuf *p, size_t offset, size_t &used)
+    {
+        NuSockServer *s = (NuSockServer *)c->server;
+        used = 0;
+        for (struct pbuf *ptr = p; ptr; ptr = ptr->next)
+        {
+            if (offset >= ptr->len)
             {
-                memcpy(c->rxBuffer + c->rxLen, ptr->payload, ptr->len);
-                c->rxLen += ptr->len;
+                offset -= ptr->len;
+                continue;
+            }
+            // Parse each pbuf in place, the chain is freed once the callbacks have returned
+            uint8_t *data = (uint8_t *)ptr->payload + offset;
+            size_t len = ptr->len - offset;
+            offset = 0;
+            while (len > 0)
+            {
+                size_t n = 0;
+                if (c->state == NuClient::STATE_HANDSHAKE)
+                {
+                    // Keep one byte free for the terminator of the request
+                    size_t room = c->reserveRx(len);
+                    n = c->appendRx(data, room > len ? len : (room > 0 ? room - 1 : 0));
+                    if (!s->handshake(c))
+                        return false;
+                }
+                else if (!NuFrameParser::feed(c, data, len, true, frameHandler, s, &n))
+                    return false;
+                used += n;
+                if (n == 0)
+                    return true; // Buffer full
+                data += n;
+                len -= n;
             }
-            ptr = ptr->next;
         }
-        pbuf_free(p);
-        NuSockServer *s = (NuSockServer *)c->server;
-        if (c->state == NuClient::STATE_HANDSHAKE)
+        return true;
+    }
+
+    // Answer the upgrade request once it is complete. Returns false if the client was dropped.
+    bool handshake(NuClient *c)
+    {
+        if (c->rxLen <= 100)
+            return true;
+        c->rxBuffer[c->rxLen] = 0;
+        char *reqBuf = (char *)c->rxBuffer;
+        char *reqEnd = strstr(reqBuf, "\r\n\r\n");
+        if (!reqEnd)
+        {
+            if (c->rxLen + 1 < c->rxCap)
+                return true; // Wait for the rest of the request
+            emit(c, SERVER_EVENT_ERROR, (const uint8_t *)"Handshake Too Large", 19);
+            c->last_event = SERVER_EVENT_ERROR;
+            dropClient(c);
+            return false;
+        }
+        char *upgradeHeader = strstr(reqBuf, "Upgrade: websocket");
+        if (upgradeHeader)
         {
-            if (c->rxLen > 100)
+            emit(c, SERVER_EVENT_CLIENT_HANDSHAKE, nullptr, 0);
+            c->last_event = SERVER_EVENT_CLIENT_HANDSHAKE;
+            char *keyHeader = strstr(reqBuf, "Sec-WebSocket-Key: ");
+            if (keyHeader)
             {
-                if (c->rxLen < MAX_WS_BUFFER)
-                    c->rxBuffer[c->rxLen] = 0;
-                if (strstr((char *)c->rxBuffer, "\r\n\r\n"))
+                keyHeader += 19;
+                char *keyEnd = strstr(keyHeader, "\r\n");
+                if (keyEnd)
                 {
-                    char *reqBuf = (char *)c->rxBuffer;
-                    char *upgradeHeader = strstr(reqBuf, "Upgrade: websocket");
-                    if (upgradeHeader)
-                    {
-                        if (s->_onEvent)
-                            s->_onEvent(c, SERVER_EVENT_CLIENT_HANDSHAKE, nullptr, 0);
-                        c->last_event = SERVER_EVENT_CLIENT_HANDSHAKE;
-                        char *keyHeader = strstr(reqBuf, "Sec-WebSocket-Key: ");
-                        if (keyHeader)
-                        {
-                            keyHeader += 19;
-                            char *keyEnd = strstr(keyHeader, "\r\n");
-                            if (keyEnd)
-                            {
-                                char clientKey[64];
-                                size_t keyLen = keyEnd - keyHeader;
-                                if (keyLen > 63)
-                                    keyLen = 63;
-                                strncpy(clientKey, keyHeader, keyLen);
-                                clientKey[keyLen] = 0;
-                                char acceptKey[64];
-                                NuCrypto::getAcceptKey(clientKey, acceptKey, sizeof(acceptKey));
-                                char respHead[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
-                                tcp_write(pcb, respHead, strlen(respHead), TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
-                                tcp_write(pcb, acceptKey, strlen(acceptKey), TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
-                                tcp_write(pcb, "\r\n\r\n", 4, TCP_WRITE_FLAG_COPY);
-                                tcp_output(pcb);
-                                c->state = NuClient::STATE_CONNECTED;
-                                c->rxLen = 0;
-                                if (s->_onEvent)
-                                    s->_onEvent(c, SERVER_EVENT_CLIENT_CONNECTED, nullptr, 0);
-                                c->last_event = SERVER_EVENT_CLIENT_CONNECTED;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        if (s->_onEvent)
-                            s->_onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Invalid Handshake", 17);
-                        c->last_event = SERVER_EVENT_ERROR;
-                    }
+                    char clientKey[64];
+                    size_t keyLen = keyEnd - keyHeader;
+                    if (keyLen > 63)
+                        keyLen = 63;
+                    strncpy(clientKey, keyHeader, keyLen);
+                    clientKey[keyLen] = 0;
+                    char acceptKey[64];
+                    NuCrypto::getAcceptKey(clientKey, acceptKey, sizeof(acceptKey));
+                    char respHead[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+                    tcp_write(c->pcb, respHead, strlen(respHead), TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+                    tcp_write(c->pcb, acceptKey, strlen(acceptKey), TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE);
+                    tcp_write(c->pcb, "\r\n\r\n", 4, TCP_WRITE_FLAG_COPY);
+                    tcp_output(c->pcb);
+#ifdef NUSOCK_LWIP_ZERO_COPY
+                    c->txQueue.skip(strlen(respHead) + strlen(acceptKey) + 4);
+#endif
+                    c->state = NuClient::STATE_CONNECTED;
+                    // Frames sent right behind the request stay in the buffer
+                    c->consumeRx(reqEnd + 4 - reqBuf);
+                    c->resizeRx(c->bufferConfig.frameBufferSize);
+                    emit(c, SERVER_EVENT_CLIENT_CONNECTED, nullptr, 0);
+                    c->last_event = SERVER_EVENT_CLIENT_CONNECTED;
+                    return NuFrameParser::process(c, true, frameHandler, this);
                 }
             }
         }
         else
         {
-            s->lwip_process(c);
+            emit(c, SERVER_EVENT_ERROR, (const uint8_t *)"Invalid Handshake", 17);
+            c->last_event = SERVER_EVENT_ERROR;
         }
-        return ERR_OK;
+        return true;
     }
     static err_t cb_accept(void *arg, struct tcp_pcb *newpcb, err_t err)
     {
         NuSockServer *s = (NuSockServer *)arg;
-        s->myLock.lock();
-        NuClient *c = new NuClient(s, newpcb);
-        c->index = s->clients.size();
-        s->clients.push_back(c);
+        NuClient *c = new NuClient(s, newpcb, s->_bufferConfig);
+        if (!c->rxBuffer || !c->flushMsg.init(static_flush_client, c) || !c->closeMsg.init(static_close_client, c) ||
+            !s->clients.add(c))
+        {
+            delete c;
+            tcp_abort(newpcb);
+            return ERR_ABRT;
+        }
         tcp_arg(newpcb, c);
         tcp_recv(newpcb, cb_recv);
-        tcp_sent(newpcb, [](void *arg, struct tcp_pcb *pcb, u16_t len) -> err_t
-                 { tcpip_callback(static_flush_client, arg); return ERR_OK; });
+        tcp_sent(newpcb, cb_sent);
+        tcp_poll(newpcb, cb_poll, 2);
+#ifdef NUSOCK_LWIP_ZERO_COPY
+        c->txQueue.holdUntilAck = true;
+#endif
         ip_set_option(newpcb, SOF_KEEPALIVE);
-        s->myLock.unlock();
         return ERR_OK;
     }
+    static void static_resume(void *arg)
+    {
+        NuSockServer *s = (NuSockServer *)arg;
+        NuClientTable::View v(s->clients);
+        for (size_t i = 0; i < v.size(); i++)
+        {
+            NuClient *c = v[i];
+            if (!c->detached && (c->rxHeld || c->rxPaused) && !c->closeRequested)
+                resume_recv(c);
+        }
+    }
+
     static void static_begin(void *arg)
     {
         NuSockServer *s = (NuSockServer *)arg;
@@ -492,8 +829,7 @@ private:
             s->server_pcb = tcp_listen(s->server_pcb);
             tcp_arg(s->server_pcb, s);
             tcp_accept(s->server_pcb, cb_accept);
-            if (s->_onEvent)
-                s->_onEvent(nullptr, SERVER_EVENT_CONNECT, nullptr, 0);
+            s->emit(nullptr, SERVER_EVENT_CONNECT, nullptr, 0);
         }
     }
     static void static_stop(void *arg)
@@ -509,34 +845,47 @@ private:
 
 #ifndef NUSOCK_USE_LWIP
 
-    void generic_process(NuClient *c)
+    // Read pending bytes into the receive buffer (bounded by the free space)
+    size_t readClient(NuClient *c)
     {
-        if (!c->rxBuffer)
-            return;
-
-        while (c->client && c->client->connected() && c->client->available())
+        size_t total = 0;
+        while (c->client && c->client->connected())
         {
-            int byte = c->client->read();
-            if (byte == -1)
+            int pending = c->client->available();
+            if (pending <= 0)
+                break;
+            size_t room = c->reserveRx(pending);
+            if (room == 0)
                 break;
-            if (c->rxLen < MAX_WS_BUFFER)
-                c->rxBuffer[c->rxLen++] = (uint8_t)byte;
+            int n = c->client->read(c->rxBuffer + c->rxLen, room);
+            if (n <= 0)
+                break;
+            c->rxLen += n;
+            total += n;
         }
+        return total;
+    }
+
+    void generic_process(NuClient *c)
+    {
+        if (!c->rxBuffer)
+            return;
 
         if (c->state == NuClient::STATE_HANDSHAKE)
         {
+            readClient(c);
             if (c->rxLen > 0)
             {
-                if (c->rxLen < MAX_WS_BUFFER)
+                if (c->rxLen < c->rxCap)
                     c->rxBuffer[c->rxLen] = 0;
                 char *reqBuf = (char *)c->rxBuffer;
-                if (strstr(reqBuf, "\r\n\r\n"))
+                char *reqEnd = strstr(reqBuf, "\r\n\r\n");
+                if (reqEnd)
                 {
                     char *upgradePtr = strstr(reqBuf, "Upgrade: websocket");
                     if (upgradePtr)
                     {
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_CLIENT_HANDSHAKE, nullptr, 0);
+                        emit(c, SERVER_EVENT_CLIENT_HANDSHAKE, nullptr, 0);
                         c->last_event = SERVER_EVENT_CLIENT_HANDSHAKE;
 
                         char *keyStart = strstr(reqBuf, "Sec-WebSocket-Key: ");
@@ -561,18 +910,20 @@ private:
                                 c->client->print("\r\n\r\n");
 
                                 c->state = NuClient::STATE_CONNECTED;
-                                c->rxLen = 0;
+                                // Frames sent right behind the request stay in the buffer
+                                c->consumeRx(reqEnd + 4 - reqBuf);
+                                c->resizeRx(c->bufferConfig.frameBufferSize);
 
-                                if (_onEvent)
-                                    _onEvent(c, SERVER_EVENT_CLIENT_CONNECTED, nullptr, 0);
+                                emit(c, SERVER_EVENT_CLIENT_CONNECTED, nullptr, 0);
                                 c->last_event = SERVER_EVENT_CLIENT_CONNECTED;
+                                if (c->rxAvailable() > 0 && !NuFrameParser::process(c, true, frameHandler, this))
+                                    return;
                             }
                         }
                     }
                     else
                     {
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Invalid Handshake", 17);
+                        emit(c, SERVER_EVENT_ERROR, (const uint8_t *)"Invalid Handshake", 17);
                         c->last_event = SERVER_EVENT_ERROR;
                     }
                 }
@@ -580,311 +931,141 @@ private:
         }
         else
         {
-            while (c->rxLen > 0)
+#ifdef NUSOCK_DISPATCH
+            if (c->rxPaused)
             {
-                if (c->rxLen < 2)
-                    return;
-
-                uint8_t opcode = c->rxBuffer[0] & 0x0F;
-                bool isFin = (c->rxBuffer[0] & 0x80);
-                uint8_t lenByte = c->rxBuffer[1] & 0x7F;
-                bool isMasked = (c->rxBuffer[1] & 0x80);
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                // RSV bit check
-                if ((c->rxBuffer[0] & 0x70) != 0)
+                // Resume once loop() has made room in the dispatch queue
+                if (_events.full())
                 {
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"RSV Error", 9);
-                    c->last_event = SERVER_EVENT_ERROR;
-                    c->client->stop();
-                    return;
-                }
-                // Strict masking check
-                if (!isMasked)
-                {
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Mask Error", 10);
-                    c->last_event = SERVER_EVENT_ERROR;
-                    c->client->stop();
+                    flushClient(c);
                     return;
                 }
+                c->rxPaused = false;
+            }
 #endif
-
-                size_t headerSize = 2;
-                size_t payloadLen = lenByte;
-                if (payloadLen == 126)
-                {
-                    if (c->rxLen < 4)
-                        return;
-                    payloadLen = (c->rxBuffer[2] << 8) | c->rxBuffer[3];
-                    headerSize += 2;
-                }
-                else if (payloadLen == 127)
-                {
-                    // Frame too large / 64-bit not supported in basic implementation
-                    c->client->stop();
+            // Parse what a paused receiver left in the buffer, then read as much
+            // as the receive buffer can hold and parse it
+            if (c->rxAvailable() > 0 && !NuFrameParser::process(c, true, frameHandler, this))
+                return;
+            while (readClient(c) > 0)
+            {
+                if (!NuFrameParser::process(c, true, frameHandler, this))
                     return;
-                }
+            }
+        }
 
-                if (isMasked)
-                    headerSize += 4;
+        flushClient(c);
+    }
 
-                size_t totalFrameSize = headerSize + payloadLen;
-                if (c->rxLen < totalFrameSize)
-                    return;
+    // Accept new connections and serve the connected clients (loop() or the network task)
+    void generic_loop()
+    {
+        if (!_genericServerRef || !_acceptFunc)
+            return;
 
-                size_t maskOffset = headerSize - 4;
+        NuClient *newClient = _acceptFunc(_genericServerRef, this);
 
-                // Control frame handling
-                if (opcode >= 0x8)
-                {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                    // Control frames cannot be fragmented or > 125 bytes
-                    if (!isFin || payloadLen > 125)
-                    {
-                        c->client->stop();
-                        return;
-                    }
+        if (newClient)
+        {
+            if (!newClient->client || !newClient->client->connected())
+            {
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdelete-non-virtual-dtor"
 #endif
-
-                    // Unmask control frame (in place)
-                    if (isMasked)
-                    {
-                        uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1], c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                        uint8_t *ctrlPayload = &c->rxBuffer[headerSize];
-                        for (size_t i = 0; i < payloadLen; i++)
-                            ctrlPayload[i] ^= mask[i % 4];
-                    }
-                    uint8_t *ctrlPayload = &c->rxBuffer[headerSize];
-
-                    // Close Handshake Handling
-                    if (opcode == 0x8)
+                delete newClient;
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+            }
+            else
+            {
+                // Duplicate check
+                bool duplicate = false;
+                NuClientTable::View v(clients);
+                for (size_t i = 0; i < v.size(); i++)
+                {
+                    if (!v[i]->detached && v[i]->client && v[i]->client->connected())
                     {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
-                        // Protocol Error
-                        if (payloadLen == 1)
-                        {
-                            c->client->stop();
-                            return;
-                        }
-
-                        // We initiated close (State is CLOSING)
-                        if (c->state == NuClient::STATE_CLOSING)
-                        {
-                            c->client->stop();
-                            removeClient(c);
-                            return;
-                        }
-
-                        // Client initiated close (State is CONNECTED)
-                        // Echo close frame
-                        buildFrame(c, 0x8, true, ctrlPayload, payloadLen);
-                        if (c->txBuffer && c->txLen > 0)
+                        if (v[i]->remoteIP == newClient->remoteIP &&
+                            v[i]->remotePort == newClient->remotePort)
                         {
-                            c->client->write(c->txBuffer, c->txLen);
-                            c->clearTx();
+                            duplicate = true;
+                            break;
                         }
-
-                        if (_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
-                            _onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, ctrlPayload, payloadLen);
-                        c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
-
-                        c->client->stop();
-                        return;
-#else
-                        if (_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
-                            _onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, nullptr, 0);
-                        c->client->stop();
-                        c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
-                        return;
-#endif
-                    }
-                    else if (opcode == 0x9)
-                    {
-                        // Ping -> Pong
-                        buildFrame(c, 0xA, true, ctrlPayload, payloadLen);
                     }
-
-                    // Strip control frame
-                    size_t rem = c->rxLen - totalFrameSize;
-                    if (rem > 0)
-                        memmove(c->rxBuffer, c->rxBuffer + totalFrameSize, rem);
-                    c->rxLen -= totalFrameSize;
-                    continue;
                 }
 
-                // Data frame handling
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                // Streaming fragmentation logic
-                if (opcode > 0) // New data frame
+                if (duplicate)
                 {
-                    if (c->fragmentOpcode != 0)
-                    {
-                        c->client->stop();
-                        return; // Error: Nested fragmentation
-                    }
-
-                    // Unmask payload
-                    if (isMasked)
-                    {
-                        uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1], c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                        uint8_t *payload = &c->rxBuffer[headerSize];
-                        for (size_t i = 0; i < payloadLen; i++)
-                            payload[i] ^= mask[i % 4];
-                    }
-                    uint8_t *payload = &c->rxBuffer[headerSize];
-
-                    // Strict UTF-8 validation
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                    if (opcode == 0x1)
-                    {
-                        if (!NuUTF8::validate(c->utf8State, payload, payloadLen))
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Invalid UTF-8", 13);
-                            // RFC 6455 1007: Invalid frame payload data
-                            c->client->stop();
-                            return;
-                        }
-                    }
-#endif
 
-                    if (!isFin)
-                    {
-                        // Start of fragmentation
-                        c->fragmentOpcode = opcode;
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_FRAGMENT_START, payload, payloadLen);
-                    }
-                    else
-                    {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                        // If FIN check validation state is accept
-                        if (opcode == 0x1 && c->utf8State != NuUTF8::UTF8_ACCEPT)
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Truncated UTF-8", 15);
-                            c->client->stop();
-                            return;
-                        }
-                        c->utf8State = 0; // Reset for next message
-#endif
+                    // Safe duplicate cleanup
+                    // Ethernet (Teensy/Mega/STM32) and WiFiS3 (R4) clients must be deleted to avoid leaks.
+                    // WiFi101 (MKR1000) and WiFiNINA clients must not be deleted to avoid closing the socket.
 
-                        // Normal complete message
-                        if (opcode == 0x1 && _onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                        else if (opcode == 0x2 && _onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                    }
-                }
-                else if (opcode == 0) // Continuation frame
-                {
-                    if (c->fragmentOpcode == 0)
-                    {
-                        c->client->stop();
-                        return; // Error: Orphan continuation
-                    }
+                    Client *rawWrapper = newClient->client;
 
-                    // Unmask payload
-                    if (isMasked)
-                    {
-                        uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1], c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                        uint8_t *payload = &c->rxBuffer[headerSize];
-                        for (size_t i = 0; i < payloadLen; i++)
-                            payload[i] ^= mask[i % 4];
-                    }
-                    uint8_t *payload = &c->rxBuffer[headerSize];
+                    // Detach from NuClient to prevent stop() call in ~NuClient destructor
+                    newClient->client = nullptr;
 
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                    if (c->fragmentOpcode == 0x1)
-                    {
-                        if (!NuUTF8::validate(c->utf8State, payload, payloadLen))
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Invalid UTF-8", 13);
-                            c->client->stop();
-                            return;
-                        }
-                    }
+                    // Delete NuClient container
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdelete-non-virtual-dtor"
 #endif
-
-                    if (!isFin)
-                    {
-                        // Middle fragment
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_FRAGMENT_CONT, payload, payloadLen);
-                    }
-                    else
-                    {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                        if (c->fragmentOpcode == 0x1 && c->utf8State != NuUTF8::UTF8_ACCEPT)
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Truncated UTF-8", 15);
-                            c->client->stop();
-                            return;
-                        }
-                        c->utf8State = 0;
+                    delete newClient;
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
 #endif
 
-                        // End of fragmentation
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_FRAGMENT_FIN, payload, payloadLen);
-                        c->fragmentOpcode = 0; // Reset state
-                    }
-                }
+// Delete the wrapper for Safe Platforms (Ethernet/S3)
+#if defined(ARDUINO_UNOR4_WIFI) || defined(TEENSYDUINO) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO_ARCH_AVR) || defined(ESP32) || defined(ESP8266)
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdelete-non-virtual-dtor"
+#endif
+                    if (rawWrapper)
+                        delete rawWrapper;
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
 #else
-                // Legacy behavior
-                if ((opcode == 0x1 || opcode == 0x2) && isMasked)
-                {
-                    uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1], c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                    uint8_t *payload = &c->rxBuffer[headerSize];
-                    for (size_t i = 0; i < payloadLen; i++)
-                        payload[i] ^= mask[i % 4];
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                    if (opcode == 0x1)
-                    {
-                        uint32_t tempState = 0;
-                        if (!NuUTF8::validate(tempState, payload, payloadLen) || tempState != NuUTF8::UTF8_ACCEPT)
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Invalid UTF-8", 13);
-                            c->client->stop();
-                            return;
-                        }
-                    }
+                    (void)rawWrapper; // Keep it alive for NINA/101
 #endif
-
-                    if (opcode == 0x1)
-                    {
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                        c->last_event = SERVER_EVENT_MESSAGE_TEXT;
-                    }
-                    else if (opcode == 0x2)
+                }
+                else
+                {
+                    if (!newClient->rxBuffer || !clients.add(newClient))
                     {
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                        c->last_event = SERVER_EVENT_MESSAGE_BINARY;
+                        delete newClient;
                     }
                 }
-#endif
-
-                // Consume frame (remove from buffer)
-                size_t total = headerSize + payloadLen;
-                size_t rem = c->rxLen - total;
-                if (rem > 0)
-                    memmove(c->rxBuffer, &c->rxBuffer[total], rem);
-                c->rxLen = rem;
             }
         }
 
-        if (c->txBuffer && c->txLen > 0 && c->client && c->client->connected())
+        // The callbacks run without locks, other tasks keep sending meanwhile
+        NuClientTable::View v(clients);
+        for (size_t i = 0; i < v.size(); i++)
         {
-            c->client->write(c->txBuffer, c->txLen);
-            c->clearTx();
+            NuClient *c = v[i];
+            if (c->detached)
+                continue;
+            if (!c->client || !c->client->connected())
+            {
+                if (c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
+                    emit(c, SERVER_EVENT_CLIENT_DISCONNECTED, nullptr, 0);
+                c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
+                removeClient(c);
+                continue;
+            }
+            if (c->txOverflow)
+            {
+                // Closed by the slow-consumer policy, write the Close frame and drop it here
+                flushClient(c);
+                dropClient(c);
+                continue;
+            }
+            generic_process(c);
         }
     }
 #endif
@@ -912,44 +1093,71 @@ public:
      * @brief Stop the server.
      * Disconnects all connected clients, frees their resources, stops the listener,
      * and fires the SERVER_EVENT_DISCONNECTED event.
+     * In LwIP mode, if the listener cannot be closed (LwIP mailbox full),
+     * SERVER_EVENT_ERROR fires and the server keeps running.
      */
     void stop()
     {
+        stopNetworkTask();
         if (!_running)
             return;
-        myLock.lock();
-        for (size_t i = 0; i < clients.size(); i++)
-        {
-            NuClient *c = clients[i];
 #ifdef NUSOCK_USE_LWIP
-            if (c->pcb)
-            {
-                tcp_arg(c->pcb, NULL);
-                tcp_close(c->pcb);
-                c->pcb = NULL;
-            }
+        // Close the listening pcb first, no client is accepted during the cleanup
+#if defined(ESP8266) || defined(ARDUINO_ARCH_RP2040)
+        static_stop(this);
 #else
-            if (c->client)
-                c->client->stop();
+        if (tcpip_callback(static_stop, this) != ERR_OK)
+        {
+            // Still listening, stop() can be called again
+            _postFailures++;
+            emit(nullptr, SERVER_EVENT_ERROR, (const uint8_t *)"Stop Failed", 11);
+            return;
+        }
 #endif
-            if (c->rxBuffer)
-                free(c->rxBuffer);
-            delete c;
+#endif
+#ifdef NUSOCK_DISPATCH
+        // Clients only the queued events refer to are deleted without the lock
+        for (;;)
+        {
+            myLock.lock();
+            NuEventQueue::Item *e = _events.pop();
+            NuClient *c = e ? NuEventQueue::release(e) : nullptr;
+            myLock.unlock();
+            if (!e)
+                break;
+            if (c)
+                delete c;
         }
-        clients.clear();
+        myLock.lock();
+        _events.clear();
+        myLock.unlock();
+#endif
 #ifdef NUSOCK_USE_LWIP
-#if defined(ESP8266) || defined(ARDUINO_ARCH_RP2040)
-        static_stop(this);
-#else
-        tcpip_callback(static_stop, this);
+        _resumeMsg.release();
 #endif
+        {
+            NuClientTable::View v(clients);
+            for (size_t i = 0; i < v.size(); i++)
+            {
+                NuClient *c = v[i];
+#ifdef NUSOCK_USE_LWIP
+                close_pcb(c);
+                c->flushMsg.release();
+                c->closeMsg.release();
 #else
+                if (c->client)
+                    c->client->stop();
+#endif
+            }
+        }
+        // Clients still referenced by a view or a dispatched event are deleted with it
+        clients.clear();
+#ifndef NUSOCK_USE_LWIP
         _acceptFunc = nullptr;
 #endif
         _running = false;
         if (_onEvent)
             _onEvent(nullptr, SERVER_EVENT_DISCONNECTED, nullptr, 0);
-        myLock.unlock();
     }
 
 #ifdef NUSOCK_USE_LWIP
@@ -958,10 +1166,18 @@ public:
         if (_running)
             return;
         _port = port;
+        _resumeMsg.init(static_resume, this); // On failure, receivers resume from their poll callbacks
 #if defined(ESP8266) || defined(ARDUINO_ARCH_RP2040)
         static_begin(this);
 #else
-        tcpip_callback(static_begin, this);
+        if (tcpip_callback(static_begin, this) != ERR_OK)
+        {
+            // Not listening, begin() can be called again
+            _postFailures++;
+            _resumeMsg.release();
+            emit(nullptr, SERVER_EVENT_ERROR, (const uint8_t *)"Start Failed", 12);
+            return;
+        }
 #endif
         _running = true;
     }
@@ -1001,7 +1217,7 @@ public:
             {
                 // Copy the client object to heap to persist it.
                 Client *clientWrapper = new decltype(c)(c);
-                NuClient *nc = new NuClient(ns, clientWrapper, true);
+                NuClient *nc = new NuClient(ns, clientWrapper, true, ns->_bufferConfig);
                 nc->remoteIP = c.remoteIP();
                 nc->remotePort = c.remotePort();
                 return nc;
@@ -1023,191 +1239,207 @@ public:
 
         _running = true;
         if (_onEvent)
-            _onEvent(nullptr, SERVER_EVENT_CONNECT, nullptr, 0);
-    }
-#endif
-
-    /**
-     * @brief Main processing loop.
-     */
-    void loop()
-    {
-#ifndef NUSOCK_USE_LWIP
-        if (!_genericServerRef || !_acceptFunc)
-            return;
-
-        NuClient *newClient = _acceptFunc(_genericServerRef, this);
-
-        if (newClient)
-        {
-            if (!newClient->client || !newClient->client->connected())
-            {
-#if defined(__GNUC__)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdelete-non-virtual-dtor"
+            _onEvent(nullptr, SERVER_EVENT_CONNECT, nullptr, 0);
+    }
 #endif
-                delete newClient;
-#if defined(__GNUC__)
-#pragma GCC diagnostic pop
+
+    /**
+     * @brief Main processing loop.
+     */
+    void loop()
+    {
+#if defined(NUSOCK_NETWORK_TASK)
+        if (!_task)
+            generic_loop();
+        dispatch();
+#elif defined(NUSOCK_USE_LWIP)
+        dispatch();
+#else
+        generic_loop();
 #endif
-            }
-            else
-            {
-                // Duplicate check
-                bool duplicate = false;
-                myLock.lock();
-                for (size_t i = 0; i < clients.size(); i++)
-                {
-                    if (clients[i]->client && clients[i]->client->connected())
-                    {
-                        if (clients[i]->remoteIP == newClient->remoteIP &&
-                            clients[i]->remotePort == newClient->remotePort)
-                        {
-                            duplicate = true;
-                            break;
-                        }
-                    }
-                }
+    }
 
-                if (duplicate)
-                {
+    /**
+     * @brief Register a callback function for server events.
+     * @param cb Function pointer matching the NuServerEventCallback signature.
+     */
+    void onEvent(NuServerEventCallback cb) { _onEvent = cb; }
 
-                    // Safe duplicate cleanup
-                    // Ethernet (Teensy/Mega/STM32) and WiFiS3 (R4) clients must be deleted to avoid leaks.
-                    // WiFi101 (MKR1000) and WiFiNINA clients must not be deleted to avoid closing the socket.
+    /**
+     * @brief Enable automatic fragmentation of large messages.
+     * Messages sent with send() that are larger than the fragment size are split into
+     * a first frame and continuation frames, so large payloads can be sent without
+     * sendFragmentStart/Cont/Fin.
+     * @param fragmentSize Maximum payload per frame, 0 to disable (default).
+     * NUSOCK_FRAGMENT_SIZE sizes the frames to the transport (TCP MSS on LwIP).
+     */
+    void setFragmentSize(size_t fragmentSize) { _fragmentSize = fragmentSize; }
 
-                    Client *rawWrapper = newClient->client;
+    /**
+     * @brief Set the buffer sizes and the message size limit of this server.
+     * Applies to connections opened afterwards.
+     * @param config Handshake and frame receive buffer sizes, maximum message size
+     * (0 = no limit) and initial transmit buffer capacity. frameBufferSize is
+     * raised to NUSOCK_MIN_FRAME_BUFFER (139 bytes) if smaller.
+     */
+    void setBufferConfig(const NuBufferConfig &config)
+    {
+        _bufferConfig = config;
+        if (_bufferConfig.frameBufferSize < NUSOCK_MIN_FRAME_BUFFER)
+            _bufferConfig.frameBufferSize = NUSOCK_MIN_FRAME_BUFFER;
+    }
 
-                    // Detach from NuClient to prevent stop() call in ~NuClient destructor
-                    newClient->client = nullptr;
+    /**
+     * @brief Get the buffer configuration of this server.
+     */
+    const NuBufferConfig &getBufferConfig() const { return _bufferConfig; }
 
-                    // Delete NuClient container
-#if defined(__GNUC__)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdelete-non-virtual-dtor"
-#endif
-                    delete newClient;
-#if defined(__GNUC__)
-#pragma GCC diagnostic pop
-#endif
+    /**
+     * @brief Get the number of flush/close requests that could not be posted to the
+     * network thread (LwIP mode, always 0 otherwise). They are retried from the
+     * connection's poll callback, so a non-zero count means delayed, not lost.
+     * A failed begin() or stop() is counted too and reported with SERVER_EVENT_ERROR.
+     */
+    uint32_t getPostFailures() const { return _postFailures; }
 
-// Delete the wrapper for Safe Platforms (Ethernet/S3)
-#if defined(ARDUINO_UNOR4_WIFI) || defined(TEENSYDUINO) || defined(ARDUINO_ARCH_STM32) || defined(ARDUINO_ARCH_AVR) || defined(ESP32) || defined(ESP8266)
-#if defined(__GNUC__)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdelete-non-virtual-dtor"
-#endif
-                    if (rawWrapper)
-                        delete rawWrapper;
-#if defined(__GNUC__)
-#pragma GCC diagnostic pop
-#endif
+    /**
+     * @brief Run the event callbacks from loop() instead of the network thread (LwIP mode).
+     * The lwIP thread then only parses the received data and queues the events with a
+     * copy of their payload, loop() runs the callbacks on the application task, so a
+     * slow callback does not stall the TCP/IP stack. Once the queued payloads reach
+     * maxBytes, the receivers are paused and the peers are slowed down by their TCP
+     * window until loop() has caught up. The events of a client are delivered before it
+     * is deleted. Each event is queued with its NuClient::rxStream and fragmentOpcode,
+     * they are restored when it is dispatched.
+     * In Generic mode the callbacks run from loop() anyway, the queue is used by the
+     * network task (see startNetworkTask()).
+     * @param maxBytes Payload bytes queued before receiving is paused, 0 to disable (default).
+     */
+    void setDispatchQueue(size_t maxBytes)
+    {
+#ifdef NUSOCK_DISPATCH
+        myLock.lock();
+        _events.limit = maxBytes;
+        myLock.unlock();
 #else
-                    (void)rawWrapper; // Keep it alive for NINA/101
+        (void)maxBytes;
 #endif
-                }
-                else
-                {
-                    if (newClient->rxBuffer)
-                    {
-                        newClient->index = clients.size();
-                        clients.push_back(newClient);
-                    }
-                    else
-                    {
-                        delete newClient;
-                    }
-                }
-                myLock.unlock();
-            }
-        }
+    }
 
+    /**
+     * @brief Run the I/O loop of the server in its own FreeRTOS task (ESP32).
+     * The task accepts the connections, reads, parses and writes; the events are queued
+     * with the dispatch queue (NUSOCK_DISPATCH_QUEUE_SIZE bytes unless setDispatchQueue()
+     * was called) and loop() only runs their callbacks, each with the NuClient::rxStream
+     * and fragmentOpcode it was queued with, while the task parses ahead. Messages sent
+     * from the application are queued and written by the task. Call after begin().
+     * In LwIP mode the TCP/IP thread is already the network task (its core is set by
+     * CONFIG_LWIP_TCPIP_TASK_AFFINITY), only the dispatch queue is enabled.
+     * @param core Core the task is pinned to, tskNO_AFFINITY (or a core the chip does
+     * not have) to let the scheduler choose.
+     * @param priority FreeRTOS priority of the task.
+     * @param stackSize Stack size of the task in bytes.
+     * @return true if the task is running, false if it could not be created or the
+     * platform has no network task.
+     */
+    bool startNetworkTask(int core = NUSOCK_TASK_CORE, uint8_t priority = NUSOCK_TASK_PRIORITY, uint32_t stackSize = NUSOCK_TASK_STACK_SIZE)
+    {
+#ifdef NUSOCK_DISPATCH
         myLock.lock();
-        for (size_t i = 0; i < clients.size(); i++)
+        if (!_events.enabled())
+            _events.limit = NUSOCK_DISPATCH_QUEUE_SIZE;
+        myLock.unlock();
+#endif
+#if defined(NUSOCK_NETWORK_TASK)
+        if (_task)
+            return true;
+        if (core < 0 || core >= portNUM_PROCESSORS)
+            core = tskNO_AFFINITY;
+        _taskRunning = true;
+        TaskHandle_t task = nullptr;
+        if (xTaskCreatePinnedToCore(networkTask, "NuSockServer", stackSize, this, priority, &task, core) != pdPASS)
         {
-            NuClient *c = clients[i];
-            if (!c->client || !c->client->connected())
-            {
-                if (_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
-                    _onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, nullptr, 0);
-                c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
-                removeClient(c);
-                i--;
-                continue;
-            }
-            generic_process(c);
+            _taskRunning = false;
+            return false;
         }
-        myLock.unlock();
+        _task = task;
+        return true;
+#elif defined(NUSOCK_USE_LWIP)
+        (void)core;
+        (void)priority;
+        (void)stackSize;
+        return true;
+#else
+        (void)core;
+        (void)priority;
+        (void)stackSize;
+        return false;
 #endif
     }
 
     /**
-     * @brief Register a callback function for server events.
-     * @param cb Function pointer matching the NuServerEventCallback signature.
+     * @brief Stop the network task and wait until it has finished its pass.
+     * loop() serves the connections again afterwards. Called by stop().
      */
-    void onEvent(NuServerEventCallback cb) { _onEvent = cb; }
+    void stopNetworkTask()
+    {
+#ifdef NUSOCK_NETWORK_TASK
+        if (!_task || xTaskGetCurrentTaskHandle() == _task)
+            return;
+        _taskRunning = false;
+        while (_task)
+            vTaskDelay(1);
+#endif
+    }
+
+    /**
+     * @brief Set what happens to messages for a client whose transmit queue would
+     * exceed NuBufferConfig::txHighWatermark (no effect without a watermark).
+     * @param policy SLOW_CONSUMER_BLOCK (default, the send is rejected),
+     * SLOW_CONSUMER_DROP_OLDEST, SLOW_CONSUMER_LATEST_WINS (see sendKeyed())
+     * or SLOW_CONSUMER_CLOSE (status 1008).
+     */
+    void setSlowConsumerPolicy(NuSlowConsumerPolicy policy) { _slowPolicy = policy; }
+
+    /**
+     * @brief Get the rejected, dropped, replaced and closed counters of the slow-consumer policy.
+     */
+    NuSlowConsumerStats getSlowConsumerStats() const { return _slowStats; }
 
     /**
      * @brief Broadcast a text message to ALL connected clients.
+     * Clients above their high watermark (NuBufferConfig::txHighWatermark) are skipped.
      * @param msg Null-terminated string to broadcast.
+     * @return true if the message was queued on every connected client.
      */
-    void send(const char *msg)
+    bool send(const char *msg)
     {
-        myLock.lock();
-        size_t len = strlen(msg);
-        for (size_t i = 0; i < clients.size(); i++)
-        {
-            NuClient *c = clients[i];
-            if (c->state != NuClient::STATE_CONNECTED)
-                continue;
-            buildFrame(c, 0x1, true, (const uint8_t *)msg, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
-        }
-        myLock.unlock();
+        return broadcast(0x1, (const uint8_t *)msg, strlen(msg));
     }
 
     /**
      * @brief Broadcast a binary message to ALL connected clients.
+     * Clients above their high watermark (NuBufferConfig::txHighWatermark) are skipped.
      * @param data Pointer to the data buffer.
      * @param len Length of the data to broadcast.
+     * @return true if the message was queued on every connected client.
      */
-    void send(const uint8_t *data, size_t len)
+    bool send(const uint8_t *data, size_t len)
     {
-        myLock.lock();
-        for (size_t i = 0; i < clients.size(); i++)
-        {
-            NuClient *c = clients[i];
-            if (c->state != NuClient::STATE_CONNECTED)
-                continue;
-            buildFrame(c, 0x2, true, data, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
-        }
-        myLock.unlock();
+        return broadcast(0x2, data, len);
     }
 
     /**
      * @brief Send a text message to a specific client by internal index.
      * @param index The index of the client in the internal list.
      * @param msg Null-terminated string to send.
+     * @return true if the message was queued.
+     * @return false if the client is not connected, is above its high watermark
+     * (SERVER_EVENT_WRITABLE follows once it drains) or memory is low.
      */
-    void send(int index, const char *msg)
+    bool send(int index, const char *msg)
     {
-        if (index >= (int)clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-        {
-            buildFrame(c, 0x1, true, (const uint8_t *)msg, strlen(msg));
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
-        }
-        myLock.unlock();
+        return sendIndex(index, 0x1, false, true, (const uint8_t *)msg, strlen(msg));
     }
 
     /**
@@ -1215,21 +1447,11 @@ public:
      * @param index The index of the client in the internal list.
      * @param data Pointer to the data buffer.
      * @param len Length of the data to send.
+     * @return true if the message was queued (see send(int, const char *)).
      */
-    void send(int index, const uint8_t *data, size_t len)
+    bool send(int index, const uint8_t *data, size_t len)
     {
-        if (index >= (int)clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-        {
-            buildFrame(c, 0x2, true, data, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
-        }
-        myLock.unlock();
+        return sendIndex(index, 0x2, false, true, data, len);
     }
 
     /**
@@ -1237,23 +1459,11 @@ public:
      * The ID is usually assigned by the user logic or extracted from the handshake.
      * @param targetId The ID string to match.
      * @param msg Null-terminated string to send.
+     * @return true if the message was queued on every matching client.
      */
-    void send(const char *targetId, const char *msg)
+    bool send(const char *targetId, const char *msg)
     {
-        myLock.lock();
-        size_t len = strlen(msg);
-        for (size_t i = 0; i < clients.size(); i++)
-        {
-            NuClient *c = clients[i];
-            if (c->state == NuClient::STATE_CONNECTED && strcmp(c->id, targetId) == 0)
-            {
-                buildFrame(c, 0x1, true, (const uint8_t *)msg, len);
-#ifdef NUSOCK_USE_LWIP
-                tcpip_callback(static_flush_client, c);
-#endif
-            }
-        }
-        myLock.unlock();
+        return sendId(targetId, 0x1, (const uint8_t *)msg, strlen(msg));
     }
 
     /**
@@ -1261,22 +1471,141 @@ public:
      * @param targetId The ID string to match.
      * @param data Pointer to the data buffer.
      * @param len Length of the data to send.
+     * @return true if the message was queued on every matching client.
      */
-    void send(const char *targetId, const uint8_t *data, size_t len)
+    bool send(const char *targetId, const uint8_t *data, size_t len)
     {
-        myLock.lock();
-        for (size_t i = 0; i < clients.size(); i++)
-        {
-            NuClient *c = clients[i];
-            if (c->state == NuClient::STATE_CONNECTED && strcmp(c->id, targetId) == 0)
-            {
-                buildFrame(c, 0x2, true, data, len);
-#ifdef NUSOCK_USE_LWIP
-                tcpip_callback(static_flush_client, c);
-#endif
-            }
-        }
-        myLock.unlock();
+        return sendId(targetId, 0x2, data, len);
+    }
+
+    /**
+     * @brief Broadcast a text message that supersedes queued messages with the same key.
+     * With SLOW_CONSUMER_LATEST_WINS, a slow client keeps only the newest unsent
+     * message per key (e.g. one key per sensor). Otherwise the same as send().
+     * @param key Message key, non-zero.
+     * @param msg Null-terminated string to broadcast.
+     * @return true if the message was queued on every connected client.
+     */
+    bool sendKeyed(uint32_t key, const char *msg)
+    {
+        return broadcast(0x1, (const uint8_t *)msg, strlen(msg), key);
+    }
+
+    /**
+     * @brief Broadcast a binary message that supersedes queued messages with the same key.
+     * @param key Message key, non-zero.
+     * @param data Pointer to the data buffer.
+     * @param len Length of the data to broadcast.
+     * @return true if the message was queued on every connected client.
+     */
+    bool sendKeyed(uint32_t key, const uint8_t *data, size_t len)
+    {
+        return broadcast(0x2, data, len, key);
+    }
+
+    /**
+     * @brief Send a text message to a specific client, superseding its queued messages with the same key.
+     * @param index The index of the client in the internal list.
+     * @param key Message key, non-zero.
+     * @param msg Null-terminated string to send.
+     * @return true if the message was queued.
+     */
+    bool sendKeyed(int index, uint32_t key, const char *msg)
+    {
+        return sendIndex(index, 0x1, false, true, (const uint8_t *)msg, strlen(msg), key);
+    }
+
+    /**
+     * @brief Send a binary message to a specific client, superseding its queued messages with the same key.
+     * @param index The index of the client in the internal list.
+     * @param key Message key, non-zero.
+     * @param data Pointer to the data buffer.
+     * @param len Length of the data to send.
+     * @return true if the message was queued.
+     */
+    bool sendKeyed(int index, uint32_t key, const uint8_t *data, size_t len)
+    {
+        return sendIndex(index, 0x2, false, true, data, len, key);
+    }
+
+    /**
+     * @brief Broadcast a prepared message to ALL connected clients.
+     * The encoded frames are queued by reference, nothing is encoded or copied.
+     * Clients above their high watermark (NuBufferConfig::txHighWatermark) are skipped.
+     * @param msg The prepared message.
+     * @return true if the message was queued on every connected client.
+     */
+    bool send(const NuPreparedMessage &msg)
+    {
+        return broadcastPrepared(msg);
+    }
+
+    /**
+     * @brief Send a prepared message to a specific client by internal index.
+     * @param index The index of the client in the internal list.
+     * @param msg The prepared message.
+     * @return true if the message was queued (see send(int, const char *)).
+     */
+    bool send(int index, const NuPreparedMessage &msg)
+    {
+        NuClientTable::View v(clients);
+        NuClient *c = v.at(index);
+        return c && sendPrepared(c, msg);
+    }
+
+    /**
+     * @brief Broadcast a prepared message that supersedes queued messages with the same key.
+     * @param key Message key, non-zero.
+     * @param msg The prepared message.
+     * @return true if the message was queued on every connected client.
+     */
+    bool sendKeyed(uint32_t key, const NuPreparedMessage &msg)
+    {
+        return broadcastPrepared(msg, key);
+    }
+
+    /**
+     * @brief Start a message to a specific client that is written with print() or printf().
+     * The output is encoded in place into the frame (see NuMessageWriter) and sent
+     * as continuation frames when it exceeds the fragment size (setFragmentSize(),
+     * NUSOCK_FRAGMENT_SIZE if not set). The message is sent by end().
+     * @param index The index of the client in the internal list.
+     * @param isBinary true for a Binary message, false for Text.
+     * @return NuMessageWriter The writer, false if the client is not connected or is
+     * above its high watermark.
+     */
+    NuMessageWriter message(int index, bool isBinary = false)
+    {
+        NuClientTable::View v(clients);
+        NuClient *c = v.at(index);
+        if (!c)
+            return NuMessageWriter();
+        bool close = false;
+        c->txLock.lock();
+        bool admitted = c->state == NuClient::STATE_CONNECTED && admit(c, 0, 0, close);
+        c->txLock.unlock();
+        if (close)
+            closeSlowConsumer(c);
+        if (!admitted)
+            return NuMessageWriter();
+        return NuMessageWriter(this, c, writerSink, isBinary ? 0x2 : 0x1, _fragmentSize ? _fragmentSize : NUSOCK_FRAGMENT_SIZE, c->txQueue.blockSize, false);
+    }
+
+    /**
+     * @brief Send a formatted text message to a specific client.
+     * The text is formatted directly into the frame, without a separate buffer.
+     * @param index The index of the client in the internal list.
+     * @param format printf() format string.
+     * @return true if the message was queued (see send(int, const char *)).
+     */
+    bool sendf(int index, const char *format, ...)
+    {
+        NuMessageWriter writer = message(index);
+        va_list args;
+        va_start(args, format);
+        writer.vprintf(format, args);
+        va_end(args);
+        return writer.end();
     }
 
     /**
@@ -1285,22 +1614,12 @@ public:
      * @param payload The first chunk of data.
      * @param len Length of the data chunk.
      * @param isBinary If true, starts a Binary message (Opcode 0x2). If false, starts Text (Opcode 0x1).
+     * @return true if the fragment was queued (a rejected fragment can be sent again later).
      */
-    void sendFragmentStart(int index, const uint8_t *payload, size_t len, bool isBinary)
+    bool sendFragmentStart(int index, const uint8_t *payload, size_t len, bool isBinary)
     {
-        if (index >= (int)clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = false, Opcode = 0x1 (Text) or 0x2 (Binary)
-            buildFrame(c, isBinary ? 0x2 : 0x1, false, payload, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
-        }
-        myLock.unlock();
+        // FIN = false, Opcode = 0x1 (Text) or 0x2 (Binary)
+        return sendIndex(index, isBinary ? 0x2 : 0x1, true, false, payload, len);
     }
 
     /**
@@ -1308,22 +1627,12 @@ public:
      * @param index The client index.
      * @param payload The data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentCont(int index, const uint8_t *payload, size_t len)
+    bool sendFragmentCont(int index, const uint8_t *payload, size_t len)
     {
-        if (index >= (int)clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = false, Opcode = 0x0 (Continuation)
-            buildFrame(c, 0x0, false, payload, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
-        }
-        myLock.unlock();
+        // FIN = false, Opcode = 0x0 (Continuation)
+        return sendIndex(index, 0x0, true, false, payload, len);
     }
 
     /**
@@ -1331,22 +1640,12 @@ public:
      * @param index The client index.
      * @param payload The last data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentFin(int index, const uint8_t *payload, size_t len)
+    bool sendFragmentFin(int index, const uint8_t *payload, size_t len)
     {
-        if (index >= (int)clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-        {
-            // FIN = true, Opcode = 0x0 (Continuation)
-            buildFrame(c, 0x0, true, payload, len);
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
-        }
-        myLock.unlock();
+        // FIN = true, Opcode = 0x0 (Continuation)
+        return sendIndex(index, 0x0, true, true, payload, len);
     }
 
     /**
@@ -1355,20 +1654,19 @@ public:
      */
     void sendPing(const char *msg = "")
     {
-        myLock.lock();
+        NuClientTable::View v(clients);
         size_t len = strlen(msg);
-        for (size_t i = 0; i < clients.size(); i++)
+        for (size_t i = 0; i < v.size(); i++)
         {
-            NuClient *c = clients[i];
-            if (c->state != NuClient::STATE_CONNECTED)
+            NuClient *c = v[i];
+            if (c->detached || c->state != NuClient::STATE_CONNECTED)
                 continue;
 
             buildFrame(c, 0x9, true, (const uint8_t *)msg, len);
 #ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
+            post_flush(c);
 #endif
         }
-        myLock.unlock();
     }
 
     /**
@@ -1378,18 +1676,15 @@ public:
      */
     void sendPing(int index, const char *msg = "")
     {
-        if (index >= (int)clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
+        NuClientTable::View v(clients);
+        NuClient *c = v.at(index);
+        if (c && c->state == NuClient::STATE_CONNECTED)
         {
             buildFrame(c, 0x9, true, (const uint8_t *)msg, strlen(msg));
 #ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
+            post_flush(c);
 #endif
         }
-        myLock.unlock();
     }
 
     /**
@@ -1401,14 +1696,15 @@ public:
      */
     void close(int index, uint16_t code = 1000, const char *reason = "")
     {
-        if (index >= (int)clients.size())
+        NuClientTable::View v(clients);
+        NuClient *c = v.at(index);
+        if (!c)
             return;
 
-        myLock.lock();
-        NuClient *c = clients[index];
-
         // Only initiate if currently connected
-        if (c->state == NuClient::STATE_CONNECTED)
+        c->txLock.lock();
+        bool open = c->state == NuClient::STATE_CONNECTED;
+        if (open)
         {
             uint8_t payload[128];
             payload[0] = (uint8_t)((code >> 8) & 0xFF);
@@ -1424,16 +1720,17 @@ public:
             }
 
             // Send Close frame
-            buildFrame(c, 0x8, true, payload, 2 + reasonLen);
-
-#ifdef NUSOCK_USE_LWIP
-            tcpip_callback(static_flush_client, c);
-#endif
+            NuFrameBuilder::build(c, 0x8, true, payload, 2 + reasonLen);
 
             // Update state to wait for Echo
             c->state = NuClient::STATE_CLOSING;
         }
-        myLock.unlock();
+        c->txLock.unlock();
+
+#ifdef NUSOCK_USE_LWIP
+        if (open)
+            post_flush(c);
+#endif
     }
 
     /**
@@ -1442,10 +1739,7 @@ public:
      */
     size_t clientCount()
     {
-        myLock.lock();
-        size_t n = clients.size();
-        myLock.unlock();
-        return n;
+        return clients.size();
     }
 };
 
@@ -15,6 +15,7 @@
 #include "NuSockConfig.h"
 #include "NuSockUtils.h"
 #include "NuSockTypes.h"
+#include "NuSockFrame.h"
 #include "vector/dynamic/DynamicVector.h"
 #include <WiFi.h>
 #include "esp_tls.h"
@@ -43,7 +44,11 @@ private:
     ReadyUtils::DynamicVector<NuClient *> clients;
     uint16_t _port;
     NuServerSecureEventCallback _onEvent = nullptr;
+    size_t _fragmentSize = 0;
+    NuBufferConfig _bufferConfig;
     bool _running = false;
+    NuSlowConsumerPolicy _slowPolicy = SLOW_CONSUMER_BLOCK;
+    NuSlowConsumerStats _slowStats;
 
     // Server socket
     int _serverSock = -1;
@@ -105,27 +110,220 @@ private:
             delete c;
     }
 
-    void buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
+    bool buildFrame(NuClient *c, uint8_t opcode, bool isFin, const uint8_t *data, size_t len)
     {
-        uint8_t firstByte = opcode & 0x0F;
-        if (isFin)
+        return NuFrameBuilder::build(c, opcode, isFin, data, len);
+    }
+
+    bool buildMessage(NuClient *c, uint8_t opcode, const uint8_t *data, size_t len)
+    {
+        return NuFrameBuilder::buildMessage(c, opcode, data, len, _fragmentSize, false);
+    }
+
+    // Write the pending TX data in order, stops when the socket would block
+    void flushClient(NuClient *c, NuSSLClient *sc)
+    {
+        const uint8_t *data;
+        size_t len;
+        while ((data = c->txPeek(len)) != nullptr)
         {
-            firstByte |= 0x80;
+            int sent = esp_tls_conn_write(sc->tls, data, len);
+            if (sent <= 0)
+                break;
+            c->txConsume(sent);
         }
-        c->appendTx(firstByte);
+        if (c->txWritable() && _onEvent)
+            _onEvent(c, SERVER_EVENT_WRITABLE, nullptr, 0);
+    }
 
-        if (len <= 125)
+    // Apply the high watermark and the slow-consumer policy to a message for a client
+    bool admit(NuClient *c, size_t len, uint32_t key)
+    {
+        if (c->txAdmit(len, _slowPolicy, key, &_slowStats))
+            return true;
+        if (_slowPolicy == SLOW_CONSUMER_CLOSE)
         {
-            c->appendTx((uint8_t)len);
+            // Close with status 1008 (Policy Violation), the client is removed by loop()
+            uint8_t closeFrame[125];
+            buildFrame(c, 0x8, true, closeFrame, NuFrameBuilder::closePayload(closeFrame, 1008, (const uint8_t *)"Slow Consumer", 13));
+            c->state = NuClient::STATE_CLOSING;
+            c->txOverflow = true;
+            if (_onEvent)
+                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Slow Consumer", 13);
+            c->last_event = SERVER_EVENT_ERROR;
         }
-        else
+        return false;
+    }
+
+    // Messages are queued as separate frames the drop policies can remove
+    bool droppable() const
+    {
+        return _slowPolicy == SLOW_CONSUMER_DROP_OLDEST || _slowPolicy == SLOW_CONSUMER_LATEST_WINS;
+    }
+
+    // Encode the message once and queue it on every connected client below the high watermark
+    bool broadcast(uint8_t opcode, const uint8_t *data, size_t len, uint32_t key = 0)
+    {
+        NuSharedFrame *frame = nullptr;
+        size_t encoded = NuFrameBuilder::encodedLength(len, _fragmentSize, false);
+        bool all = true;
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            NuClient *c = clients[i];
+            if (c->state != NuClient::STATE_CONNECTED)
+                continue;
+            if (!admit(c, encoded, key))
+            {
+                all = false;
+                continue;
+            }
+            if (!frame)
+            {
+                frame = NuFrameBuilder::buildShared(opcode, data, len, _fragmentSize);
+                if (!frame)
+                    return false;
+            }
+            if (!c->queueShared(frame, true, key))
+                all = false;
+        }
+        NuSharedFrame::release(frame);
+        return all;
+    }
+
+    // Queue a frame of a NuMessageWriter if its client is still connected
+    static bool writerSink(void *owner, NuClient *c, NuSharedFrame *frame, bool droppable)
+    {
+        NuSockServerSecure *s = (NuSockServerSecure *)owner;
+        bool queued = false;
+        s->myLock.lock();
+        for (size_t i = 0; i < s->clients.size(); i++)
+        {
+            if (s->clients[i] == c)
+            {
+                queued = c->state == NuClient::STATE_CONNECTED && c->queueShared(frame, droppable);
+                break;
+            }
+        }
+        s->myLock.unlock();
+        return queued;
+    }
+
+    // Queue a prepared message on a connected client below the high watermark
+    bool sendPrepared(NuClient *c, const NuPreparedMessage &msg, uint32_t key = 0)
+    {
+        if (c->state != NuClient::STATE_CONNECTED || !admit(c, msg.length(), key))
+            return false;
+        bool queued = msg.queue(c, key);
+        return queued;
+    }
+
+    // Queue a prepared message on every connected client below the high watermark
+    bool broadcastPrepared(const NuPreparedMessage &msg, uint32_t key = 0)
+    {
+        bool all = true;
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            if (clients[i]->state == NuClient::STATE_CONNECTED && !sendPrepared(clients[i], msg, key))
+                all = false;
+        }
+        return all;
+    }
+
+    // Queue a data message (or fragment) on a connected client below the high watermark
+    bool sendIndex(int index, uint8_t opcode, bool fragment, bool fin, const uint8_t *data, size_t len, uint32_t key = 0)
+    {
+        if (index < 0 || index >= (int)clients.size())
+            return false;
+        bool queued = false;
+        myLock.lock();
+        NuClient *c = clients[index];
+        size_t encoded = NuFrameBuilder::encodedLength(len, fragment ? 0 : _fragmentSize, false);
+        if (c->state == NuClient::STATE_CONNECTED && admit(c, encoded, key))
+        {
+            if (fragment)
+                queued = buildFrame(c, opcode, fin, data, len);
+            else if (droppable())
+            {
+                NuSharedFrame *frame = NuFrameBuilder::buildShared(opcode, data, len, _fragmentSize);
+                queued = frame && c->queueShared(frame, true, key);
+                NuSharedFrame::release(frame);
+            }
+            else
+                queued = buildMessage(c, opcode, data, len);
+        }
+        myLock.unlock();
+        return queued;
+    }
+
+    static bool frameHandler(void *ctx, NuClient *c, NuFrameEvent event, uint8_t *payload, size_t len)
+    {
+        NuSSLClient *sc = (NuSSLClient *)ctx;
+        NuSockServerSecure *s = (NuSockServerSecure *)c->server;
+        c->publishRx();
+        switch (event)
+        {
+        case FRAME_EVENT_PING:
+            s->buildFrame(c, 0xA, true, payload, len);
+            return true;
+
+        case FRAME_EVENT_PONG:
+            return true;
+
+        case FRAME_EVENT_CLOSE:
+#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
+            // We initiated close
+            if (c->state == NuClient::STATE_CLOSING)
+            {
+                s->removeClient(c, sc);
+                return false;
+            }
+
+            // Client initiated close (Echo required)
+            s->buildFrame(c, 0x8, true, payload, len);
+            s->flushClient(c, sc);
+#else
+            payload = nullptr;
+            len = 0;
+#endif
+            if (s->_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
+                s->_onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, payload, len);
+            c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
+            s->removeClient(c, sc);
+            return false;
+
+        case FRAME_EVENT_ERROR:
         {
-            c->appendTx(126);
-            c->appendTx(len >> 8);
-            c->appendTx(len & 0xFF);
+#if defined(NUSOCK_DEBUG)
+            NuSock::printLog("DBG ", "Error: %.*s\n", (int)len, (const char *)payload);
+#endif
+            // Tell the client why it is dropped (status in rxFrame.closeCode, e.g. 1009)
+            uint8_t closeFrame[125];
+            s->buildFrame(c, 0x8, true, closeFrame, NuFrameBuilder::closePayload(closeFrame, c->rxFrame.closeCode, payload, len));
+            s->flushClient(c, sc);
+            if (s->_onEvent)
+                s->_onEvent(c, SERVER_EVENT_ERROR, payload, len);
+            c->last_event = SERVER_EVENT_ERROR;
+            s->removeClient(c, sc);
+            return false;
+        }
+
+        default:
+        {
+#if !defined(NUSOCK_FULL_COMPLIANCE) && !defined(NUSOCK_RFC_FRAGMENTATION)
+            // Legacy: the first text message names the client
+            if (event == FRAME_EVENT_TEXT && c->id[0] == 0 && len < sizeof(c->id))
+            {
+                strncpy(c->id, (char *)payload, len);
+                c->id[len] = 0;
+            }
+#endif
+            NuServerEvent e = NuFrameParser::serverEvent(event);
+            if (s->_onEvent)
+                s->_onEvent(c, e, payload, len);
+            c->last_event = e;
+            return true;
+        }
         }
-        for (size_t j = 0; j < len; j++)
-            c->appendTx(data[j]);
     }
 
     void processClient(NuClient *c, NuSSLClient *sc)
@@ -141,11 +339,9 @@ private:
             NuSock::printLog("DBG ", "Read %d bytes from SSL connection\n", ret);
 #endif
 
-            // Copy to RX buffer
-            for (int i = 0; i < ret && c->rxLen < MAX_WS_BUFFER; i++)
-            {
-                c->rxBuffer[c->rxLen++] = sc->tmpBuf[i];
-            }
+            // Copy to RX buffer (frames are fed to the parser directly below)
+            if (c->state == NuClient::STATE_HANDSHAKE)
+                c->appendRx(sc->tmpBuf, ret);
         }
         else if (ret == 0 || ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE)
         {
@@ -166,7 +362,7 @@ private:
         {
             if (c->rxLen > 100)
             {
-                if (c->rxLen < MAX_WS_BUFFER)
+                if (c->rxLen < c->rxCap)
                     c->rxBuffer[c->rxLen] = 0;
                 char *reqBuf = (char *)c->rxBuffer;
                 if (strstr(reqBuf, "\r\n\r\n"))
@@ -207,6 +403,7 @@ private:
 
                                 c->state = NuClient::STATE_CONNECTED;
                                 c->rxLen = 0;
+                                c->resizeRx(c->bufferConfig.frameBufferSize);
 
                                 if (_onEvent)
                                     _onEvent(c, SERVER_EVENT_CLIENT_CONNECTED, nullptr, 0);
@@ -225,300 +422,15 @@ private:
                 }
             }
         }
-        else
+        else if (ret > 0)
         {
             // Process WebSocket frames
-            while (c->rxLen > 0)
-            {
-                if (c->rxLen < 2)
-                    return;
-                uint8_t opcode = c->rxBuffer[0] & 0x0F;
-                bool isFin = (c->rxBuffer[0] & 0x80);
-                uint8_t lenByte = c->rxBuffer[1] & 0x7F;
-                bool isMasked = (c->rxBuffer[1] & 0x80);
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                // RSV check
-                if ((c->rxBuffer[0] & 0x70) != 0)
-                {
-#if defined(NUSOCK_DEBUG)
-                    NuSock::printLog("DBG ", "Error: RSV Bits set in incoming frame\n");
-#endif
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"RSV Error", 9);
-                    c->last_event = SERVER_EVENT_ERROR;
-                    removeClient(c, sc);
-                    return;
-                }
-                // Strict masking (server must receive masked)
-                if (!isMasked)
-                {
-#if defined(NUSOCK_DEBUG)
-                    NuSock::printLog("DBG ", "Error: Masking not set in incoming frame\n");
-#endif
-                    if (_onEvent)
-                        _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Mask Error", 10);
-                    c->last_event = SERVER_EVENT_ERROR;
-                    removeClient(c, sc);
-                    return;
-                }
-#endif
-
-                size_t headerSize = 2;
-                size_t payloadLen = lenByte;
-
-                if (payloadLen == 126)
-                {
-                    if (c->rxLen < 4)
-                        return;
-                    payloadLen = (c->rxBuffer[2] << 8) | c->rxBuffer[3];
-                    headerSize += 2;
-                }
-
-                if (isMasked)
-                    headerSize += 4;
-
-                size_t totalFrameSize = headerSize + payloadLen;
-                if (c->rxLen < totalFrameSize)
-                    return;
-
-                size_t maskOffset = headerSize - 4;
-
-                // Control frames
-                if (opcode >= 0x8)
-                {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION) || defined(NUSOCK_RFC_STRICT_MASK_RSV)
-                    if (!isFin || payloadLen > 125)
-                    {
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"Control Err", 11);
-                        removeClient(c, sc);
-                        return;
-                    }
-#endif
-                    // Unmask control frame
-                    if (isMasked)
-                    {
-                        uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1],
-                                           c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                        uint8_t *ctrlPayload = &c->rxBuffer[headerSize];
-                        for (size_t i = 0; i < payloadLen; i++)
-                            ctrlPayload[i] ^= mask[i % 4];
-                    }
-                    uint8_t *ctrlPayload = &c->rxBuffer[headerSize];
-
-                    if (opcode == 0x8)
-                    {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_CLOSE_HANDSHAKE)
-                        if (payloadLen == 1)
-                        {
-                            removeClient(c, sc);
-                            return;
-                        }
-
-                        // We initiated close
-                        if (c->state == NuClient::STATE_CLOSING)
-                        {
-                            removeClient(c, sc);
-                            return;
-                        }
-
-                        // Client initiated close (Echo required)
-                        buildFrame(c, 0x8, true, ctrlPayload, payloadLen);
-                        if (c->txBuffer && c->txLen > 0)
-                        {
-                            esp_tls_conn_write(sc->tls, c->txBuffer, c->txLen);
-                            c->clearTx();
-                        }
-                        if (_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
-                            _onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, ctrlPayload, payloadLen);
-                        c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
-                        removeClient(c, sc);
-                        return;
-#else
-                        if (_onEvent && c->last_event != SERVER_EVENT_CLIENT_DISCONNECTED)
-                            _onEvent(c, SERVER_EVENT_CLIENT_DISCONNECTED, nullptr, 0);
-                        c->last_event = SERVER_EVENT_CLIENT_DISCONNECTED;
-                        removeClient(c, sc);
-                        return;
-#endif
-                    }
-                    else if (opcode == 0x9)
-                    {
-                        buildFrame(c, 0xA, true, ctrlPayload, payloadLen);
-                    }
-
-                    size_t rem = c->rxLen - totalFrameSize;
-                    if (rem > 0)
-                        memmove(c->rxBuffer, c->rxBuffer + totalFrameSize, rem);
-                    c->rxLen -= totalFrameSize;
-                    continue;
-                }
-
-                // Data frames
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_FRAGMENTATION)
-                if (opcode > 0)
-                {
-                    if (c->fragmentOpcode != 0)
-                    {
-                        removeClient(c, sc);
-                        return;
-                    }
-                    // Unmask payload
-                    if (isMasked)
-                    {
-                        uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1],
-                                           c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                        uint8_t *payload = &c->rxBuffer[headerSize];
-                        for (size_t i = 0; i < payloadLen; i++)
-                            payload[i] ^= mask[i % 4];
-                    }
-                    uint8_t *payload = &c->rxBuffer[headerSize];
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                    if (opcode == 0x1) // Text
-                    {
-                        if (!NuUTF8::validate(c->utf8State, payload, payloadLen))
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"UTF-8 Error", 11);
-                            removeClient(c, sc);
-                            return;
-                        }
-                    }
-#endif
-
-                    if (!isFin)
-                    {
-                        c->fragmentOpcode = opcode;
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_FRAGMENT_START, payload, payloadLen);
-                    }
-                    else
-                    {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                        if (opcode == 0x1 && c->utf8State != NuUTF8::UTF8_ACCEPT)
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"UTF-8 Incomplete", 16);
-                            removeClient(c, sc);
-                            return;
-                        }
-                        c->utf8State = 0;
-#endif
-                        if (opcode == 0x1 && _onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                        else if (opcode == 0x2 && _onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                    }
-                }
-                else if (opcode == 0) // Continuation
-                {
-                    if (c->fragmentOpcode == 0)
-                    {
-                        removeClient(c, sc);
-                        return;
-                    }
-
-                    // Unmask payload
-                    if (isMasked)
-                    {
-                        uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1],
-                                           c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                        uint8_t *payload = &c->rxBuffer[headerSize];
-                        for (size_t i = 0; i < payloadLen; i++)
-                            payload[i] ^= mask[i % 4];
-                    }
-                    uint8_t *payload = &c->rxBuffer[headerSize];
-
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                    if (c->fragmentOpcode == 0x1) // Text continuation
-                    {
-                        if (!NuUTF8::validate(c->utf8State, payload, payloadLen))
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"UTF-8 Error", 11);
-                            removeClient(c, sc);
-                            return;
-                        }
-                    }
-#endif
-
-                    if (!isFin)
-                    {
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_FRAGMENT_CONT, payload, payloadLen);
-                    }
-                    else
-                    {
-#if defined(NUSOCK_FULL_COMPLIANCE) || defined(NUSOCK_RFC_UTF8_STRICT)
-                        if (c->fragmentOpcode == 0x1 && c->utf8State != NuUTF8::UTF8_ACCEPT)
-                        {
-                            if (_onEvent)
-                                _onEvent(c, SERVER_EVENT_ERROR, (const uint8_t *)"UTF-8 Incomplete", 16);
-                            removeClient(c, sc);
-                            return;
-                        }
-                        c->utf8State = 0;
-#endif
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_FRAGMENT_FIN, payload, payloadLen);
-                        c->fragmentOpcode = 0;
-                    }
-                }
-#else
-                // Legacy
-                if (isMasked)
-                {
-                    uint8_t mask[4] = {c->rxBuffer[maskOffset], c->rxBuffer[maskOffset + 1],
-                                       c->rxBuffer[maskOffset + 2], c->rxBuffer[maskOffset + 3]};
-                    uint8_t *payload = &c->rxBuffer[headerSize];
-                    for (size_t i = 0; i < payloadLen; i++)
-                        payload[i] ^= mask[i % 4];
-
-                    if (opcode == 0x1)
-                    {
-                        if (c->id[0] == 0 && payloadLen < sizeof(c->id))
-                        {
-                            strncpy(c->id, (char *)payload, payloadLen);
-                            c->id[payloadLen] = 0;
-                        }
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_TEXT, payload, payloadLen);
-                        c->last_event = SERVER_EVENT_MESSAGE_TEXT;
-                    }
-                    else if (opcode == 0x2)
-                    {
-                        if (_onEvent)
-                            _onEvent(c, SERVER_EVENT_MESSAGE_BINARY, payload, payloadLen);
-                        c->last_event = SERVER_EVENT_MESSAGE_BINARY;
-                    }
-                }
-#endif
-
-                // Consume
-                size_t rem = c->rxLen - totalFrameSize;
-                if (rem > 0)
-                    memmove(c->rxBuffer, c->rxBuffer + totalFrameSize, rem);
-                c->rxLen -= totalFrameSize;
-            }
+            if (!NuFrameParser::feed(c, sc->tmpBuf, ret, true, frameHandler, sc))
+                return; // Client removed
         }
 
         // Send pending data
-        if (c->txBuffer && c->txLen > 0)
-        {
-            int sent = esp_tls_conn_write(sc->tls, c->txBuffer, c->txLen);
-            if (sent > 0)
-            {
-                if (sent == c->txLen)
-                    c->clearTx();
-                else
-                {
-                    memmove(c->txBuffer, c->txBuffer + sent, c->txLen - sent);
-                    c->txLen -= sent;
-                }
-            }
-        }
+        flushClient(c, sc);
     }
 
 public:
@@ -570,8 +482,6 @@ public:
         for (size_t i = 0; i < clients.size(); i++)
         {
             NuClient *c = clients[i];
-            if (c->rxBuffer)
-                free(c->rxBuffer);
             delete c;
         }
         clients.clear();
@@ -719,9 +629,9 @@ public:
                     sc->tls = tls;
 
 #if defined(NUSOCK_USE_LWIP)
-                    NuClient *c = new NuClient(this, nullptr);
+                    NuClient *c = new NuClient(this, nullptr, _bufferConfig);
 #else
-                    NuClient *c = new NuClient(this, nullptr, false);
+                    NuClient *c = new NuClient(this, nullptr, false, _bufferConfig);
 #endif
                     c->isSecure = true;
                     c->index = clients.size();
@@ -766,6 +676,15 @@ public:
                 continue;
             }
 
+            // Closed by the slow-consumer policy
+            if (c->txOverflow)
+            {
+                flushClient(c, sc);
+                removeClient(c, sc);
+                i--;
+                continue;
+            }
+
             // Standard processing
             processClient(c, sc);
         }
@@ -778,71 +697,241 @@ public:
      */
     void onEvent(NuServerSecureEventCallback cb) { _onEvent = cb; }
 
+    /**
+     * @brief Enable automatic fragmentation of large messages.
+     * Messages sent with send() that are larger than the fragment size are split into
+     * a first frame and continuation frames, so large payloads can be sent without
+     * sendFragmentStart/Cont/Fin.
+     * @param fragmentSize Maximum payload per frame, 0 to disable (default).
+     * NUSOCK_FRAGMENT_SIZE sizes the frames to the transport (TCP MSS on LwIP).
+     */
+    void setFragmentSize(size_t fragmentSize) { _fragmentSize = fragmentSize; }
+
+    /**
+     * @brief Set the buffer sizes and the message size limit of this server.
+     * Applies to connections opened afterwards.
+     * @param config Handshake and frame receive buffer sizes, maximum message size
+     * (0 = no limit) and initial transmit buffer capacity. frameBufferSize is
+     * raised to NUSOCK_MIN_FRAME_BUFFER (139 bytes) if smaller.
+     */
+    void setBufferConfig(const NuBufferConfig &config)
+    {
+        _bufferConfig = config;
+        if (_bufferConfig.frameBufferSize < NUSOCK_MIN_FRAME_BUFFER)
+            _bufferConfig.frameBufferSize = NUSOCK_MIN_FRAME_BUFFER;
+    }
+
+    /**
+     * @brief Get the buffer configuration of this server.
+     */
+    const NuBufferConfig &getBufferConfig() const { return _bufferConfig; }
+
+    /**
+     * @brief Set what happens to messages for a client whose transmit queue would
+     * exceed NuBufferConfig::txHighWatermark (no effect without a watermark).
+     * @param policy SLOW_CONSUMER_BLOCK (default, the send is rejected),
+     * SLOW_CONSUMER_DROP_OLDEST, SLOW_CONSUMER_LATEST_WINS (see sendKeyed())
+     * or SLOW_CONSUMER_CLOSE (status 1008).
+     */
+    void setSlowConsumerPolicy(NuSlowConsumerPolicy policy) { _slowPolicy = policy; }
+
+    /**
+     * @brief Get the rejected, dropped, replaced and closed counters of the slow-consumer policy.
+     */
+    NuSlowConsumerStats getSlowConsumerStats() const { return _slowStats; }
+
     /**
      * @brief Broadcast a text message to aLL connected clients.
+     * Clients above their high watermark (NuBufferConfig::txHighWatermark) are skipped.
      * @param msg Null-terminated string to send.
+     * @return true if the message was queued on every connected client.
      */
-    void send(const char *msg)
+    bool send(const char *msg)
     {
         myLock.lock();
-        size_t len = strlen(msg);
-        for (size_t i = 0; i < clients.size(); i++)
-        {
-            NuClient *c = clients[i];
-            if (c->state == NuClient::STATE_CONNECTED)
-                buildFrame(c, 0x1, true, (const uint8_t *)msg, len);
-        }
+        bool queued = broadcast(0x1, (const uint8_t *)msg, strlen(msg));
         myLock.unlock();
+        return queued;
     }
 
     /**
      * @brief Broadcast a binary message to aLL connected clients.
+     * Clients above their high watermark (NuBufferConfig::txHighWatermark) are skipped.
      * @param data Pointer to the data buffer.
      * @param len Length of the data.
+     * @return true if the message was queued on every connected client.
      */
-    void send(const uint8_t *data, size_t len)
+    bool send(const uint8_t *data, size_t len)
     {
         myLock.lock();
-        for (size_t i = 0; i < clients.size(); i++)
-        {
-            NuClient *c = clients[i];
-            if (c->state == NuClient::STATE_CONNECTED)
-                buildFrame(c, 0x2, true, data, len);
-        }
+        bool queued = broadcast(0x2, data, len);
         myLock.unlock();
+        return queued;
     }
 
     /**
      * @brief Send a text message to a specific client.
      * @param index The client's internal index.
      * @param msg Null-terminated string to send.
+     * @return true if the message was queued.
+     * @return false if the client is not connected, is above its high watermark
+     * (SERVER_EVENT_WRITABLE follows once it drains) or memory is low.
      */
-    void send(int index, const char *msg)
+    bool send(int index, const char *msg)
+    {
+        return sendIndex(index, 0x1, false, true, (const uint8_t *)msg, strlen(msg));
+    }
+
+    /**
+     * @brief Send a binary message to a specific client.
+     * @param index The client's internal index.
+     * @param data Pointer to the data buffer.
+     * @param len Length of the data.
+     * @return true if the message was queued (see send(int, const char *)).
+     */
+    bool send(int index, const uint8_t *data, size_t len)
+    {
+        return sendIndex(index, 0x2, false, true, data, len);
+    }
+
+    /**
+     * @brief Broadcast a text message that supersedes queued messages with the same key.
+     * With SLOW_CONSUMER_LATEST_WINS, a slow client keeps only the newest unsent
+     * message per key. Otherwise the same as send().
+     * @param key Message key, non-zero.
+     * @param msg Null-terminated string to send.
+     * @return true if the message was queued on every connected client.
+     */
+    bool sendKeyed(uint32_t key, const char *msg)
     {
-        if (index >= clients.size())
-            return;
         myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-            buildFrame(c, 0x1, true, (const uint8_t *)msg, strlen(msg));
+        bool queued = broadcast(0x1, (const uint8_t *)msg, strlen(msg), key);
         myLock.unlock();
+        return queued;
     }
 
     /**
-     * @brief Send a binary message to a specific client.
+     * @brief Broadcast a binary message that supersedes queued messages with the same key.
+     * @param key Message key, non-zero.
+     * @param data Pointer to the data buffer.
+     * @param len Length of the data.
+     * @return true if the message was queued on every connected client.
+     */
+    bool sendKeyed(uint32_t key, const uint8_t *data, size_t len)
+    {
+        myLock.lock();
+        bool queued = broadcast(0x2, data, len, key);
+        myLock.unlock();
+        return queued;
+    }
+
+    /**
+     * @brief Send a text message to a specific client, superseding its queued messages with the same key.
+     * @param index The client's internal index.
+     * @param key Message key, non-zero.
+     * @param msg Null-terminated string to send.
+     * @return true if the message was queued.
+     */
+    bool sendKeyed(int index, uint32_t key, const char *msg)
+    {
+        return sendIndex(index, 0x1, false, true, (const uint8_t *)msg, strlen(msg), key);
+    }
+
+    /**
+     * @brief Send a binary message to a specific client, superseding its queued messages with the same key.
      * @param index The client's internal index.
+     * @param key Message key, non-zero.
      * @param data Pointer to the data buffer.
      * @param len Length of the data.
+     * @return true if the message was queued.
      */
-    void send(int index, const uint8_t *data, size_t len)
+    bool sendKeyed(int index, uint32_t key, const uint8_t *data, size_t len)
+    {
+        return sendIndex(index, 0x2, false, true, data, len, key);
+    }
+
+    /**
+     * @brief Broadcast a prepared message to ALL connected clients.
+     * The encoded frames are queued by reference, nothing is encoded or copied.
+     * Clients above their high watermark (NuBufferConfig::txHighWatermark) are skipped.
+     * @param msg The prepared message.
+     * @return true if the message was queued on every connected client.
+     */
+    bool send(const NuPreparedMessage &msg)
     {
-        if (index >= clients.size())
-            return;
         myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-            buildFrame(c, 0x2, true, data, len);
+        bool queued = broadcastPrepared(msg);
         myLock.unlock();
+        return queued;
+    }
+
+    /**
+     * @brief Send a prepared message to a specific client by internal index.
+     * @param index The index of the client in the internal list.
+     * @param msg The prepared message.
+     * @return true if the message was queued (see send(int, const char *)).
+     */
+    bool send(int index, const NuPreparedMessage &msg)
+    {
+        if (index < 0 || index >= (int)clients.size())
+            return false;
+        myLock.lock();
+        bool queued = sendPrepared(clients[index], msg);
+        myLock.unlock();
+        return queued;
+    }
+
+    /**
+     * @brief Broadcast a prepared message that supersedes queued messages with the same key.
+     * @param key Message key, non-zero.
+     * @param msg The prepared message.
+     * @return true if the message was queued on every connected client.
+     */
+    bool sendKeyed(uint32_t key, const NuPreparedMessage &msg)
+    {
+        myLock.lock();
+        bool queued = broadcastPrepared(msg, key);
+        myLock.unlock();
+        return queued;
+    }
+
+    /**
+     * @brief Start a message to a specific client that is written with print() or printf().
+     * The output is encoded in place into the frame (see NuMessageWriter) and sent
+     * as continuation frames when it exceeds the fragment size (setFragmentSize(),
+     * NUSOCK_FRAGMENT_SIZE if not set). The message is sent by end().
+     * @param index The index of the client in the internal list.
+     * @param isBinary true for a Binary message, false for Text.
+     * @return NuMessageWriter The writer, false if the client is not connected or is
+     * above its high watermark.
+     */
+    NuMessageWriter message(int index, bool isBinary = false)
+    {
+        NuClient *c = nullptr;
+        myLock.lock();
+        if (index >= 0 && index < (int)clients.size() && clients[index]->state == NuClient::STATE_CONNECTED && admit(clients[index], 0, 0))
+            c = clients[index];
+        myLock.unlock();
+        if (!c)
+            return NuMessageWriter();
+        return NuMessageWriter(this, c, writerSink, isBinary ? 0x2 : 0x1, _fragmentSize ? _fragmentSize : NUSOCK_FRAGMENT_SIZE, c->txQueue.blockSize, false);
+    }
+
+    /**
+     * @brief Send a formatted text message to a specific client.
+     * The text is formatted directly into the frame, without a separate buffer.
+     * @param index The index of the client in the internal list.
+     * @param format printf() format string.
+     * @return true if the message was queued (see send(int, const char *)).
+     */
+    bool sendf(int index, const char *format, ...)
+    {
+        NuMessageWriter writer = message(index);
+        va_list args;
+        va_start(args, format);
+        writer.vprintf(format, args);
+        va_end(args);
+        return writer.end();
     }
 
     /**
@@ -851,21 +940,12 @@ public:
      * @param payload The first chunk of data.
      * @param len Length of the data chunk.
      * @param isBinary If true, starts a Binary message (Opcode 0x2). If false, starts Text (Opcode 0x1).
+     * @return true if the fragment was queued (a rejected fragment can be sent again later).
      */
-    void sendFragmentStart(int index, const uint8_t *payload, size_t len, bool isBinary)
+    bool sendFragmentStart(int index, const uint8_t *payload, size_t len, bool isBinary)
     {
-        if (index >= clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-        {
-            buildFrame(c, isBinary ? 0x2 : 0x1, false, payload, len);
-            // Secure server flushes immediately via write in the main loop or here if needed.
-            // In the original code, 'send' buffered data. We should ensure it gets written.
-            // However, NuSockServerSecure::loop() handles flushing txBuffer.
-        }
-        myLock.unlock();
+        // The queued frames are written by loop()
+        return sendIndex(index, isBinary ? 0x2 : 0x1, true, false, payload, len);
     }
 
     /**
@@ -873,16 +953,11 @@ public:
      * @param index The client index.
      * @param payload The data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentCont(int index, const uint8_t *payload, size_t len)
+    bool sendFragmentCont(int index, const uint8_t *payload, size_t len)
     {
-        if (index >= clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-            buildFrame(c, 0x0, false, payload, len);
-        myLock.unlock();
+        return sendIndex(index, 0x0, true, false, payload, len);
     }
 
     /**
@@ -890,16 +965,11 @@ public:
      * @param index The client index.
      * @param payload The last data chunk.
      * @param len Length of the data chunk.
+     * @return true if the fragment was queued.
      */
-    void sendFragmentFin(int index, const uint8_t *payload, size_t len)
+    bool sendFragmentFin(int index, const uint8_t *payload, size_t len)
     {
-        if (index >= clients.size())
-            return;
-        myLock.lock();
-        NuClient *c = clients[index];
-        if (c->state == NuClient::STATE_CONNECTED)
-            buildFrame(c, 0x0, true, payload, len);
-        myLock.unlock();
+        return sendIndex(index, 0x0, true, true, payload, len);
     }
 
     /**
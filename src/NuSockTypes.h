@@ -8,6 +8,7 @@
 #define NUSOCK_TYPES_H
 
 #include "NuSockConfig.h"
+#include "NuSockUtils.h"
 
 // Forward declarations
 class NuSockServer;
@@ -29,7 +30,9 @@ enum NuServerEvent
     SERVER_EVENT_FRAGMENT_START,      // First chunk of a fragmented message (FIN=0, Opcode > 0)
     SERVER_EVENT_FRAGMENT_CONT,       // Middle chunk (FIN=0, Opcode=0)
     SERVER_EVENT_FRAGMENT_FIN,        // Last chunk (FIN=1, Opcode=0)
-    SERVER_EVENT_ERROR                // Error
+    SERVER_EVENT_ERROR,               // Error
+    SERVER_EVENT_STREAM_CHUNK,        // Payload chunk of a frame larger than the receive buffer (see NuClient::rxStream)
+    SERVER_EVENT_WRITABLE             // Transmit queue drained below the low watermark after a rejected send
 };
 
 /**
@@ -45,7 +48,668 @@ enum NuClientEvent
     CLIENT_EVENT_FRAGMENT_START,
     CLIENT_EVENT_FRAGMENT_CONT,
     CLIENT_EVENT_FRAGMENT_FIN,
-    CLIENT_EVENT_ERROR
+    CLIENT_EVENT_ERROR,
+    CLIENT_EVENT_STREAM_CHUNK, // Payload chunk of a frame larger than the receive buffer (see NuClient::rxStream)
+    CLIENT_EVENT_WRITABLE      // Transmit queue drained below the low watermark after a rejected send
+};
+
+/**
+ * @brief Describes the payload chunk delivered with a STREAM_CHUNK event.
+ * Frames larger than the receive buffer are not buffered whole, their
+ * (unmasked) payload is delivered in chunks as the data arrives.
+ */
+struct NuStreamInfo
+{
+    uint8_t opcode = 0;  // Message type (0x1 = Text, 0x2 = Binary)
+    bool fin = false;    // FIN bit of the frame (false if more fragments follow)
+    size_t offset = 0;   // Offset of this chunk in the frame payload
+    size_t total = 0;    // Total frame payload length
+    bool final = false;  // Last chunk of the frame
+};
+
+/**
+ * @brief Receive state of the incremental frame parser.
+ * Kept per client so a partially received frame is resumed where it stopped
+ * and the header fields are decoded only once.
+ */
+struct NuFrameState
+{
+    enum Stage
+    {
+        STAGE_HEADER,  // Waiting for the first 2 header bytes
+        STAGE_LENGTH,  // Waiting for the extended payload length
+        STAGE_MASK,    // Waiting for the masking key
+        STAGE_PAYLOAD  // Waiting for the payload
+    };
+
+    uint8_t stage = STAGE_HEADER;
+    uint8_t opcode = 0;
+    bool fin = false;
+    bool masked = false;
+    uint8_t lenBytes = 0;   // Size of the extended length field (0, 2 or 8)
+    uint8_t headerSize = 0; // Header bytes decoded so far
+    uint8_t mask[4] = {0, 0, 0, 0};
+    size_t payloadLen = 0;
+
+    // Streaming: the frame does not fit in the receive buffer and its payload
+    // is delivered in chunks, offset is the payload bytes delivered so far.
+    bool streaming = false;
+    size_t offset = 0;
+
+    // Close status code of the last protocol error (e.g. 1002, 1007)
+    uint16_t closeCode = 0;
+
+    // Message state of the parser, copied to NuClient::fragmentOpcode and
+    // NuClient::rxStream with each event it reports (see NuClient::publishRx())
+    uint8_t fragmentOpcode = 0; // Opcode of the fragmented message in progress, 0 = none
+    NuStreamInfo stream;        // Chunk of a streamed frame, opcode 0 = frame ignored
+
+    void reset()
+    {
+        stage = STAGE_HEADER;
+        headerSize = 0;
+        lenBytes = 0;
+        payloadLen = 0;
+        streaming = false;
+        offset = 0;
+    }
+};
+
+/**
+ * @brief Per-instance buffer settings of a server or client.
+ * Applied to the connections opened after the configuration is set.
+ */
+struct NuBufferConfig
+{
+    size_t handshakeBufferSize = MAX_WS_BUFFER; // Receive buffer while the HTTP upgrade is in progress
+    size_t frameBufferSize = MAX_WS_BUFFER;     // Receive buffer once connected, larger frames are streamed (min NUSOCK_MIN_FRAME_BUFFER)
+    size_t maxMessageSize = 0;                  // Largest accepted message payload, 0 = no limit
+    size_t txBlockSize = NUSOCK_TX_BLOCK_SIZE;  // Size of the transmit queue blocks
+    size_t txHighWatermark = 0;                 // Queued bytes above which sends are rejected, 0 = no limit
+    size_t txLowWatermark = 0;                  // WRITABLE fires when a blocked queue drains to this level
+};
+
+/**
+ * @brief What a server does with a message for a client whose transmit queue
+ * would exceed NuBufferConfig::txHighWatermark (a slow consumer).
+ */
+enum NuSlowConsumerPolicy
+{
+    SLOW_CONSUMER_BLOCK,       // Reject the send, WRITABLE fires when the queue has drained (default)
+    SLOW_CONSUMER_DROP_OLDEST, // Drop the oldest unsent whole messages to make room
+    SLOW_CONSUMER_LATEST_WINS, // Replace unsent messages with the same key, then drop the oldest
+    SLOW_CONSUMER_CLOSE        // Close the connection with status 1008 (Policy Violation)
+};
+
+/**
+ * @brief Counters of the slow-consumer policy of a server.
+ */
+struct NuSlowConsumerStats
+{
+    uint32_t rejected = 0; // Sends rejected (SLOW_CONSUMER_BLOCK)
+    uint32_t dropped = 0;  // Queued messages dropped to make room, or new messages that did not fit
+    uint32_t replaced = 0; // Queued messages replaced by a newer one with the same key
+    uint32_t closed = 0;   // Connections closed (SLOW_CONSUMER_CLOSE)
+};
+
+/**
+ * @brief Encoded frame(s) shared by the transmit queues of several clients.
+ * A broadcast is encoded once (server frames are unmasked, so the bytes are the
+ * same for every client) and each client holds a reference until it has sent it.
+ * The reference count is atomic on ESP32, where the clients sharing a frame are
+ * flushed under their own locks and zero-copy frames of a closed connection are
+ * released from the tcpip thread.
+ */
+struct NuSharedFrame
+{
+    uint8_t *data;
+    size_t len;
+    size_t cap;   // Capacity of a transmit block (appended in place), 0 for encoded frames
+    uint32_t refs;
+    bool progmem; // data points to flash (PROGMEM), it is not owned
+
+    /**
+     * @brief Allocate a frame of len bytes (one allocation), holding one reference.
+     */
+    static NuSharedFrame *create(size_t len)
+    {
+        NuSharedFrame *f = (NuSharedFrame *)malloc(sizeof(NuSharedFrame) + len);
+        if (!f)
+            return nullptr;
+        f->data = (uint8_t *)(f + 1);
+        f->len = len;
+        f->cap = 0;
+        f->refs = 1;
+        f->progmem = false;
+        return f;
+    }
+
+    /**
+     * @brief Reference len bytes of flash (PROGMEM) data without copying them.
+     * The data must stay valid until the frame is released.
+     */
+    static NuSharedFrame *wrapProgmem(const uint8_t *data, size_t len)
+    {
+        NuSharedFrame *f = (NuSharedFrame *)malloc(sizeof(NuSharedFrame));
+        if (!f)
+            return nullptr;
+        f->data = (uint8_t *)data;
+        f->len = len;
+        f->cap = 0;
+        f->refs = 1;
+        f->progmem = true;
+        return f;
+    }
+
+    /**
+     * @brief Copy n bytes from offset, flash data is read with memcpy_P().
+     */
+    void read(uint8_t *out, size_t offset, size_t n) const
+    {
+        if (progmem)
+            memcpy_P(out, data + offset, n);
+        else
+            memcpy(out, data + offset, n);
+    }
+
+    void retain()
+    {
+#if defined(ESP32) && defined(__GNUC__)
+        __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+#else
+        refs++;
+#endif
+    }
+
+    /**
+     * @brief Drop one reference, the frame is freed with the last one.
+     */
+    static void release(NuSharedFrame *f)
+    {
+        if (!f)
+            return;
+#if defined(ESP32) && defined(__GNUC__)
+        if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0)
+            return;
+#else
+        if (--f->refs > 0)
+            return;
+#endif
+        free(f);
+    }
+};
+
+/**
+ * @brief Transmit queue entry referencing a shared frame or a transmit block.
+ */
+struct NuTxItem
+{
+    NuTxItem *next;
+    NuSharedFrame *frame;
+    uint32_t key;   // Latest-wins key, 0 = none
+    bool droppable; // Whole message(s) that may be dropped while unsent
+};
+
+/**
+ * @brief Ordered queue of frames waiting to be sent.
+ * Frames built for one client are appended to fixed-size blocks, shared frames
+ * (broadcasts) are linked in between. Queued bytes never move: the write cursor
+ * (cur) advances as data is passed to the transport and blocks are released from
+ * the head, drained blocks go back to a small pool for reuse.
+ * The release point is kept apart from the write cursor: with holdUntilAck a
+ * frame is released when it has been acknowledged, otherwise once written.
+ * Bytes written to the connection between the queued ones (handshake, control
+ * frames) are recorded with skip() so acknowledgements are applied in order.
+ */
+struct NuTxQueue
+{
+    NuTxItem *head = nullptr;  // Oldest frame not yet released
+    NuTxItem *tail = nullptr;  // Newest frame, appended to if it is a block with room
+    NuTxItem *cur = nullptr;   // Frame being written
+    NuTxItem *spare = nullptr; // Pool of empty blocks
+    size_t curSent = 0;        // Bytes of cur already written
+    size_t headAcked = 0;      // Bytes of head already released
+    size_t unacked = 0;        // Bytes written but not yet acknowledged (holdUntilAck)
+    size_t bytes = 0;          // Bytes held (queued, or written and not yet released)
+    size_t blockSize = NUSOCK_TX_BLOCK_SIZE;
+    uint8_t spareCount = 0;
+    bool holdUntilAck = false;
+
+    // Bytes written outside the queue: after `at` more acknowledged queued bytes, `len` other bytes follow
+    static const uint8_t maxSkips = 4;
+    struct Skip
+    {
+        size_t at;
+        size_t len;
+    } skips[maxSkips];
+    uint8_t skipCount = 0;
+    size_t skipped = 0; // Sum of skips[].at
+
+    ~NuTxQueue() { clear(); }
+
+    /**
+     * @brief Append a frame, the caller's reference moves to the queue.
+     * @param droppable The frame holds whole messages that may be dropped while unsent.
+     * @param key Latest-wins key (see dropKey()), 0 for none.
+     * @param payload Flash payload of the frame (see NuSharedFrame::wrapProgmem()),
+     * queued right after it and dropped with it, nullptr for none. Its reference
+     * moves to the queue as well.
+     * @return false if out of memory (the caller keeps its references).
+     */
+    bool push(NuSharedFrame *frame, bool droppable = false, uint32_t key = 0, NuSharedFrame *payload = nullptr)
+    {
+        NuTxItem *item = (NuTxItem *)malloc(sizeof(NuTxItem));
+        NuTxItem *body = (item && payload) ? (NuTxItem *)malloc(sizeof(NuTxItem)) : nullptr;
+        if (!item || (payload && !body))
+        {
+            free(item);
+            return false;
+        }
+        item->frame = frame;
+        item->droppable = droppable;
+        item->key = key;
+        link(item);
+        bytes += frame->len;
+        if (body)
+        {
+            body->frame = payload;
+            body->droppable = false;
+            body->key = 0;
+            link(body);
+            bytes += payload->len;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Make sure len bytes can be appended without allocating.
+     * Used before a frame is written, so a frame is either queued whole or not at all.
+     * @return false if out of memory.
+     */
+    bool reserve(size_t len)
+    {
+        size_t room = (tail && tail->frame->cap) ? tail->frame->cap - tail->frame->len : 0;
+        room += spareCount * blockSize;
+        while (room < len)
+        {
+            NuTxItem *item = (NuTxItem *)malloc(sizeof(NuTxItem));
+            NuSharedFrame *f = item ? NuSharedFrame::create(blockSize) : nullptr;
+            if (!f)
+            {
+                free(item);
+                return false;
+            }
+            f->len = 0;
+            f->cap = blockSize;
+            item->frame = f;
+            item->droppable = false;
+            item->key = 0;
+            item->next = spare;
+            spare = item;
+            spareCount++;
+            room += blockSize;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Get the free space of the last block (a reserved block is added when it is full).
+     * The caller writes up to room bytes at the returned position and then calls commit().
+     * @return uint8_t* Write position, or nullptr if nothing has been reserved.
+     */
+    uint8_t *writePtr(size_t &room)
+    {
+        if (!tail || tail->frame->len >= tail->frame->cap)
+        {
+            if (!spare)
+            {
+                room = 0;
+                return nullptr;
+            }
+            NuTxItem *item = spare;
+            spare = item->next;
+            spareCount--;
+            link(item);
+        }
+        room = tail->frame->cap - tail->frame->len;
+        return tail->frame->data + tail->frame->len;
+    }
+
+    /**
+     * @brief Add n bytes written at writePtr() to the queue.
+     */
+    void commit(size_t n)
+    {
+        tail->frame->len += n;
+        bytes += n;
+    }
+
+    /**
+     * @brief Get the next contiguous bytes to write.
+     * @param progmem Set to true if the bytes are in flash (read them with memcpy_P()).
+     * @return const uint8_t* The data, or nullptr if everything has been written.
+     */
+    const uint8_t *peek(size_t &len, bool *progmem = nullptr) const
+    {
+        if (!pending())
+        {
+            len = 0;
+            return nullptr;
+        }
+        len = cur->frame->len - curSent;
+        if (progmem)
+            *progmem = cur->frame->progmem;
+        return cur->frame->data + curSent;
+    }
+
+    /**
+     * @brief Mark bytes returned by peek() as written.
+     */
+    void consume(size_t len)
+    {
+        if (!cur)
+            return;
+        curSent += len;
+        advance();
+        if (holdUntilAck)
+            unacked += len;
+        else
+            release(len);
+    }
+
+    /**
+     * @brief Release acknowledged bytes (in write order).
+     */
+    void ack(size_t len)
+    {
+        while (len > 0)
+        {
+            if (skipCount > 0 && skips[0].at == 0)
+            {
+                size_t n = len < skips[0].len ? len : skips[0].len;
+                skips[0].len -= n;
+                len -= n;
+                if (skips[0].len == 0)
+                {
+                    skipCount--;
+                    memmove(skips, skips + 1, skipCount * sizeof(Skip));
+                }
+                continue;
+            }
+            size_t n = skipCount > 0 ? skips[0].at : unacked;
+            if (n > len)
+                n = len;
+            if (n == 0)
+                break;
+            if (skipCount > 0)
+            {
+                skips[0].at -= n;
+                skipped -= n;
+            }
+            unacked -= n;
+            len -= n;
+            release(n);
+        }
+    }
+
+    /**
+     * @brief Check if skip() can record bytes written at the current position.
+     */
+    bool canSkip() const { return skipCount < maxSkips || unacked == skipped; }
+
+    /**
+     * @brief Record len bytes written to the connection outside the queue (holdUntilAck),
+     * they are acknowledged after the queued bytes written before them.
+     * @return false if too many records are pending (see canSkip()).
+     */
+    bool skip(size_t len)
+    {
+        size_t at = unacked - skipped;
+        if (skipCount > 0 && at == 0)
+            skips[skipCount - 1].len += len;
+        else if (skipCount < maxSkips)
+        {
+            skips[skipCount].at = at;
+            skips[skipCount].len = len;
+            skipCount++;
+            skipped += at;
+        }
+        else
+            return false;
+        return true;
+    }
+
+    /**
+     * @brief Copy up to len unwritten bytes from the write cursor (across frames).
+     * @return size_t Number of bytes copied.
+     */
+    size_t copyPending(uint8_t *out, size_t len) const
+    {
+        size_t done = 0, offset = curSent;
+        for (NuTxItem *item = cur; item && done < len; item = item->next, offset = 0)
+        {
+            size_t n = item->frame->len - offset;
+            if (n > len - done)
+                n = len - done;
+            item->frame->read(out + done, offset, n);
+            done += n;
+        }
+        return done;
+    }
+
+    /**
+     * @brief Drop the oldest droppable frame that has not been written yet.
+     * @return size_t Bytes dropped, 0 if there is none.
+     */
+    size_t dropOldest()
+    {
+        NuTxItem *prev = nullptr;
+        for (NuTxItem *item = head; item; prev = item, item = item->next)
+        {
+            if (item->droppable && unsent(item))
+                return drop(prev, item);
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Drop the droppable frames with this key that have not been written yet.
+     * @return size_t Number of frames dropped.
+     */
+    size_t dropKey(uint32_t key)
+    {
+        size_t count = 0;
+        NuTxItem *prev = nullptr, *item = head;
+        while (item)
+        {
+            if (key && item->key == key && item->droppable && unsent(item))
+            {
+                drop(prev, item);
+                count++;
+            }
+            else
+                prev = item;
+            item = prev ? prev->next : head;
+        }
+        return count;
+    }
+
+    /**
+     * @brief Take over all frames of another queue, which is left empty.
+     */
+    void moveFrom(NuTxQueue &other)
+    {
+        clear();
+        head = other.head;
+        tail = other.tail;
+        cur = other.cur;
+        curSent = other.curSent;
+        headAcked = other.headAcked;
+        unacked = other.unacked;
+        bytes = other.bytes;
+        holdUntilAck = other.holdUntilAck;
+        memcpy(skips, other.skips, sizeof(skips));
+        skipCount = other.skipCount;
+        skipped = other.skipped;
+        other.head = other.tail = other.cur = nullptr;
+        other.curSent = other.headAcked = other.unacked = other.bytes = other.skipped = 0;
+        other.skipCount = 0;
+    }
+
+    /**
+     * @brief Check if any bytes are waiting to be written.
+     */
+    bool pending() const { return cur && curSent < cur->frame->len; }
+
+    /**
+     * @brief Check if no frame is held (written but unacknowledged frames included).
+     */
+    bool empty() const { return head == nullptr; }
+
+    /**
+     * @brief Release all frames and pooled blocks.
+     */
+    void clear()
+    {
+        while (head)
+            pop();
+        cur = nullptr;
+        curSent = 0;
+        unacked = 0;
+        bytes = 0;
+        skipCount = 0;
+        skipped = 0;
+        while (spare)
+        {
+            NuTxItem *item = spare;
+            spare = item->next;
+            free(item->frame);
+            free(item);
+        }
+        spareCount = 0;
+    }
+
+private:
+    void link(NuTxItem *item)
+    {
+        item->next = nullptr;
+        if (tail)
+            tail->next = item;
+        else
+            head = item;
+        tail = item;
+        if (!cur)
+            cur = item;
+        advance();
+    }
+
+    // Nothing of the frame has been written (it is the write cursor or after it)
+    bool unsent(NuTxItem *item) const
+    {
+        if (item == cur)
+            return curSent == 0;
+        for (NuTxItem *i = cur; i; i = i->next)
+            if (i == item)
+                return true;
+        return false;
+    }
+
+    // Remove an unsent frame, the write cursor moves to the next frame (or stays
+    // at the end of the previous, completely written one)
+    void unlink(NuTxItem *prev, NuTxItem *item)
+    {
+        if (prev)
+            prev->next = item->next;
+        else
+            head = item->next;
+        if (tail == item)
+            tail = prev;
+        if (cur == item)
+        {
+            cur = item->next ? item->next : prev;
+            curSent = (cur && cur == prev) ? prev->frame->len : 0;
+        }
+        bytes -= item->frame->len;
+        NuSharedFrame::release(item->frame);
+        free(item);
+    }
+
+    // Remove an unsent frame and its flash payload, returns the bytes removed
+    size_t drop(NuTxItem *prev, NuTxItem *item)
+    {
+        size_t n = 0;
+        do
+        {
+            NuTxItem *next = item->next;
+            n += item->frame->len;
+            unlink(prev, item);
+            item = next;
+        } while (item && item->frame->progmem);
+        return n;
+    }
+
+    // Move the write cursor past a completely written frame (the last block stays open for appending)
+    void advance()
+    {
+        if (cur && curSent >= cur->frame->len && cur->next)
+        {
+            cur = cur->next;
+            curSent = 0;
+        }
+    }
+
+    // Release written frames from the head, len bytes in write order
+    void release(size_t len)
+    {
+        bytes -= (len < bytes) ? len : bytes;
+        while (len > 0 && head && head != cur)
+        {
+            size_t n = head->frame->len - headAcked;
+            if (len < n)
+            {
+                headAcked += len;
+                return;
+            }
+            len -= n;
+            pop();
+        }
+        if (len > 0 && head)
+            headAcked += len; // Frame being written (head == cur)
+
+        // The last frame has been written and released completely: a block
+        // is reused in place, a shared frame is dropped
+        if (head && head == cur && curSent == head->frame->len && headAcked == curSent)
+        {
+            if (head->frame->cap)
+                head->frame->len = headAcked = curSent = 0;
+            else
+                pop();
+        }
+    }
+
+    void pop()
+    {
+        NuTxItem *item = head;
+        head = item->next;
+        if (!head)
+            tail = nullptr;
+        if (cur == item)
+        {
+            cur = head;
+            curSent = 0;
+        }
+        headAcked = 0;
+        if (item->frame->cap && spareCount < NUSOCK_TX_POOL_BLOCKS)
+        {
+            item->frame->len = 0;
+            item->next = spare;
+            spare = item;
+            spareCount++;
+            return;
+        }
+        NuSharedFrame::release(item->frame);
+        free(item);
+    }
 };
 
 /**
@@ -72,17 +736,67 @@ struct NuClient
     char id[32];
     uint8_t *rxBuffer;
     size_t rxLen;
-    uint8_t *txBuffer;
-    size_t txLen;
-    size_t txCap;
+    size_t rxPos = 0; // Read cursor, bytes before it are consumed
+    size_t rxCap = 0; // Receive buffer capacity
+
+    // Outgoing frames, sent in order (see txPeek/txConsume)
+    NuTxQueue txQueue;
+
+    // Outgoing control frames (Ping, Pong, Close), sent ahead of txQueue at frame boundaries
+    NuTxQueue ctrlQueue;
+    size_t txFrameLeft = 0;     // Unwritten bytes of the txQueue frame being written, 0 at a boundary
+    bool txCloseQueued = false; // No data frame may follow the queued Close frame
+
+#ifdef NUSOCK_USE_LWIP
+    // Preallocated flush and close messages for the network thread
+    NuCallbackMsg flushMsg;
+    NuCallbackMsg closeMsg;
+    bool closeRequested = false; // Retried from the poll callback until it has run
+
+    // Received data the parser could not take yet, not acknowledged to the peer
+    // (its TCP window stays closed). Parsed again from the poll callback.
+    struct pbuf *rxHeld = nullptr;
+    size_t rxHeldOffset = 0; // Bytes of rxHeld already consumed
+#endif
+
+    // Client tables (NuClientTable) and queued events (NuEventQueue) referring to the
+    // client, a detached client is deleted once the last one has let go of it.
+    // Changed under the owner's lock.
+    uint16_t refs = 0;
+    bool detached = false;
+
+    // Guards the transmit queues and the state against sends from other tasks
+    NuLock txLock;
+
+    // A send was rejected by the high watermark, WRITABLE is pending
+    bool txBlocked = false;
+
+    // Closed by the slow-consumer policy, removed by the owner's loop (secure server)
+    bool txOverflow = false;
 
     // Stores the opcode of the FIRST fragment (1=Text, 2=Binary)
     // 0 = No active fragmentation
+    // As of the event being delivered, the parser keeps its own in rxFrame
     uint8_t fragmentOpcode = 0;
 
+    // Payload bytes received so far of the current message (for the message size limit)
+    size_t rxMessageLen = 0;
+
     // UTF-8 Validation State (0 = Accept)
     uint32_t utf8State = 0; // 0 = NuUTF8::UTF8_ACCEPT
 
+    // Frame parser state
+    NuFrameState rxFrame;
+
+    // The parser stops before the next frame until the receiver is resumed (dispatch queue full)
+    bool rxPaused = false;
+
+    // Chunk information of the STREAM_CHUNK event being delivered
+    NuStreamInfo rxStream;
+
+    // Buffer settings of the owner at the time the connection was opened
+    NuBufferConfig bufferConfig;
+
     enum State
     {
         STATE_SSL_HANDSHAKE,
@@ -97,33 +811,49 @@ struct NuClient
 
 #ifdef NUSOCK_USE_LWIP
     template <typename Server>
-    NuClient(Server *s, struct tcp_pcb *p)
-        : server((void *)s), isSecure(false), pcb(p), rxLen(0), txLen(0), txCap(0), state(STATE_HANDSHAKE)
+    NuClient(Server *s, struct tcp_pcb *p, const NuBufferConfig &config = NuBufferConfig())
+        : server((void *)s), isSecure(false), pcb(p), rxLen(0), bufferConfig(config), state(STATE_HANDSHAKE)
     {
-        rxBuffer = (uint8_t *)malloc(MAX_WS_BUFFER);
-        txBuffer = nullptr;
+        rxCap = config.handshakeBufferSize ? config.handshakeBufferSize : MAX_WS_BUFFER;
+        rxBuffer = (uint8_t *)malloc(rxCap);
+        if (!rxBuffer)
+            rxCap = 0;
+        if (config.txBlockSize)
+            txQueue.blockSize = config.txBlockSize;
+        ctrlQueue.blockSize = NUSOCK_TX_CONTROL_BLOCK_SIZE;
         id[0] = 0;
     }
 #else
     template <typename Server>
-    NuClient(Server *s, Client *c, bool owns = true)
-        : server((void *)s), isSecure(false), client(c), isConnected(true), ownsClient(owns), rxLen(0), txLen(0), txCap(0), state(STATE_HANDSHAKE)
+    NuClient(Server *s, Client *c, bool owns = true, const NuBufferConfig &config = NuBufferConfig())
+        : server((void *)s), isSecure(false), client(c), isConnected(true), ownsClient(owns), rxLen(0), bufferConfig(config), state(STATE_HANDSHAKE)
     {
-        rxBuffer = (uint8_t *)malloc(MAX_WS_BUFFER);
-        txBuffer = nullptr;
+        rxCap = config.handshakeBufferSize ? config.handshakeBufferSize : MAX_WS_BUFFER;
+        rxBuffer = (uint8_t *)malloc(rxCap);
+        if (!rxBuffer)
+            rxCap = 0;
+        if (config.txBlockSize)
+            txQueue.blockSize = config.txBlockSize;
+        ctrlQueue.blockSize = NUSOCK_TX_CONTROL_BLOCK_SIZE;
         id[0] = 0;
     }
 #endif
 
     ~NuClient()
     {
+#ifdef NUSOCK_USE_LWIP
+        // Cancel the queued callbacks and wait for a running one before anything is freed
+        flushMsg.release();
+        closeMsg.release();
+#endif
         if (rxBuffer)
             free(rxBuffer);
         rxBuffer = nullptr;
-        if (txBuffer)
-            free(txBuffer);
-        txBuffer = nullptr;
-#ifndef NUSOCK_USE_LWIP
+#ifdef NUSOCK_USE_LWIP
+        if (rxHeld)
+            pbuf_free(rxHeld);
+        rxHeld = nullptr;
+#else
         if (client)
         {
             client->stop();
@@ -142,24 +872,651 @@ struct NuClient
 #endif
     }
 
-    void appendTx(uint8_t b)
+    /**
+     * @brief Queue a shared frame (takes a reference).
+     * @param droppable The frame holds whole messages the slow-consumer policy may drop.
+     * @param key Latest-wins key, 0 for none.
+     * @param payload Flash payload following the frame (takes a reference), nullptr for none.
+     * @return false if out of memory (nothing is queued).
+     */
+    bool queueShared(NuSharedFrame *frame, bool droppable = false, uint32_t key = 0, NuSharedFrame *payload = nullptr)
+    {
+        if (!txQueue.push(frame, droppable, key, payload))
+            return false;
+        frame->retain();
+        if (payload)
+            payload->retain();
+        return true;
+    }
+
+    /**
+     * @brief Get the next contiguous bytes to send.
+     * Queued control frames go first as soon as the data frame being written is
+     * complete, so a Pong does not wait behind bulk data.
+     * Flash payloads are returned in chunks of NUSOCK_PROGMEM_CHUNK_SIZE bytes
+     * copied to RAM where flash is not directly readable (AVR, ESP8266).
+     * @param len Set to the number of bytes at the returned pointer.
+     * @param copy Set to true if the transport must copy the bytes: control frames
+     * are not held until acknowledged, flash chunks are reused by the next call.
+     * @return const uint8_t* The data, or nullptr if nothing is pending.
+     */
+    const uint8_t *txPeek(size_t &len, bool *copy = nullptr)
+    {
+        bool ctrl = txControlFirst();
+        if (copy)
+            *copy = ctrl;
+        if (ctrl)
+            return ctrlQueue.peek(len);
+        if (txFrameLeft == 0 && txCloseQueued)
+        {
+            len = 0;
+            return nullptr;
+        }
+        bool progmem = false;
+        const uint8_t *data = txQueue.peek(len, &progmem);
+        if (data && txFrameLeft > 0 && len > txFrameLeft && ctrlQueue.pending())
+            len = txFrameLeft; // Stop at the frame boundary
+        if (data && progmem)
+        {
+            if (copy)
+                *copy = true;
+#if defined(NUSOCK_PROGMEM_COPY)
+            static uint8_t chunk[NUSOCK_PROGMEM_CHUNK_SIZE];
+            if (len > sizeof(chunk))
+                len = sizeof(chunk);
+            memcpy_P(chunk, data, len);
+            data = chunk;
+#endif
+        }
+        return data;
+    }
+
+    /**
+     * @brief Mark bytes returned by txPeek() as sent (at most the peeked length).
+     * Drained blocks and frames are released, or once they have been acknowledged
+     * when txQueue.holdUntilAck is set.
+     */
+    void txConsume(size_t len)
     {
-        if (txLen >= txCap)
+        if (txControlFirst())
         {
-            size_t newCap = (txCap == 0) ? 64 : txCap * 2;
-            uint8_t *newBuf = (uint8_t *)realloc(txBuffer, newCap);
-            if (!newBuf)
-                return;
-            txBuffer = newBuf;
-            txCap = newCap;
+            ctrlQueue.consume(len);
+            if (txQueue.holdUntilAck)
+                txQueue.skip(len);
+            return;
+        }
+        // Track the frame boundaries of the written data
+        while (len > 0)
+        {
+            if (txFrameLeft == 0)
+                txFrameLeft = txFrameSize();
+            size_t n = len < txFrameLeft ? len : txFrameLeft;
+            if (n == 0)
+                n = len;
+            txQueue.consume(n);
+            txFrameLeft -= (n < txFrameLeft) ? n : txFrameLeft;
+            len -= n;
         }
-        txBuffer[txLen++] = b;
     }
 
-    void clearTx()
+    /**
+     * @brief Check if any data is waiting to be sent.
+     */
+    bool txPending() const
+    {
+        return ctrlQueue.pending() || (txQueue.pending() && (txFrameLeft > 0 || !txCloseQueued));
+    }
+
+    /**
+     * @brief Check if a message of len encoded bytes (frame headers included, see
+     * NuFrameBuilder::encodedLength()) may be queued (bufferConfig.txHighWatermark).
+     * An empty queue always accepts, so a message larger than the watermark is not
+     * rejected forever. Above the watermark the slow-consumer policy applies: a
+     * blocking rejection arms the WRITABLE event (see txWritable()), the drop
+     * policies make room by dropping unsent droppable messages.
+     * @param policy Slow-consumer policy of the owner.
+     * @param key Latest-wins key of the message, 0 for none.
+     * @param stats Counters to update, may be nullptr.
+     * @return false if the message must not be queued (SLOW_CONSUMER_CLOSE: the
+     * caller closes the connection).
+     */
+    bool txAdmit(size_t len, NuSlowConsumerPolicy policy = SLOW_CONSUMER_BLOCK, uint32_t key = 0, NuSlowConsumerStats *stats = nullptr)
+    {
+        size_t high = bufferConfig.txHighWatermark;
+        if (high == 0 || txQueue.bytes == 0 || txQueue.bytes + len <= high)
+            return true;
+        NuSlowConsumerStats unused;
+        if (!stats)
+            stats = &unused;
+        switch (policy)
+        {
+        case SLOW_CONSUMER_LATEST_WINS:
+            stats->replaced += txQueue.dropKey(key);
+            // Fall through - drop the oldest if still above the watermark
+        case SLOW_CONSUMER_DROP_OLDEST:
+            while (txQueue.bytes + len > high && txQueue.dropOldest() > 0)
+                stats->dropped++;
+            if (txQueue.bytes == 0 || txQueue.bytes + len <= high)
+                return true;
+            stats->dropped++; // The new message itself
+            return false;
+        case SLOW_CONSUMER_CLOSE:
+            stats->closed++;
+            return false;
+        default:
+            stats->rejected++;
+            txBlocked = true;
+            return false;
+        }
+    }
+
+    /**
+     * @brief Check if the queue has drained to the low watermark after a rejected send.
+     * @return true once per rejection, when the WRITABLE event should be fired.
+     */
+    bool txWritable()
+    {
+        if (!txBlocked || txQueue.bytes > bufferConfig.txLowWatermark)
+            return false;
+        txBlocked = false;
+        return true;
+    }
+
+    // Control frames go next: at a data frame boundary, and the ack order can be recorded
+    bool txControlFirst() const
     {
-        txLen = 0;
+        return txFrameLeft == 0 && ctrlQueue.pending() && (!txQueue.holdUntilAck || txQueue.canSkip());
+    }
+
+    // Size of the queued data frame at the write cursor, from its header
+    size_t txFrameSize() const
+    {
+        uint8_t h[10];
+        size_t n = txQueue.copyPending(h, sizeof(h));
+        if (n < 2)
+            return 0;
+        size_t headerSize = 2;
+        uint64_t len = h[1] & 0x7F;
+        if (len == 126 && n >= 4)
+        {
+            len = ((uint16_t)h[2] << 8) | h[3];
+            headerSize = 4;
+        }
+        else if (len == 127 && n >= 10)
+        {
+            len = 0;
+            for (int i = 2; i < 10; i++)
+                len = (len << 8) | h[i];
+            headerSize = 10;
+        }
+        if (h[1] & 0x80)
+            headerSize += 4; // Masking key
+        return headerSize + (size_t)len;
+    }
+
+    /**
+     * @brief Pointer to the first unconsumed byte of the receive buffer.
+     */
+    uint8_t *rxData() { return rxBuffer + rxPos; }
+
+    /**
+     * @brief Number of unconsumed bytes in the receive buffer.
+     */
+    size_t rxAvailable() const { return rxLen - rxPos; }
+
+    /**
+     * @brief Get the free space at the end of the receive buffer.
+     * The unconsumed bytes are moved to the front only when the free space
+     * is smaller than the requested length.
+     * @return size_t Number of bytes that can be written at rxBuffer + rxLen.
+     */
+    size_t reserveRx(size_t len)
+    {
+        if (!rxBuffer)
+            return 0;
+        if (rxCap - rxLen < len && rxPos > 0)
+        {
+            rxLen -= rxPos;
+            memmove(rxBuffer, rxBuffer + rxPos, rxLen);
+            rxPos = 0;
+        }
+        return rxCap - rxLen;
+    }
+
+    /**
+     * @brief Expose the parser's message state (fragmentOpcode, rxStream) to the
+     * callback of the event being delivered. In dispatch mode the copy queued
+     * with the event is delivered instead (NuEventQueue::Item::publish()).
+     */
+    void publishRx()
+    {
+        fragmentOpcode = rxFrame.fragmentOpcode;
+        rxStream = rxFrame.stream;
+    }
+
+    /**
+     * @brief Resize the receive buffer, keeping the unconsumed bytes.
+     * Used to switch from the handshake buffer to the frame buffer,
+     * never smaller than NUSOCK_MIN_FRAME_BUFFER.
+     * @return false if out of memory (the current buffer is kept).
+     */
+    bool resizeRx(size_t cap)
+    {
+        if (!rxBuffer)
+            return false;
+        if (cap > 0 && cap < NUSOCK_MIN_FRAME_BUFFER)
+            cap = NUSOCK_MIN_FRAME_BUFFER;
+        size_t avail = rxAvailable();
+        if (cap < avail)
+            cap = avail;
+        if (rxPos > 0)
+        {
+            memmove(rxBuffer, rxBuffer + rxPos, avail);
+            rxLen = avail;
+            rxPos = 0;
+        }
+        if (cap == rxCap || cap == 0)
+            return true;
+        uint8_t *newBuf = (uint8_t *)realloc(rxBuffer, cap);
+        if (!newBuf)
+            return false;
+        rxBuffer = newBuf;
+        rxCap = cap;
+        return true;
+    }
+
+    /**
+     * @brief Append received bytes to the receive buffer.
+     * @return size_t Number of bytes accepted (limited by the free space).
+     */
+    size_t appendRx(const uint8_t *data, size_t len)
+    {
+        size_t room = reserveRx(len);
+        if (len > room)
+            len = room;
+        if (len > 0)
+        {
+            memcpy(rxBuffer + rxLen, data, len);
+            rxLen += len;
+        }
+        return len;
+    }
+
+    /**
+     * @brief Consume bytes from the front of the receive buffer.
+     * Only the read cursor moves, the buffer is rewound once it is drained.
+     */
+    void consumeRx(size_t len)
+    {
+        rxPos += len;
+        if (rxPos >= rxLen)
+            rxPos = rxLen = 0;
     }
 };
 
+/**
+ * @brief Copy-on-write table of the clients of a server.
+ * Adding or removing a client publishes a new table under the owner's lock, so a
+ * sender, a broadcast or the I/O loop traverses a View of the table without holding
+ * any lock while it works. A removed client is marked detached and deleted once no
+ * table (and no queued event) refers to it any more.
+ */
+class NuClientTable
+{
+public:
+    struct Table
+    {
+        uint16_t refs; // Views and the owner (while current)
+        uint16_t count;
+        NuClient *slots[1]; // Allocated with count slots
+        NuClient **items() { return slots; }
+    };
+
+    /**
+     * @brief Reference to the table at the time it was taken.
+     * Removed clients stay valid (detached) until the view is released.
+     */
+    class View
+    {
+    public:
+        View(NuClientTable &owner) : _owner(&owner), _table(owner.acquire()) {}
+        View(const View &) = delete;
+        View &operator=(const View &) = delete;
+        ~View() { _owner->release(_table); }
+
+        size_t size() const { return _table ? _table->count : 0; }
+        NuClient *operator[](size_t i) const { return _table->items()[i]; }
+
+        /**
+         * @brief The client at index, nullptr if out of range or removed.
+         */
+        NuClient *at(int index) const
+        {
+            if (index < 0 || (size_t)index >= size())
+                return nullptr;
+            NuClient *c = _table->items()[index];
+            return c->detached ? nullptr : c;
+        }
+
+        /**
+         * @brief Check if the client is in the table (and not removed).
+         */
+        bool contains(const NuClient *c) const
+        {
+            for (size_t i = 0; i < size(); i++)
+            {
+                if (_table->items()[i] == c)
+                    return !c->detached;
+            }
+            return false;
+        }
+
+    private:
+        NuClientTable *_owner;
+        Table *_table;
+    };
+
+    NuClientTable(NuLock &lock) : _lock(lock) {}
+    NuClientTable(const NuClientTable &) = delete;
+    NuClientTable &operator=(const NuClientTable &) = delete;
+    ~NuClientTable() { clear(); }
+
+    size_t size()
+    {
+        _lock.lock();
+        size_t n = _current ? _current->count : 0;
+        _lock.unlock();
+        return n;
+    }
+
+    /**
+     * @brief Append a client (takes ownership).
+     * @return false if out of memory, the client is not added.
+     */
+    bool add(NuClient *c)
+    {
+        _lock.lock();
+        size_t n = _current ? _current->count : 0;
+        Table *t = create(n + 1);
+        if (!t)
+        {
+            _lock.unlock();
+            return false;
+        }
+        for (size_t i = 0; i < n; i++)
+            t->items()[i] = _current->items()[i];
+        t->items()[n] = c;
+        Table *old = publish(t);
+        _lock.unlock();
+        dispose(old);
+        return true;
+    }
+
+    /**
+     * @brief Remove a client, it is deleted once no view or queued event refers to it.
+     * Marks the client detached even if the new table cannot be allocated (views skip it
+     * with at() and contains()), it is then dropped with the next change.
+     * Removing a client that is not in the table does nothing.
+     */
+    void remove(NuClient *c)
+    {
+        _lock.lock();
+        size_t n = _current ? _current->count : 0, live = 0;
+        bool found = false;
+        for (size_t i = 0; i < n; i++)
+        {
+            NuClient *item = _current->items()[i];
+            if (item == c)
+                found = true;
+            else if (!item->detached)
+                live++;
+        }
+        if (!found)
+        {
+            _lock.unlock();
+            return;
+        }
+        c->detached = true;
+        Table *old = nullptr;
+        Table *t = create(live);
+        if (t)
+        {
+            size_t k = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                NuClient *item = _current->items()[i];
+                if (!item->detached)
+                    t->items()[k++] = item;
+            }
+            old = publish(t);
+        }
+        _lock.unlock();
+        dispose(old);
+    }
+
+    /**
+     * @brief Remove all clients.
+     */
+    void clear()
+    {
+        _lock.lock();
+        Table *old = nullptr;
+        if (_current)
+        {
+            for (size_t i = 0; i < _current->count; i++)
+                _current->items()[i]->detached = true;
+            old = publish(nullptr);
+        }
+        _lock.unlock();
+        dispose(old);
+    }
+
+private:
+    NuLock &_lock;
+    Table *_current = nullptr;
+
+    static Table *create(size_t count)
+    {
+        Table *t = (Table *)malloc(sizeof(Table) + (count > 1 ? count - 1 : 0) * sizeof(NuClient *));
+        if (!t)
+            return nullptr;
+        t->refs = 1;
+        t->count = count;
+        return t;
+    }
+
+    // Make t the current table (under the lock), the clients it holds gain a reference.
+    // Returns the previous table if it is to be disposed (see drop()).
+    Table *publish(Table *t)
+    {
+        if (t)
+        {
+            for (size_t i = 0; i < t->count; i++)
+            {
+                t->items()[i]->index = i;
+                t->items()[i]->refs++;
+            }
+        }
+        Table *old = _current;
+        _current = t;
+        return drop(old);
+    }
+
+    Table *acquire()
+    {
+        _lock.lock();
+        Table *t = _current;
+        if (t)
+            t->refs++;
+        _lock.unlock();
+        return t;
+    }
+
+    void release(Table *t)
+    {
+        if (!t)
+            return;
+        _lock.lock();
+        Table *old = drop(t);
+        _lock.unlock();
+        dispose(old);
+    }
+
+    // Drop a table reference (under the lock). Returns the table if this was the last
+    // reference, its slots then hold only the clients nothing refers to any more.
+    static Table *drop(Table *t)
+    {
+        if (!t || --t->refs > 0)
+            return nullptr;
+        for (size_t i = 0; i < t->count; i++)
+        {
+            NuClient *c = t->items()[i];
+            if (--c->refs > 0 || !c->detached)
+                t->items()[i] = nullptr;
+        }
+        return t;
+    }
+
+    // Delete the clients of a dropped table and free it. Called without the lock: a client
+    // waits for its running network callbacks, which may take the lock, when it is deleted.
+    static void dispose(Table *t)
+    {
+        if (!t)
+            return;
+        for (size_t i = 0; i < t->count; i++)
+        {
+            if (t->items()[i])
+            {
+                delete t->items()[i];
+            }
+        }
+        free(t);
+    }
+};
+
+#ifdef NUSOCK_DISPATCH
+/**
+ * @brief Bounded queue of events for dispatch mode (LwIP, network task).
+ * The network thread or task queues the events with a copy of their payload and
+ * loop() runs the callbacks on the application task. Once the queued payloads reach the
+ * limit, the receivers are paused (NuClient::rxPaused) until loop() has caught up.
+ * Accessed under the owner's lock.
+ */
+class NuEventQueue
+{
+public:
+    struct Item
+    {
+        Item *next;
+        NuClient *client;
+        int event;
+        size_t len;
+        uint8_t fragmentOpcode; // Message state of the parser when the event was queued
+        NuStreamInfo stream;
+        uint8_t *data() { return (uint8_t *)(this + 1); }
+
+        // Deliver the message state of this event (NuClient::publishRx())
+        void publish()
+        {
+            client->fragmentOpcode = fragmentOpcode;
+            client->rxStream = stream;
+        }
+    };
+
+    size_t limit = 0;     // Payload bytes before the receivers are paused, 0 = disabled
+    size_t bytes = 0;     // Payload bytes queued
+    size_t count = 0;     // Events queued
+    uint32_t dropped = 0; // Events lost (out of memory)
+    bool paused = false;  // A receiver has been paused since the last resume
+
+    NuEventQueue() {}
+    NuEventQueue(const NuEventQueue &) = delete;
+    NuEventQueue &operator=(const NuEventQueue &) = delete;
+    ~NuEventQueue() { clear(); }
+
+    bool enabled() const { return limit > 0; }
+    bool full() const { return limit > 0 && bytes >= limit; }
+
+    /**
+     * @brief Queue an event with a copy of its payload (takes a client reference).
+     * @return false if out of memory (counted in dropped).
+     */
+    bool push(NuClient *c, int event, const uint8_t *data, size_t len)
+    {
+        Item *e = (Item *)malloc(sizeof(Item) + len);
+        if (!e)
+        {
+            dropped++;
+            return false;
+        }
+        e->next = nullptr;
+        e->client = c;
+        e->event = event;
+        e->len = len;
+        e->fragmentOpcode = c ? c->rxFrame.fragmentOpcode : 0;
+        e->stream = c ? c->rxFrame.stream : NuStreamInfo();
+        if (len > 0)
+            memcpy(e->data(), data, len);
+        if (_tail)
+            _tail->next = e;
+        else
+            _head = e;
+        _tail = e;
+        bytes += len;
+        count++;
+        if (c)
+            c->refs++;
+        return true;
+    }
+
+    /**
+     * @brief Dequeue the oldest event, nullptr if empty. Free it with release().
+     */
+    Item *pop()
+    {
+        Item *e = _head;
+        if (!e)
+            return nullptr;
+        _head = e->next;
+        if (!_head)
+            _tail = nullptr;
+        bytes -= e->len;
+        count--;
+        return e;
+    }
+
+    /**
+     * @brief Free a dequeued event and drop its client reference.
+     * @return The client to delete (detached and no events left), else nullptr.
+     */
+    static NuClient *release(Item *e)
+    {
+        NuClient *c = e->client;
+        free(e);
+        if (c && --c->refs == 0 && c->detached)
+            return c;
+        return nullptr;
+    }
+
+    /**
+     * @brief Discard the queued events, deleting the detached clients they held.
+     */
+    void clear()
+    {
+        Item *e;
+        while ((e = pop()) != nullptr)
+        {
+            NuClient *c = release(e);
+            if (c)
+                delete c;
+        }
+        paused = false;
+    }
+
+private:
+    Item *_head = nullptr;
+    Item *_tail = nullptr;
+};
+#endif
+
 #endif
\ No newline at end of file
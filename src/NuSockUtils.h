@@ -9,6 +9,28 @@
 
 #include "NuSockConfig.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Vectorized UTF-8 validation (host builds with SSSE3 or AArch64 NEON)
+#if defined(__SSSE3__) || (defined(__ARM_NEON) && defined(__aarch64__))
+#define NUSOCK_UTF8_SIMD
+#endif
+
+// 32-bit word allowed to alias byte buffers (word at a time kernels)
+#if defined(__GNUC__)
+typedef uint32_t __attribute__((__may_alias__)) NuWord32;
+#else
+typedef uint32_t NuWord32;
+#endif
+
 class NuUTF8
 {
 public:
@@ -16,7 +38,10 @@ public:
     static const uint32_t UTF8_REJECT = 1;
 
     /**
-     * @brief Validates a stream of bytes as UTF-8 using a state machine.
+     * @brief Validates a stream of bytes as UTF-8.
+     * Host builds with SSSE3/NEON validate 16 bytes per step with the lookup
+     * algorithm (Keiser & Lemire), other builds skip ASCII a 32-bit word at a time.
+     * The state machine handles sequences spanning calls and the remaining bytes.
      * @param state Reference to the current state (initialize to UTF8_ACCEPT).
      * @param data Pointer to the data buffer.
      * @param len Length of the data.
@@ -24,6 +49,325 @@ public:
      * @return false if an invalid sequence was encountered.
      */
     static bool validate(uint32_t &state, const uint8_t *data, size_t len)
+    {
+        size_t i = 0;
+
+        // Finish a sequence left open by the previous call
+        while (i < len && state != UTF8_ACCEPT)
+        {
+            if (!step(state, data[i]))
+                return false;
+            i++;
+        }
+
+#if defined(NUSOCK_UTF8_SIMD)
+        if (len - i >= 16)
+        {
+            // The vector kernel only sees complete characters, a trailing
+            // (possibly incomplete) one is left to the state machine.
+            size_t end = boundary(data, i, len);
+            if (!validateBlocks(data + i, end - i))
+            {
+                state = UTF8_REJECT;
+                return false;
+            }
+            i = end;
+        }
+#else
+        // SWAR: 4 bytes per step while the data is ASCII
+        while (i < len && ((uintptr_t)(data + i) & 3))
+        {
+            if (!step(state, data[i]))
+                return false;
+            i++;
+        }
+        // Local copy, the state would otherwise be reloaded after every byte
+        // (it may alias the data).
+        uint32_t s = state;
+        for (; len - i >= 4; i += 4)
+        {
+            uint32_t w = *(const NuWord32 *)(data + i);
+            if (s == UTF8_ACCEPT && (w & 0x80808080UL) == 0)
+                continue;
+
+            // REJECT is a sink state, check it once per word
+            step(s, data[i]);
+            step(s, data[i + 1]);
+            step(s, data[i + 2]);
+            if (!step(s, data[i + 3]))
+            {
+                state = s;
+                return false;
+            }
+        }
+        state = s;
+#endif
+
+        for (; i < len; i++)
+        {
+            if (!step(state, data[i]))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Validates a stream of bytes as UTF-8, one byte at a time with the
+     * state machine only (reference implementation).
+     * @param state Reference to the current state (initialize to UTF8_ACCEPT).
+     * @param data Pointer to the data buffer.
+     * @param len Length of the data.
+     * @return true if the processed data is valid so far.
+     * @return false if an invalid sequence was encountered.
+     */
+    static bool validateDFA(uint32_t &state, const uint8_t *data, size_t len)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            if (!step(state, data[i]))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Unmasks data in place and validates it as UTF-8 in the same pass.
+     * ASCII runs are skipped a word at a time, the state machine only runs on
+     * words with non-ASCII bytes or while a multi-byte sequence is pending.
+     * The state is kept across calls like validate().
+     * @param state Reference to the current state (initialize to UTF8_ACCEPT).
+     * @param data Pointer to the data buffer.
+     * @param len Length of the data.
+     * @param mask The 4-byte masking key, nullptr if the data is not masked.
+     * @param phase Offset of data[0] in the frame payload (for payloads processed in chunks).
+     * @return true if the processed data is valid so far.
+     * @return false if an invalid sequence was encountered.
+     */
+    static bool unmaskValidate(uint32_t &state, uint8_t *data, size_t len, const uint8_t *mask, size_t phase = 0)
+    {
+        if (!mask)
+            return validate(state, data, len);
+
+        size_t i = 0;
+
+        // Unaligned head
+        while (i < len && ((uintptr_t)(data + i) & 3))
+        {
+            data[i] ^= mask[(phase + i) & 3];
+            if (!step(state, data[i]))
+                return false;
+            i++;
+        }
+
+        uint8_t k[4];
+        for (int j = 0; j < 4; j++)
+            k[j] = mask[(phase + i + j) & 3];
+        uint32_t key32;
+        memcpy(&key32, k, 4);
+
+        for (; len - i >= 4; i += 4)
+        {
+            NuWord32 *p = (NuWord32 *)(data + i);
+            uint32_t w = *p ^ key32;
+            *p = w;
+
+            // ASCII word with no pending sequence
+            if (state == UTF8_ACCEPT && (w & 0x80808080UL) == 0)
+                continue;
+
+            for (int j = 0; j < 4; j++)
+            {
+                if (!step(state, data[i + j]))
+                    return false;
+            }
+        }
+
+        // Tail
+        for (; i < len; i++)
+        {
+            data[i] ^= mask[(phase + i) & 3];
+            if (!step(state, data[i]))
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Checks if the UTF-8 sequence is complete (ends in ACCEPT state).
+     * This must be called at the end of a message (FIN=1) to ensure no
+     * partial characters remain.
+     * @param state The current validation state.
+     * @return true if the state is ACCEPT (0).
+     */
+    static bool isComplete(uint32_t state) {
+        return state == UTF8_ACCEPT;
+    }
+
+private:
+#if defined(NUSOCK_UTF8_SIMD)
+    // Error bits of the lookup algorithm (byte 1 high nibble, byte 1 low nibble, byte 2 high nibble)
+    enum
+    {
+        TOO_SHORT = 1 << 0,      // 11______ 0_______ or 11______ 11______
+        TOO_LONG = 1 << 1,       // 0_______ 10______
+        OVERLONG_3 = 1 << 2,     // 11100000 100_____
+        TOO_LARGE = 1 << 3,      // 11110100 1001____ or 11110100 101_____
+        SURROGATE = 1 << 4,      // 11101101 101_____
+        OVERLONG_2 = 1 << 5,     // 1100000_ 10______
+        TOO_LARGE_1000 = 1 << 6, // 11110101+ 1000____
+        OVERLONG_4 = 1 << 6,     // 11110000 1000____
+        TWO_CONTS = 1 << 7,      // 10______ 10______
+        CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+    };
+
+    // End of the data without its last character (if it is not ASCII), so that
+    // [start, end) holds complete characters when the data is valid.
+    static size_t boundary(const uint8_t *data, size_t start, size_t len)
+    {
+        size_t end = len;
+        for (int k = 0; k < 3 && end > start && (data[end - 1] & 0xC0) == 0x80; k++)
+            end--;
+        if (end > start && data[end - 1] >= 0xC0)
+            end--;
+        return end;
+    }
+
+#define NU_UTF8_BYTE1_HIGH                                              \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,         \
+        TOO_LONG, TOO_LONG, TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+        TOO_SHORT | OVERLONG_2, TOO_SHORT,                              \
+        TOO_SHORT | OVERLONG_3 | SURROGATE,                             \
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define NU_UTF8_BYTE1_LOW                                                                          \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,                \
+        CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,                    \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,                    \
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,                    \
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000,        \
+        CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define NU_UTF8_BYTE2_HIGH                                                                           \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,          \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,                 \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,                                  \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,                                   \
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+        TOO_SHORT
+
+    // Validates complete characters 16 bytes at a time (lookup algorithm).
+    static bool validateBlocks(const uint8_t *data, size_t len)
+    {
+        static const uint8_t byte1High[16] = {NU_UTF8_BYTE1_HIGH};
+        static const uint8_t byte1Low[16] = {NU_UTF8_BYTE1_LOW};
+        static const uint8_t byte2High[16] = {NU_UTF8_BYTE2_HIGH};
+        // Bytes that leave a sequence open at the end of a block
+        static const uint8_t maxValue[16] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                             0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF};
+        uint8_t tail[16];
+
+#if defined(__SSSE3__)
+        const __m128i t1h = _mm_loadu_si128((const __m128i *)byte1High);
+        const __m128i t1l = _mm_loadu_si128((const __m128i *)byte1Low);
+        const __m128i t2h = _mm_loadu_si128((const __m128i *)byte2High);
+        const __m128i maxv = _mm_loadu_si128((const __m128i *)maxValue);
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        __m128i prev = _mm_setzero_si128();
+        __m128i prevIncomplete = _mm_setzero_si128();
+        __m128i error = _mm_setzero_si128();
+
+        for (size_t i = 0; i < len; i += 16)
+        {
+            const uint8_t *p = data + i;
+            if (len - i < 16)
+            {
+                // Zero padding (ASCII) also flags a sequence cut at the end
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, p, len - i);
+                p = tail;
+            }
+            __m128i in = _mm_loadu_si128((const __m128i *)p);
+
+            if (_mm_movemask_epi8(in) == 0)
+                error = _mm_or_si128(error, prevIncomplete);
+            else
+            {
+                __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+                __m128i sc = _mm_and_si128(_mm_and_si128(
+                                               _mm_shuffle_epi8(t1h, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                                               _mm_shuffle_epi8(t1l, _mm_and_si128(prev1, nibble))),
+                                           _mm_shuffle_epi8(t2h, _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+                // Third and fourth bytes of 3/4 byte sequences must be continuations
+                __m128i prev2 = _mm_alignr_epi8(in, prev, 14);
+                __m128i prev3 = _mm_alignr_epi8(in, prev, 13);
+                __m128i must23 = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80)),
+                                              _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80)));
+                must23 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+
+                error = _mm_or_si128(error, _mm_xor_si128(must23, sc));
+                prevIncomplete = _mm_subs_epu8(in, maxv);
+            }
+            prev = in;
+        }
+        error = _mm_or_si128(error, prevIncomplete);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+#else // AArch64 NEON
+        const uint8x16_t t1h = vld1q_u8(byte1High);
+        const uint8x16_t t1l = vld1q_u8(byte1Low);
+        const uint8x16_t t2h = vld1q_u8(byte2High);
+        const uint8x16_t maxv = vld1q_u8(maxValue);
+        const uint8x16_t nibble = vdupq_n_u8(0x0F);
+        uint8x16_t prev = vdupq_n_u8(0);
+        uint8x16_t prevIncomplete = vdupq_n_u8(0);
+        uint8x16_t error = vdupq_n_u8(0);
+
+        for (size_t i = 0; i < len; i += 16)
+        {
+            const uint8_t *p = data + i;
+            if (len - i < 16)
+            {
+                // Zero padding (ASCII) also flags a sequence cut at the end
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, p, len - i);
+                p = tail;
+            }
+            uint8x16_t in = vld1q_u8(p);
+
+            if (vmaxvq_u8(in) < 0x80)
+                error = vorrq_u8(error, prevIncomplete);
+            else
+            {
+                uint8x16_t prev1 = vextq_u8(prev, in, 15);
+                uint8x16_t sc = vandq_u8(vandq_u8(vqtbl1q_u8(t1h, vshrq_n_u8(prev1, 4)),
+                                                  vqtbl1q_u8(t1l, vandq_u8(prev1, nibble))),
+                                         vqtbl1q_u8(t2h, vshrq_n_u8(in, 4)));
+
+                // Third and fourth bytes of 3/4 byte sequences must be continuations
+                uint8x16_t prev2 = vextq_u8(prev, in, 14);
+                uint8x16_t prev3 = vextq_u8(prev, in, 13);
+                uint8x16_t must23 = vorrq_u8(vqsubq_u8(prev2, vdupq_n_u8(0xE0 - 0x80)),
+                                             vqsubq_u8(prev3, vdupq_n_u8(0xF0 - 0x80)));
+                must23 = vandq_u8(must23, vdupq_n_u8(0x80));
+
+                error = vorrq_u8(error, veorq_u8(must23, sc));
+                prevIncomplete = vqsubq_u8(in, maxv);
+            }
+            prev = in;
+        }
+        error = vorrq_u8(error, prevIncomplete);
+        return vmaxvq_u8(error) == 0;
+#endif
+    }
+
+#undef NU_UTF8_BYTE1_HIGH
+#undef NU_UTF8_BYTE1_LOW
+#undef NU_UTF8_BYTE2_HIGH
+#endif
+
+    // Advances the state machine by one byte, returns false on REJECT.
+    static inline bool step(uint32_t &state, uint8_t byte)
     {
         // Flexible and Economical UTF-8 Decoder (Copyright (c) 2008-2009 Bjoern Hoehrmann)
         static const uint8_t utf8d[] = {
@@ -43,23 +387,113 @@ public:
             1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1  // s7..s8
         };
 
-        for (size_t i = 0; i < len; i++) {
-            uint32_t type = utf8d[data[i]];
-            state = utf8d[256 + state * 16 + type];
-            if (state == UTF8_REJECT) return false;
-        }
-        return true;
+        uint32_t type = utf8d[byte];
+        state = utf8d[256 + state * 16 + type];
+        return state != UTF8_REJECT;
     }
+};
 
+/**
+ * @brief WebSocket masking kernel (RFC 6455 section 5.3).
+ * Masking and unmasking are the same XOR operation. The payload is processed
+ * a word at a time after the unaligned head bytes, with SSE2/AVX2/NEON
+ * vectors on host builds that support them.
+ */
+class NuMask
+{
+public:
     /**
-     * @brief Checks if the UTF-8 sequence is complete (ends in ACCEPT state).
-     * This must be called at the end of a message (FIN=1) to ensure no
-     * partial characters remain.
-     * @param state The current validation state.
-     * @return true if the state is ACCEPT (0).
+     * @brief Mask or unmask data in place.
+     * @param data Pointer to the data buffer.
+     * @param len Length of the data.
+     * @param mask The 4-byte masking key.
+     * @param phase Offset of data[0] in the frame payload (for payloads processed in chunks).
      */
-    static bool isComplete(uint32_t state) {
-        return state == UTF8_ACCEPT;
+    static void apply(uint8_t *data, size_t len, const uint8_t mask[4], size_t phase = 0)
+    {
+        copy(data, data, len, mask, phase);
+    }
+
+    /**
+     * @brief Copy data while masking it (dst[i] = src[i] ^ mask[(phase + i) % 4]).
+     * @param dst Destination buffer (may be the same as src).
+     * @param src Source buffer.
+     * @param len Length of the data.
+     * @param mask The 4-byte masking key.
+     * @param phase Offset of src[0] in the frame payload (for payloads processed in chunks).
+     */
+    static void copy(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t mask[4], size_t phase = 0)
+    {
+        size_t i = 0;
+
+        // Unaligned head, byte by byte until dst is word aligned
+        while (i < len && ((uintptr_t)(dst + i) & 3))
+        {
+            dst[i] = src[i] ^ mask[(phase + i) & 3];
+            i++;
+        }
+
+        if (len - i >= 4)
+        {
+            // Key bytes in memory order for the word at offset i, the pattern repeats every 4 bytes
+            uint8_t k[4];
+            for (int j = 0; j < 4; j++)
+                k[j] = mask[(phase + i + j) & 3];
+
+#if defined(__AVX2__)
+            __m256i key256 = _mm256_set1_epi32(load32(k));
+            for (; len - i >= 32; i += 32)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+                _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(v, key256));
+            }
+#endif
+#if defined(__SSE2__)
+            __m128i key128 = _mm_set1_epi32(load32(k));
+            for (; len - i >= 16; i += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+                _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, key128));
+            }
+#elif defined(__ARM_NEON)
+            uint8x16_t key128 = vreinterpretq_u8_u32(vdupq_n_u32(load32(k)));
+            for (; len - i >= 16; i += 16)
+                vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), key128));
+#endif
+
+            uint32_t key32 = load32(k);
+            if (((uintptr_t)(src + i) & 3) == 0)
+            {
+                // Both aligned (e.g. in place unmask)
+                const NuWord32 *s32 = (const NuWord32 *)(src + i);
+                NuWord32 *d32 = (NuWord32 *)(dst + i);
+                size_t words = (len - i) / 4;
+                for (size_t w = 0; w < words; w++)
+                    d32[w] = s32[w] ^ key32;
+                i += words * 4;
+            }
+            else
+            {
+                for (; len - i >= 4; i += 4)
+                {
+                    uint32_t v = load32(src + i);
+                    v ^= key32;
+                    memcpy(dst + i, &v, 4);
+                }
+            }
+        }
+
+        // Tail
+        for (; i < len; i++)
+            dst[i] = src[i] ^ mask[(phase + i) & 3];
+    }
+
+private:
+    static inline uint32_t load32(const uint8_t *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
     }
 };
 
@@ -75,12 +509,22 @@ public:
     {
 #if defined(ESP32) || defined(ARDUINO_ARCH_ESP32)
         _mutex = xSemaphoreCreateRecursiveMutex();
+#endif
+    }
+    NuLock(const NuLock &) = delete;
+    NuLock &operator=(const NuLock &) = delete;
+    ~NuLock()
+    {
+#if defined(ESP32) || defined(ARDUINO_ARCH_ESP32)
+        if (_mutex)
+            vSemaphoreDelete(_mutex);
 #endif
     }
     void lock()
     {
 #if defined(ESP32) || defined(ARDUINO_ARCH_ESP32)
-        xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+        if (_mutex)
+            xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
 #else
         // Do not disable interrupts on AVR/SAMD/Renesas.
         // It blocks UART communication with WiFi modules (NINA/S3).
@@ -89,7 +533,8 @@ public:
     void unlock()
     {
 #if defined(ESP32) || defined(ARDUINO_ARCH_ESP32)
-        xSemaphoreGiveRecursive(_mutex);
+        if (_mutex)
+            xSemaphoreGiveRecursive(_mutex);
 #else
         // Interrupts remain enabled.
 #endif